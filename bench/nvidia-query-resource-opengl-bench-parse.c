@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Measure the cost of decoding a query result with nvqr_parse_memory_info().
+// A synthetic result of the requested shape is built in memory and parsed
+// repeatedly, so no target process is needed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nvidia-query-resource-opengl.h"
+
+#define TAG_STRING "benchmark-tag"
+#define TAG_STRING_WORDS ((int) ((sizeof(TAG_STRING) + \
+                                  sizeof(NVQRQueryData_t) - 1) / \
+                                 sizeof(NVQRQueryData_t)))
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+static void print_help(const char *progname)
+{
+    printf("Benchmark decoding of OpenGL resource query results\n\n"
+           "Usage: %s [-d devices] [-e details] [-t tags] [-n iterations]\n\n"
+           "  -h: print this help message\n"
+           "  -d <devices>: number of devices in the result (default 1)\n"
+           "  -e <details>: number of detail blocks per device (default 4)\n"
+           "  -t <tags>: number of tags in the result (default 4)\n"
+           "  -n <iterations>: number of times to parse the result "
+           "(default 1000000)\n",
+           progname);
+}
+
+
+//------------------------------------------------------------------------------
+// Build a well-formed result with the given number of blocks. Returns its
+// length in words, or 0 if it could not be allocated.
+static int build_result(int devices, int details, int tags,
+                        NVQRQueryData_t **result)
+{
+    int deviceWords = 6 + details * 5;
+    int tagWords = 6 + TAG_STRING_WORDS;
+    int cnt = 3 + devices * deviceWords + 1 + tags * tagWords;
+    NVQRQueryData_t *data = calloc(cnt, sizeof(*data));
+    NVQRQueryData_t *ptr = data;
+    int i, j;
+
+    if (!data) {
+        return 0;
+    }
+
+    *ptr++ = 3;
+    *ptr++ = NVQR_DATA_FORMAT_VERSION;
+    *ptr++ = devices;
+
+    for (i = 0; i < devices; i++) {
+        *ptr++ = deviceWords;
+        *ptr++ = 6;
+        *ptr++ = details * 10;
+        *ptr++ = details * 1000;
+        *ptr++ = 1 << 20;
+        *ptr++ = details;
+
+        for (j = 0; j < details; j++) {
+            *ptr++ = 5;
+            *ptr++ = GL_QUERY_RESOURCE_MEMTYPE_VIDMEM_NV;
+            *ptr++ = GL_QUERY_RESOURCE_TEXTURE_NV + j % 3;
+            *ptr++ = 10;
+            *ptr++ = 1000;
+        }
+    }
+
+    *ptr++ = tags;
+    for (i = 0; i < tags; i++) {
+        *ptr++ = 6;
+        *ptr++ = i;
+        *ptr++ = devices ? i % devices : 0;
+        *ptr++ = 1;
+        *ptr++ = 100;
+        *ptr++ = TAG_STRING_WORDS;
+        memcpy(ptr, TAG_STRING, sizeof(TAG_STRING));
+        ptr += TAG_STRING_WORDS;
+    }
+
+    *result = data;
+    return cnt;
+}
+
+
+int main(int argc, char **argv)
+{
+    NVQRDeviceRecord *devices;
+    NVQRDetailRecord *details;
+    NVQRTagRecord *tags;
+    NVQRParsedData parsed;
+    NVQRQueryData_t *data = NULL;
+    int num_devices = 1, num_details = 4, num_tags = 4;
+    int iterations = 1000000, cnt, i;
+    long long checksum = 0;
+    double start, elapsed;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            num_devices = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            num_details = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            num_tags = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else {
+            print_help(argv[0]);
+            return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+
+    if (num_devices < 0 || num_details < 0 || num_tags < 0 ||
+        iterations < 1) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    cnt = build_result(num_devices, num_details, num_tags, &data);
+    devices = calloc(num_devices + 1, sizeof(*devices));
+    details = calloc(num_devices * num_details + 1, sizeof(*details));
+    tags = calloc(num_tags + 1, sizeof(*tags));
+    if (!cnt || !devices || !details || !tags) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    memset(&parsed, 0, sizeof(parsed));
+    parsed.devices = devices;
+    parsed.maxDevices = num_devices;
+    parsed.details = details;
+    parsed.maxDetails = num_devices * num_details;
+    parsed.tags = tags;
+    parsed.maxTags = num_tags;
+
+    start = now_us();
+    for (i = 0; i < iterations; i++) {
+        if (nvqr_parse_memory_info(data, cnt, &parsed) != NVQR_SUCCESS) {
+            fprintf(stderr, "Error: failed to parse the result\n");
+            return 1;
+        }
+        // Use the output, so that the parse cannot be optimized away
+        checksum += parsed.numDetails + (num_tags ? tags[0].tagLen : 0);
+    }
+    elapsed = now_us() - start;
+
+    printf("result: %d words, %d devices, %d details, %d tags\n",
+           cnt, parsed.numDevices, parsed.numDetails, parsed.numTags);
+    printf("parsed %d results in %.1f ms: %.1f ns per result, "
+           "%.2f ns per word (checksum %lld)\n",
+           iterations, elapsed / 1e3, elapsed * 1e3 / iterations,
+           elapsed * 1e3 / iterations / cnt, checksum);
+
+    free(data);
+    free(devices);
+    free(details);
+    free(tags);
+
+    return 0;
+}
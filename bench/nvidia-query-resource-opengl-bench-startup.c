@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Measure how much the preload DSO adds to the startup and teardown of the
+// processes it is preloaded into. A target process that exits as soon as it
+// starts (or a given command) is run repeatedly without the DSO, with it, and
+// with it doing all of its initialization eagerly in its constructor, taking
+// turns so that all configurations see the same system noise. Each run is
+// timed from fork(2) until the process has been reaped.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MOCK_GL_LIBRARY "libnvidia-query-resource-opengl-mock-gl.so"
+#define PRELOAD_LIBRARY "libnvidia-query-resource-opengl-preload.so"
+
+#define WARMUP_RUNS 10
+
+typedef enum {
+    CONFIG_NONE,
+    CONFIG_PRELOAD,
+    CONFIG_PRELOAD_EAGER,
+    NUM_CONFIGS
+} StartupConfig;
+
+static const char *const config_names[NUM_CONFIGS] = {
+    "none",
+    "preload",
+    "preload-eager",
+};
+
+typedef struct {
+    char mock[PATH_MAX];
+    char preload[PATH_MAX];
+    char *const *command;
+    bool mock_gl;
+    bool json;
+    int runs;
+} StartupOptions;
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+static void print_help(const char *progname)
+{
+    printf("Benchmark the startup overhead of the preload DSO\n\n"
+           "Usage: %s [-n runs] [-m] [-j] [-- command [args...]]\n\n"
+           "  -h: print this help message\n"
+           "  -n <runs>: number of times to run the target in each "
+           "configuration\n"
+           "             (default 500)\n"
+           "  -m: also preload the mock GL library in every configuration,\n"
+           "      as a stand-in for an application that uses OpenGL\n"
+           "  -j: write results as JSON lines\n"
+           "  command: the target to run (default: a process that exits\n"
+           "           immediately)\n",
+           progname);
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return da < db ? -1 : da > db;
+}
+
+
+//------------------------------------------------------------------------------
+// Find the preload DSO and the mock GL library, which are built into the same
+// directory as this executable.
+static bool find_libraries(StartupOptions *options, const char *self)
+{
+    char path[PATH_MAX], *dir;
+    ssize_t len;
+
+    len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len > 0) {
+        path[len] = '\0';
+    } else if (!realpath(self, path)) {
+        return false;
+    }
+    dir = dirname(path);
+
+    snprintf(options->mock, sizeof(options->mock), "%s/%s",
+             dir, MOCK_GL_LIBRARY);
+    snprintf(options->preload, sizeof(options->preload), "%s/%s",
+             dir, PRELOAD_LIBRARY);
+
+    return access(options->preload, R_OK) == 0 &&
+           (!options->mock_gl || access(options->mock, R_OK) == 0);
+}
+
+
+//------------------------------------------------------------------------------
+// Run the target once in the given configuration, and return how long it took
+// in microseconds, or a negative value if it could not be run or failed.
+static double run_target(const StartupOptions *options, StartupConfig config,
+                         const char *self)
+{
+    char preload[2 * PATH_MAX + 2];
+    double start;
+    pid_t pid;
+    int status;
+
+    preload[0] = '\0';
+    if (options->mock_gl) {
+        snprintf(preload, sizeof(preload), "%s", options->mock);
+    }
+    if (config != CONFIG_NONE) {
+        snprintf(preload + strlen(preload), sizeof(preload) - strlen(preload),
+                 "%s%s", preload[0] ? " " : "", options->preload);
+    }
+
+    start = now_us();
+    pid = fork();
+    if (pid == 0) {
+        if (preload[0]) {
+            setenv("LD_PRELOAD", preload, 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        if (config == CONFIG_PRELOAD_EAGER) {
+            setenv("NVQR_EAGER_INIT", "1", 1);
+        } else {
+            unsetenv("NVQR_EAGER_INIT");
+        }
+        if (options->command) {
+            execvp(options->command[0], options->command);
+        } else {
+            execl(self, self, "--target", (char *) NULL);
+        }
+        _exit(127);
+    }
+
+    if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+
+    return now_us() - start;
+}
+
+
+//------------------------------------------------------------------------------
+// Summarize the run times of a configuration, sorting them in the process, and
+// return their median. The overhead is relative to the median run time without
+// the DSO, which is given as the baseline.
+static double print_result(const StartupOptions *options,
+                           StartupConfig config, double *times, int count,
+                           int failures, double baseline)
+{
+    double total = 0, mean, p50, p90, p99;
+    int i;
+
+    if (count == 0) {
+        mean = p50 = p90 = p99 = 0;
+    } else {
+        qsort(times, count, sizeof(*times), compare_doubles);
+        for (i = 0; i < count; i++) {
+            total += times[i];
+        }
+#define PERCENTILE(p) times[(int) ((count - 1) * (p) + 0.5)]
+        mean = total / count;
+        p50 = PERCENTILE(0.5);
+        p90 = PERCENTILE(0.9);
+        p99 = PERCENTILE(0.99);
+#undef PERCENTILE
+    }
+    if (config == CONFIG_NONE) {
+        baseline = p50;
+    }
+
+    if (options->json) {
+        printf("{\"benchmark\":\"startup\",\"config\":\"%s\","
+               "\"mock_gl\":%s,\"samples\":%d,\"failures\":%d,"
+               "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+               "\"p99_us\":%.1f,\"overhead_p50_us\":%.1f}\n",
+               config_names[config], options->mock_gl ? "true" : "false",
+               count, failures, mean, p50, p90, p99, p50 - baseline);
+    } else {
+        printf("%s: %d samples, %d failures, mean %.1f us, p50 %.1f us, "
+               "p90 %.1f us, p99 %.1f us, overhead (p50) %.1f us\n",
+               config_names[config], count, failures, mean, p50, p90, p99,
+               p50 - baseline);
+    }
+
+    return p50;
+}
+
+
+int main(int argc, char **argv)
+{
+    StartupOptions options;
+    double *times[NUM_CONFIGS];
+    int counts[NUM_CONFIGS], failures[NUM_CONFIGS];
+    double baseline = 0;
+    bool ok = true;
+    int run, c, i;
+
+    if (argc == 2 && strcmp(argv[1], "--target") == 0) {
+        return 0;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.runs = 500;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            options.runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            options.mock_gl = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            options.json = true;
+        } else if (strcmp(argv[i], "--") == 0 && i + 1 < argc) {
+            options.command = &argv[i + 1];
+            break;
+        } else {
+            print_help(argv[0]);
+            return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+
+    if (options.runs < 1) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    if (!find_libraries(&options, argv[0])) {
+        fprintf(stderr, "Error: failed to find %s%s%s\n", PRELOAD_LIBRARY,
+                options.mock_gl ? " or " : "",
+                options.mock_gl ? MOCK_GL_LIBRARY : "");
+        return 1;
+    }
+
+    for (c = 0; c < NUM_CONFIGS; c++) {
+        times[c] = calloc(options.runs, sizeof(*times[c]));
+        counts[c] = failures[c] = 0;
+        if (!times[c]) {
+            return 1;
+        }
+    }
+
+    // Warm up the page cache, then take turns between the configurations
+    for (run = -WARMUP_RUNS; run < options.runs; run++) {
+        for (c = 0; c < NUM_CONFIGS; c++) {
+            double elapsed = run_target(&options, c, argv[0]);
+
+            if (run < 0) {
+                continue;
+            }
+            if (elapsed < 0) {
+                failures[c]++;
+            } else {
+                times[c][counts[c]++] = elapsed;
+            }
+        }
+    }
+
+    for (c = 0; c < NUM_CONFIGS; c++) {
+        double p50 = print_result(&options, c, times[c], counts[c],
+                                  failures[c], baseline);
+
+        if (c == CONFIG_NONE) {
+            baseline = p50;
+        }
+        ok = ok && failures[c] == 0;
+        free(times[c]);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Measure connection latency, query round trip times and query throughput
+// against the preload DSO. Unless a target pid is given, a target process is
+// spawned with the preload DSO and the mock GL library from the same
+// directory as this executable preloaded into it, so no GPU or X server is
+// needed; the mock then also lets the size of the query responses be varied.
+//
+// With -j, each measurement is written as one JSON object per line, with
+// stable keys, for tracking results over time.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "nvidia-query-resource-opengl.h"
+
+#define MOCK_GL_LIBRARY "libnvidia-query-resource-opengl-mock-gl.so"
+#define PRELOAD_LIBRARY "libnvidia-query-resource-opengl-preload.so"
+
+#define MAX_SIZES 16
+
+// How often the target samples the snapshot read with -M
+#define SNAPSHOT_INTERVAL_MS 10
+
+typedef struct {
+    pid_t pid;
+    int queries;
+    int completed;
+    int failures;
+    int response_words;
+    bool delta;
+    bool snapshot;
+    NVQRConnection *shared; // NULL if the client connects by itself
+    double *latencies_us;
+    pthread_t thread;
+} BenchClient;
+
+typedef struct {
+    int samples;
+    double mean, p50, p90, p99, p999, max;
+} LatencyStats;
+
+typedef struct {
+    pid_t pid;
+    int max_clients;
+    int queries;
+    int connects;
+    int sizes[MAX_SIZES];
+    int num_sizes;
+    bool delta;
+    bool shared;
+    bool snapshot;
+    bool json;
+} BenchOptions;
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+static void print_help(const char *progname)
+{
+    printf("Benchmark OpenGL resource queries\n\n"
+           "Usage: %s [-p pid] [-c clients] [-n queries] [-k connects] "
+           "[-r sizes] [-D | -S | -M] [-j]\n\n"
+           "  -h: print this help message\n"
+           "  -p <pid>: query an existing process instead of spawning one\n"
+           "  -c <clients>: measure throughput with 1, 2, 4, ... up to this\n"
+           "                many concurrent client connections (default 1)\n"
+           "  -n <queries>: number of queries per client (default 1000)\n"
+           "  -k <connects>: number of connections to time (default 200)\n"
+           "  -r <blocks>[,<blocks>...]: response sizes to measure, in mock\n"
+           "                detail blocks of 5 words each (default 2)\n"
+           "  -D: request delta responses, which only carry what changed\n"
+           "  -S: share one pipelined connection between all clients\n"
+           "  -M: read the results from a shared memory snapshot, which the\n"
+           "      target samples every 10 ms, instead of querying it\n"
+           "  -j: write results as JSON lines\n",
+           progname);
+}
+
+
+//------------------------------------------------------------------------------
+// Spawn a process with the mock GL library and the preload DSO preloaded, and
+// wait until it accepts query connections.
+static pid_t spawn_target(const char *self, int detail_blocks)
+{
+    char path[PATH_MAX], dir[PATH_MAX], preload[2 * PATH_MAX + 2];
+    char blocks[16];
+    ssize_t len;
+    pid_t pid;
+    int i;
+
+    len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len > 0) {
+        path[len] = '\0';
+    } else if (!realpath(self, path)) {
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s", dirname(path));
+    len = snprintf(preload, sizeof(preload), "%s/%s %s/%s",
+                   dir, MOCK_GL_LIBRARY, dir, PRELOAD_LIBRARY);
+    if (len < 0 || (size_t) len >= sizeof(preload)) {
+        return -1;
+    }
+    snprintf(blocks, sizeof(blocks), "%d", detail_blocks);
+
+    pid = fork();
+    if (pid == 0) {
+        setenv("LD_PRELOAD", preload, 1);
+        setenv("NVQR_MOCK_DETAIL_BLOCKS", blocks, 1);
+        execl(self, self, "--target", (char *) NULL);
+        _exit(127);
+    }
+
+    for (i = 0; pid > 0 && i < 500; i++) {
+        NVQRConnection c;
+
+        if (nvqr_connect(&c, pid) == NVQR_SUCCESS) {
+            nvqr_disconnect(&c);
+            return pid;
+        }
+        free(c.process_name);
+        usleep(10000);
+    }
+
+    fprintf(stderr, "Error: target process did not start serving queries\n");
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return -1;
+}
+
+
+static void stop_target(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return da < db ? -1 : da > db;
+}
+
+
+//------------------------------------------------------------------------------
+// Summarize a set of latencies, sorting them in the process. Percentiles use
+// the nearest rank.
+static LatencyStats compute_stats(double *latencies, int count)
+{
+    LatencyStats stats;
+    double total = 0;
+    int i;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.samples = count;
+    if (count == 0) {
+        return stats;
+    }
+
+    qsort(latencies, count, sizeof(*latencies), compare_doubles);
+    for (i = 0; i < count; i++) {
+        total += latencies[i];
+    }
+
+#define PERCENTILE(p) latencies[(int) ((count - 1) * (p) + 0.5)]
+    stats.mean = total / count;
+    stats.p50 = PERCENTILE(0.5);
+    stats.p90 = PERCENTILE(0.9);
+    stats.p99 = PERCENTILE(0.99);
+    stats.p999 = PERCENTILE(0.999);
+    stats.max = latencies[count - 1];
+#undef PERCENTILE
+
+    return stats;
+}
+
+
+static void print_size(const BenchOptions *options, int detail_blocks)
+{
+    if (options->pid) {
+        printf("null");
+    } else {
+        printf("%d", detail_blocks);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Time opening (and then closing) connections one after another.
+static bool bench_connect(const BenchOptions *options, pid_t pid,
+                          int detail_blocks)
+{
+    double *latencies = calloc(options->connects, sizeof(*latencies));
+    LatencyStats stats;
+    int count = 0, failures = 0, i;
+
+    if (!latencies) {
+        return false;
+    }
+
+    for (i = 0; i < options->connects; i++) {
+        NVQRConnection c;
+        double start = now_us();
+
+        if (nvqr_connect(&c, pid) != NVQR_SUCCESS) {
+            free(c.process_name);
+            failures++;
+            continue;
+        }
+        latencies[count++] = now_us() - start;
+        nvqr_disconnect(&c);
+    }
+
+    stats = compute_stats(latencies, count);
+    free(latencies);
+
+    if (options->json) {
+        printf("{\"benchmark\":\"connect\",\"detail_blocks\":");
+        print_size(options, detail_blocks);
+        printf(",\"samples\":%d,\"failures\":%d,\"mean_us\":%.1f,"
+               "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+               "\"max_us\":%.1f}\n", stats.samples, failures, stats.mean,
+               stats.p50, stats.p90, stats.p99, stats.max);
+    } else {
+        printf("connect: %d samples, %d failures, mean %.1f us, p50 %.1f us, "
+               "p90 %.1f us, p99 %.1f us, max %.1f us\n", stats.samples,
+               failures, stats.mean, stats.p50, stats.p90, stats.p99,
+               stats.max);
+    }
+
+    return failures == 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Read the results from a shared snapshot as fast as possible, timing each
+// read. The first result is waited for.
+static void read_snapshot(BenchClient *bc, NVQRConnection c)
+{
+    NVQRQueryData_t *data = malloc(NVQR_MAX_RESPONSE_LEN * sizeof(*data));
+    NVQRSnapshot *snapshot;
+    NVQRSnapshotInfo info;
+    nvqrReturn_t ret = NVQR_IN_PROGRESS;
+    int i;
+
+    if (!data || nvqr_map_snapshot(&c, GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV,
+                                   SNAPSHOT_INTERVAL_MS, &snapshot) !=
+                 NVQR_SUCCESS) {
+        free(data);
+        bc->failures = bc->queries;
+        return;
+    }
+
+    for (i = 0; i < 1000 && ret == NVQR_IN_PROGRESS; i++) {
+        ret = nvqr_read_snapshot(snapshot, data, NVQR_MAX_RESPONSE_LEN,
+                                 &info);
+        if (ret == NVQR_IN_PROGRESS) {
+            usleep(1000);
+        }
+    }
+
+    for (i = 0; i < bc->queries; i++) {
+        double start = now_us();
+
+        if (nvqr_read_snapshot(snapshot, data, NVQR_MAX_RESPONSE_LEN,
+                               &info) != NVQR_SUCCESS) {
+            bc->failures++;
+            continue;
+        }
+
+        bc->latencies_us[bc->completed++] = now_us() - start;
+        bc->response_words = info.cnt;
+    }
+
+    nvqr_unmap_snapshot(snapshot);
+    free(data);
+}
+
+
+static void *run_client(void *ptr)
+{
+    BenchClient *bc = ptr;
+    NVQRConnection c;
+    int i;
+
+    if (bc->shared) {
+        c = *bc->shared;
+    } else if (nvqr_connect(&c, bc->pid) != NVQR_SUCCESS) {
+        free(c.process_name);
+        bc->failures = bc->queries;
+        return NULL;
+    }
+
+    if (bc->delta && nvqr_enable_delta(&c) != NVQR_SUCCESS) {
+        nvqr_disconnect(&c);
+        bc->failures = bc->queries;
+        return NULL;
+    }
+
+    if (bc->snapshot) {
+        read_snapshot(bc, c);
+        nvqr_disconnect(&c);
+        return NULL;
+    }
+
+    for (i = 0; i < bc->queries; i++) {
+        NVQRQueryData_t *data;
+        double start = now_us();
+        int cnt;
+
+        if (nvqr_request_meminfo_alloc(c,
+                                       GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV,
+                                       &data, &cnt) != NVQR_SUCCESS) {
+            bc->failures++;
+            continue;
+        }
+
+        bc->latencies_us[bc->completed++] = now_us() - start;
+        bc->response_words = cnt;
+        free(data);
+    }
+
+    if (!bc->shared) {
+        nvqr_disconnect(&c);
+    }
+    return NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// Measure query round trip times and throughput with the given number of
+// clients, each querying as fast as it can over its own connection, or over
+// one connection shared by all of them.
+static bool bench_queries(const BenchOptions *options, pid_t pid,
+                          int detail_blocks, int num_clients)
+{
+    BenchClient *clients = calloc(num_clients, sizeof(*clients));
+    double *latencies = calloc((size_t) num_clients * options->queries,
+                               sizeof(*latencies));
+    int completed = 0, failures = 0, response_words = 0, i;
+    double start, elapsed;
+    LatencyStats stats;
+    NVQRConnection shared;
+
+    if (!clients || !latencies) {
+        free(clients);
+        free(latencies);
+        return false;
+    }
+
+    if (options->shared) {
+        if (nvqr_connect(&shared, pid) != NVQR_SUCCESS) {
+            free(shared.process_name);
+            free(clients);
+            free(latencies);
+            return false;
+        }
+        if (nvqr_enable_pipelining(&shared) != NVQR_SUCCESS) {
+            nvqr_disconnect(&shared);
+            free(clients);
+            free(latencies);
+            return false;
+        }
+    }
+
+    start = now_us();
+    for (i = 0; i < num_clients; i++) {
+        clients[i].pid = pid;
+        clients[i].queries = options->queries;
+        clients[i].delta = options->delta;
+        clients[i].snapshot = options->snapshot;
+        clients[i].shared = options->shared ? &shared : NULL;
+        clients[i].latencies_us = latencies + (size_t) i * options->queries;
+        pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+    for (i = 0; i < num_clients; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    elapsed = now_us() - start;
+
+    if (options->shared) {
+        nvqr_disconnect(&shared);
+    }
+
+    // Gather the latencies of all clients together
+    for (i = 0; i < num_clients; i++) {
+        memmove(latencies + completed, clients[i].latencies_us,
+                clients[i].completed * sizeof(*latencies));
+        completed += clients[i].completed;
+        failures += clients[i].failures;
+        if (clients[i].response_words) {
+            response_words = clients[i].response_words;
+        }
+    }
+
+    stats = compute_stats(latencies, completed);
+
+    if (options->json) {
+        printf("{\"benchmark\":\"query\",\"detail_blocks\":");
+        print_size(options, detail_blocks);
+        printf(",\"response_words\":%d,\"delta\":%s,\"shared\":%s,"
+               "\"snapshot\":%s,\"clients\":%d,\"queries\":%d,"
+               "\"failures\":%d,\"qps\":%.0f,"
+               "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+               "\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+               response_words, options->delta ? "true" : "false",
+               options->shared ? "true" : "false",
+               options->snapshot ? "true" : "false", num_clients,
+               completed + failures, failures,
+               completed / (elapsed / 1e6), stats.mean, stats.p50,
+               stats.p90, stats.p99, stats.p999, stats.max);
+    } else {
+        printf("clients %3d: %8.0f queries/s, %d failures, rtt mean %.1f us, "
+               "p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+               "max %.1f us\n", num_clients, completed / (elapsed / 1e6),
+               failures, stats.mean, stats.p50, stats.p90, stats.p99,
+               stats.p999, stats.max);
+    }
+    fflush(stdout);
+
+    free(clients);
+    free(latencies);
+    return failures == 0;
+}
+
+
+static bool parse_sizes(BenchOptions *options, const char *str)
+{
+    char *end;
+
+    options->num_sizes = 0;
+    while (*str) {
+        long size = strtol(str, &end, 10);
+
+        if (end == str || size < 0 || options->num_sizes == MAX_SIZES ||
+            (*end && *end != ',')) {
+            return false;
+        }
+        options->sizes[options->num_sizes++] = (int) size;
+        str = *end ? end + 1 : end;
+    }
+
+    return options->num_sizes > 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    bool ok = true;
+    int s, i;
+
+    if (argc == 2 && strcmp(argv[1], "--target") == 0) {
+        for (;;) {
+            pause();
+        }
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.max_clients = 1;
+    options.queries = 1000;
+    options.connects = 200;
+    options.sizes[0] = 2;
+    options.num_sizes = 1;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            options.pid = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            options.max_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            options.queries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            options.connects = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc &&
+                   parse_sizes(&options, argv[i + 1])) {
+            i++;
+        } else if (strcmp(argv[i], "-D") == 0) {
+            options.delta = true;
+        } else if (strcmp(argv[i], "-S") == 0) {
+            options.shared = true;
+        } else if (strcmp(argv[i], "-M") == 0) {
+            options.snapshot = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            options.json = true;
+        } else {
+            print_help(argv[0]);
+            return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+
+    if (options.max_clients < 1 || options.queries < 1 ||
+        options.connects < 0 ||
+        options.delta + options.shared + options.snapshot > 1) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    // The response size of an existing process cannot be changed
+    if (options.pid) {
+        options.num_sizes = 1;
+    }
+
+    for (s = 0; s < options.num_sizes; s++) {
+        pid_t pid = options.pid;
+        int clients;
+
+        if (!pid) {
+            pid = spawn_target(argv[0], options.sizes[s]);
+            if (pid <= 0) {
+                return 1;
+            }
+        }
+
+        if (!options.json) {
+            if (options.pid) {
+                printf("pid %ld\n", (long) pid);
+            } else {
+                printf("response size %d detail blocks\n", options.sizes[s]);
+            }
+        }
+
+        if (options.connects > 0) {
+            ok = bench_connect(&options, pid, options.sizes[s]) && ok;
+        }
+
+        for (clients = 1; ; clients *= 2) {
+            if (clients > options.max_clients) {
+                clients = options.max_clients;
+            }
+            ok = bench_queries(&options, pid, options.sizes[s], clients) &&
+                 ok;
+            if (clients == options.max_clients) {
+                break;
+            }
+        }
+
+        if (!options.pid) {
+            stop_target(pid);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
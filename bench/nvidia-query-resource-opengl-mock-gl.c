@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// A stand-in for the handful of Xlib, GLX and GL_NV_query_resource entry
+// points used by the preload DSO, so that the query server can be exercised
+// and benchmarked on systems without an X server or an NVIDIA GPU. Load it
+// ahead of the preload DSO, e.g. with LD_PRELOAD set to
+//
+//   "libnvidia-query-resource-opengl-mock-gl.so
+//    libnvidia-query-resource-opengl-preload.so"
+//
+// The cost of the driver calls can be simulated by setting the following
+// environment variables to a number of microseconds to busy-wait for:
+//
+//   NVQR_MOCK_QUERY_US:       glQueryResourceNV() (default 20)
+//   NVQR_MOCK_MAKECURRENT_US: glXMakeCurrent() (default 50)
+//
+// The size of the query response is set by NVQR_MOCK_DETAIL_BLOCKS, the
+// number of 5 word detail blocks in it (default 2, for a 28 word response).
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <GL/gl.h>
+#include <GL/glx.h>
+
+#include "nvidia-query-resource-opengl.h"
+
+#define MOCK_GLX_CONTEXT ((GLXContext) 0x1)
+
+// The response is a well-formed result for one device, with
+// NVQR_MOCK_DETAIL_BLOCKS detail blocks (default 2) and one tag:
+//
+//   header: headerBlkSize, version, numDevices
+//   device: deviceBlkSize, summaryBlkSize, totalAllocs, vidMemUsedkiB,
+//           vidMemFreekiB, numDetailBlocks
+//   details: detailBlkSize, memType, objectType, numAllocs, memUsedkiB
+//   number of tags
+//   tag: tagBlkSize, tagId, deviceId, numAllocs, vidmemUsedkiB, tagLength,
+//        followed by tagLength words of tag string
+static NVQRQueryData_t *mock_response;
+static size_t mock_response_words;
+static const char mock_tag[] = "mock";
+
+
+static long get_cost_us(const char *name, long def)
+{
+    const char *str = getenv(name);
+
+    return str ? atol(str) : def;
+}
+
+
+// Spin rather than sleep, to model CPU time spent in the driver
+static void busy_wait_us(long us)
+{
+    struct timespec start, now;
+
+    if (us <= 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000L +
+             (now.tv_nsec - start.tv_nsec) / 1000 < us);
+}
+
+
+//------------------------------------------------------------------------------
+// Build the response once, before the query server starts.
+static void build_response(void)
+{
+    static const NVQRQueryData_t object_types[] = {
+        GL_QUERY_RESOURCE_TEXTURE_NV,
+        GL_QUERY_RESOURCE_SYS_RESERVED_NV,
+        GL_QUERY_RESOURCE_RENDERBUFFER_NV,
+        GL_QUERY_RESOURCE_BUFFEROBJECT_NV,
+    };
+    long details = get_cost_us("NVQR_MOCK_DETAIL_BLOCKS", 2);
+    size_t tag_words = (sizeof(mock_tag) + sizeof(NVQRQueryData_t) - 1) /
+                       sizeof(NVQRQueryData_t);
+    NVQRQueryData_t *ptr, *device, allocs = 0, used = 0;
+    long i;
+
+    if (details < 0 || details > (1 << 20)) {
+        details = 2;
+    }
+
+    mock_response_words = 3 + 6 + details * 5 + 1 + 6 + tag_words;
+    mock_response = calloc(mock_response_words, sizeof(*mock_response));
+    if (!mock_response) {
+        mock_response_words = 0;
+        return;
+    }
+
+    ptr = mock_response;
+    *ptr++ = 3;
+    *ptr++ = NVQR_DATA_FORMAT_VERSION;
+    *ptr++ = 1;
+
+    device = ptr;
+    ptr += 6;
+    for (i = 0; i < details; i++) {
+        // The first two blocks match the original fixed response
+        NVQRQueryData_t num = i == 0 ? 3 : i == 1 ? 2 : 1;
+        NVQRQueryData_t kib = i == 0 ? 900 : i == 1 ? 100 : 10;
+
+        *ptr++ = 5;
+        *ptr++ = GL_QUERY_RESOURCE_MEMTYPE_VIDMEM_NV;
+        *ptr++ = object_types[i % 4];
+        *ptr++ = num;
+        *ptr++ = kib;
+        allocs += num;
+        used += kib;
+    }
+    device[0] = 6 + details * 5;
+    device[1] = 6;
+    device[2] = allocs;
+    device[3] = used;
+    device[4] = 24;
+    device[5] = details;
+
+    *ptr++ = 1;
+    *ptr++ = 6;
+    *ptr++ = 1;
+    *ptr++ = 0;
+    *ptr++ = 1;
+    *ptr++ = 50;
+    *ptr++ = tag_words;
+    memcpy(ptr, mock_tag, sizeof(mock_tag));
+}
+
+
+static GLint mock_glQueryResourceNV(GLenum queryType, GLuint pname,
+                                    GLuint bufSize, GLint *buffer)
+{
+    size_t bytes = mock_response_words * sizeof(*mock_response);
+
+    busy_wait_us(get_cost_us("NVQR_MOCK_QUERY_US", 20));
+
+    // Like the driver, fill as much of the buffer as there is room for
+    if (queryType != GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV || !bytes) {
+        return 0;
+    }
+    if (bufSize < bytes) {
+        bytes = bufSize - bufSize % sizeof(*mock_response);
+    }
+
+    memcpy(buffer, mock_response, bytes);
+    return bytes / sizeof(*mock_response);
+}
+
+
+void (*glXGetProcAddressARB(const GLubyte *procName))(void)
+{
+    if (strcmp((const char *) procName, "glQueryResourceNV") == 0) {
+        if (!mock_response) {
+            build_response();
+        }
+        return (void (*)(void)) mock_glQueryResourceNV;
+    }
+    return NULL;
+}
+
+
+Status XInitThreads(void)
+{
+    return True;
+}
+
+
+Display *XOpenDisplay(const char *display_name)
+{
+    // DefaultScreen() dereferences the display, so hand out a zeroed one
+    return calloc(1, sizeof(*(_XPrivDisplay) NULL));
+}
+
+
+int XCloseDisplay(Display *dpy)
+{
+    free(dpy);
+    return 0;
+}
+
+
+int XFree(void *data)
+{
+    free(data);
+    return 1;
+}
+
+
+XVisualInfo *glXChooseVisual(Display *dpy, int screen, int *attribList)
+{
+    return calloc(1, sizeof(XVisualInfo));
+}
+
+
+GLXContext glXCreateContext(Display *dpy, XVisualInfo *vis,
+                            GLXContext shareList, Bool direct)
+{
+    return MOCK_GLX_CONTEXT;
+}
+
+
+void glXDestroyContext(Display *dpy, GLXContext ctx)
+{
+}
+
+
+Bool glXMakeCurrent(Display *dpy, GLXDrawable drawable, GLXContext ctx)
+{
+    busy_wait_us(get_cost_us("NVQR_MOCK_MAKECURRENT_US", 50));
+    return True;
+}
@@ -23,7 +23,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if !defined (_WIN32)
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
+#include "nvidia-query-resource-opengl-ipc.h"
 #include "nvidia-query-resource-opengl-ipc-util.h"
 
 #if defined (_WIN32)
@@ -43,6 +49,17 @@ static char *construct_name(const char *basename, DWORD pid)
     return buf;
 }
 
+long long nvqr_ipc_get_time_us(void)
+{
+    LARGE_INTEGER count, frequency;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (long long) (count.QuadPart / frequency.QuadPart) * 1000000 +
+           (count.QuadPart % frequency.QuadPart) * 1000000 /
+           frequency.QuadPart;
+}
+
 char *nvqr_ipc_client_pipe_name(DWORD pid)
 {
     return construct_name("clientpipe", pid);
@@ -50,7 +67,7 @@ char *nvqr_ipc_client_pipe_name(DWORD pid)
 
 char *nvqr_ipc_server_pipe_name(DWORD pid)
 {
-    return construct_name("serverpipe", pid);
+    return construct_name(NVQR_IPC_SERVER_PIPE_BASENAME, pid);
 }
 
 #else
@@ -58,7 +75,7 @@ char *nvqr_ipc_server_pipe_name(DWORD pid)
 int nvqr_ipc_get_socket_name(char *dest, size_t len, pid_t pid)
 {
     int total_len;
-    static const char *basename = "nvidia-query-resource-opengl-socket.";
+    static const char *basename = NVQR_IPC_SOCKET_BASENAME;
 
 #if __linux
     // Socket names in the abstract namespace are not strings; rather, the
@@ -94,4 +111,64 @@ int nvqr_ipc_get_socket_name(char *dest, size_t len, pid_t pid)
 
     return total_len;
 }
+
+long long nvqr_ipc_get_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int nvqr_ipc_socket(void)
+{
+    int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+#if defined (SO_NOSIGPIPE)
+    int on = 1;
+
+    if (fd != -1 &&
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+#endif
+
+    return fd;
+}
+
+ssize_t nvqr_ipc_send(int fd, const void *buf, size_t len)
+{
+#if defined (MSG_NOSIGNAL)
+    return send(fd, buf, len, MSG_NOSIGNAL);
+#else
+    return send(fd, buf, len, 0);
+#endif
+}
 #endif // _WIN32
+
+
+int nvqr_ipc_histogram_bucket(long long us)
+{
+    int msb = 3, bucket;
+
+    if (us < 8) {
+        return us < 0 ? 0 : (int) us;
+    }
+
+    while (us >> (msb + 1)) {
+        msb++;
+    }
+
+    bucket = 8 + (msb - 3) * 4 + (int) ((us >> (msb - 2)) & 3);
+    return bucket < NVQR_HIST_BUCKETS ? bucket : NVQR_HIST_BUCKETS - 1;
+}
+
+
+long long nvqr_ipc_histogram_bucket_min(int bucket)
+{
+    if (bucket < 8) {
+        return bucket;
+    }
+
+    return (4LL + (bucket - 8) % 4) << ((bucket - 8) / 4 + 1);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-data.h"
+
+// Sizes, in words, of the fixed parts of each block
+#define HEADER_WORDS ((int) (sizeof(NVQRQueryDataHeader) / \
+                             sizeof(NVQRQueryData_t)))
+#define DEVICE_WORDS ((int) (sizeof(NVQRQueryDeviceInfo) / \
+                             sizeof(NVQRQueryData_t)))
+#define DETAIL_WORDS ((int) (sizeof(NVQRQueryDetailInfo) / \
+                             sizeof(NVQRQueryData_t)))
+#define TAG_WORDS    ((int) (offsetof(NVQRTagBlock, tag) / \
+                             sizeof(NVQRQueryData_t)))
+
+
+//------------------------------------------------------------------------------
+// Check that a block of at least minSize words, which claims to be blkSize
+// words long, starts at pos and fits within the first end words.
+static int block_fits(int pos, int end, int minSize, NVQRQueryData_t blkSize)
+{
+    return blkSize >= minSize && pos <= end && blkSize <= end - pos;
+}
+
+
+//------------------------------------------------------------------------------
+// Parse the detail blocks of the device block at data[pos], which ends at
+// data[end].
+static nvqrReturn_t parse_details(const NVQRQueryData_t *data, int pos,
+                                  int end, int device, int numDetails,
+                                  NVQRParsedData *parsed)
+{
+    int i;
+
+    for (i = 0; i < numDetails; i++) {
+        const NVQRQueryDetailInfo *blk =
+            (const NVQRQueryDetailInfo *) (data + pos);
+
+        if (pos > end - DETAIL_WORDS ||
+            !block_fits(pos, end, DETAIL_WORDS, blk->detailBlkSize)) {
+            return NVQR_ERROR_INVALID_ARGUMENT;
+        }
+
+        if (parsed->numDetails < parsed->maxDetails) {
+            NVQRDetailRecord *rec = &parsed->details[parsed->numDetails];
+
+            rec->device = device;
+            rec->memType = blk->memType;
+            rec->objectType = blk->objectType;
+            rec->numAllocs = blk->numAllocs;
+            rec->memUsedkiB = blk->memUsedkiB;
+        }
+        parsed->numDetails++;
+
+        pos += blk->detailBlkSize;
+    }
+
+    return NVQR_SUCCESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Parse the tag blocks, the count of which is at data[pos].
+static nvqrReturn_t parse_tags(const NVQRQueryData_t *data, int pos, int cnt,
+                               NVQRParsedData *parsed)
+{
+    int numTags, i;
+
+    // Results without any tag section are treated as having no tags
+    if (pos == cnt) {
+        return NVQR_SUCCESS;
+    }
+
+    numTags = data[pos++];
+    if (numTags < 0) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    for (i = 0; i < numTags; i++) {
+        const NVQRTagBlock *blk = (const NVQRTagBlock *) (data + pos);
+        const char *tag;
+
+        if (pos > cnt - TAG_WORDS ||
+            !block_fits(pos, cnt, TAG_WORDS, blk->tagBlkSize) ||
+            blk->tagLength < 0 ||
+            blk->tagLength > cnt - pos - blk->tagBlkSize) {
+            return NVQR_ERROR_INVALID_ARGUMENT;
+        }
+
+        // The tag string follows the block, padded out to whole words
+        tag = (const char *) (data + pos + blk->tagBlkSize);
+
+        if (parsed->numTags < parsed->maxTags) {
+            NVQRTagRecord *rec = &parsed->tags[parsed->numTags];
+            size_t maxLen = blk->tagLength * sizeof(NVQRQueryData_t);
+            const char *nul = memchr(tag, '\0', maxLen);
+
+            rec->tagId = blk->tagId;
+            rec->deviceId = blk->deviceId;
+            rec->numAllocs = blk->numAllocs;
+            rec->vidmemUsedkiB = blk->vidmemUsedkiB;
+            rec->tag = tag;
+            rec->tagLen = nul ? (int) (nul - tag) : (int) maxLen;
+        }
+        parsed->numTags++;
+
+        pos += blk->tagBlkSize + blk->tagLength;
+    }
+
+    return NVQR_SUCCESS;
+}
+
+
+nvqrReturn_t nvqr_parse_memory_info(const NVQRQueryData_t *data, int cnt,
+                                    NVQRParsedData *parsed)
+{
+    const NVQRQueryDataHeader *header = (const NVQRQueryDataHeader *) data;
+    nvqrReturn_t ret;
+    int pos, i;
+
+    parsed->version = 0;
+    parsed->numDevices = 0;
+    parsed->numDetails = 0;
+    parsed->numTags = 0;
+
+    if (!data || cnt < HEADER_WORDS ||
+        !block_fits(0, cnt, HEADER_WORDS, header->headerBlkSize)) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    parsed->version = header->version;
+    if (header->version != NVQR_DATA_FORMAT_VERSION) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+    if (header->numDevices < 0) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    pos = header->headerBlkSize;
+    for (i = 0; i < header->numDevices; i++) {
+        const NVQRQueryDeviceInfo *blk =
+            (const NVQRQueryDeviceInfo *) (data + pos);
+        int end;
+
+        if (pos > cnt - DEVICE_WORDS ||
+            !block_fits(pos, cnt, DEVICE_WORDS, blk->deviceBlkSize) ||
+            blk->summaryBlkSize < DEVICE_WORDS ||
+            blk->summaryBlkSize > blk->deviceBlkSize ||
+            blk->numDetailBlocks < 0) {
+            return NVQR_ERROR_INVALID_ARGUMENT;
+        }
+        end = pos + blk->deviceBlkSize;
+
+        if (i < parsed->maxDevices) {
+            NVQRDeviceRecord *rec = &parsed->devices[i];
+
+            rec->totalAllocs = blk->totalAllocs;
+            rec->vidMemUsedkiB = blk->vidMemUsedkiB;
+            rec->vidMemFreekiB = blk->vidMemFreekiB;
+            rec->firstDetail = parsed->numDetails;
+            rec->numDetails = blk->numDetailBlocks;
+        }
+        parsed->numDevices++;
+
+        ret = parse_details(data, pos + blk->summaryBlkSize, end, i,
+                            blk->numDetailBlocks, parsed);
+        if (ret != NVQR_SUCCESS) {
+            return ret;
+        }
+
+        pos = end;
+    }
+
+    ret = parse_tags(data, pos, cnt, parsed);
+    if (ret != NVQR_SUCCESS) {
+        return ret;
+    }
+
+    if (parsed->numDevices > parsed->maxDevices ||
+        parsed->numDetails > parsed->maxDetails ||
+        parsed->numTags > parsed->maxTags) {
+        return NVQR_ERROR_INSUFFICIENT_BUFFER;
+    }
+
+    return NVQR_SUCCESS;
+}
@@ -63,4 +63,98 @@ typedef struct NVQRTagBlockRec {
     char tag[4];
 } NVQRTagBlock;
 
+// Decoded records, as filled in by nvqr_parse_memory_info()
+
+typedef struct NVQRDeviceRecordRec {
+    NVQRQueryData_t totalAllocs;
+    NVQRQueryData_t vidMemUsedkiB;
+    NVQRQueryData_t vidMemFreekiB;
+    int firstDetail;    // index of the device's first record in details[]
+    int numDetails;
+} NVQRDeviceRecord;
+
+typedef struct NVQRDetailRecordRec {
+    int device;         // index of the device in devices[]
+    NVQRQueryData_t memType;
+    NVQRQueryData_t objectType;
+    NVQRQueryData_t numAllocs;
+    NVQRQueryData_t memUsedkiB;
+} NVQRDetailRecord;
+
+typedef struct NVQRTagRecordRec {
+    NVQRQueryData_t tagId;
+    NVQRQueryData_t deviceId;
+    NVQRQueryData_t numAllocs;
+    NVQRQueryData_t vidmemUsedkiB;
+    const char *tag;    // points into the parsed data; not NUL terminated
+    int tagLen;         // length of the tag in bytes
+} NVQRTagRecord;
+
+typedef struct NVQRParsedDataRec {
+    // Set by the caller: room for up to max* records in each array. An array
+    // may be NULL if its maximum is 0.
+    NVQRDeviceRecord *devices;
+    int maxDevices;
+    NVQRDetailRecord *details;
+    int maxDetails;
+    NVQRTagRecord *tags;
+    int maxTags;
+
+    // Set by the parser: the total number of records of each kind in the data,
+    // which may exceed the size of the corresponding array.
+    int version;
+    int numDevices;
+    int numDetails;
+    int numTags;
+} NVQRParsedData;
+
+// Layout of the records written by nvqr_format_memory_info() in the
+// NVQR_FORMAT_BINARY format. All fields are in host byte order. A record is an
+// NVQRBinaryRecordHeader followed by numDevices NVQRBinaryDevice, numDetails
+// NVQRBinaryDetail and numTags NVQRBinaryTag structures, followed by zeroed
+// padding up to recordSize bytes, a multiple of NVQR_BINARY_RECORD_ALIGN: a
+// record read into an aligned buffer keeps the next one aligned for the
+// timestampUs field. Strings are truncated to fit, and padded with NUL bytes.
+
+#define NVQR_BINARY_RECORD_MAGIC    0x5251564e  // "NVQR" in little endian
+#define NVQR_BINARY_RECORD_VERSION  1
+#define NVQR_BINARY_RECORD_ALIGN    8
+#define NVQR_BINARY_NAME_LEN        32
+
+typedef struct NVQRBinaryRecordHeaderRec {
+    int magic;
+    int recordVersion;
+    int recordSize;
+    int pid;
+    long long timestampUs;
+    int dataVersion;
+    int numDevices;
+    int numDetails;
+    int numTags;
+    char processName[NVQR_BINARY_NAME_LEN];
+} NVQRBinaryRecordHeader;
+
+typedef struct NVQRBinaryDeviceRec {
+    int totalAllocs;
+    int vidMemUsedkiB;
+    int vidMemFreekiB;
+    int numDetails;
+} NVQRBinaryDevice;
+
+typedef struct NVQRBinaryDetailRec {
+    int device;
+    int memType;
+    int objectType;
+    int numAllocs;
+    int memUsedkiB;
+} NVQRBinaryDetail;
+
+typedef struct NVQRBinaryTagRec {
+    int tagId;
+    int deviceId;
+    int numAllocs;
+    int vidmemUsedkiB;
+    char tag[NVQR_BINARY_NAME_LEN];
+} NVQRBinaryTag;
+
 #endif
@@ -27,6 +27,9 @@
 #if defined (_WIN32)
 #include <Windows.h>
 
+// Server pipes are named \\.\pipe\<NVQR_IPC_SERVER_PIPE_BASENAME><pid>
+#define NVQR_IPC_SERVER_PIPE_BASENAME "serverpipe"
+
 //------------------------------------------------------------------------------
 // Return the pipe name for the client with the given PID in a newly allocated
 // buffer. The server should call this function with the PID provided by the
@@ -47,6 +50,10 @@ char *nvqr_ipc_server_pipe_name(DWORD pid);
 #else
 #include <sys/types.h>
 
+// Sockets are named <NVQR_IPC_SOCKET_BASENAME><pid>, in the abstract namespace
+// on Linux, and in /tmp on other Unixen.
+#define NVQR_IPC_SOCKET_BASENAME "nvidia-query-resource-opengl-socket."
+
 //------------------------------------------------------------------------------
 // Write the socket name for the given pid into the provided buffer. On Linux,
 // use the abstract namespace for domain sockets. On other Unixen, create the
@@ -57,8 +64,34 @@ char *nvqr_ipc_server_pipe_name(DWORD pid);
 
 int nvqr_ipc_get_socket_name(char *dest, size_t len, pid_t pid);
 
+//------------------------------------------------------------------------------
+// Create a client socket, and write to one, without the process being killed
+// by SIGPIPE if the server has gone away; the write fails with EPIPE instead.
+// Clients must create their sockets with nvqr_ipc_socket() on systems that
+// only have SO_NOSIGPIPE. Both return -1 on failure, like socket(2) and
+// send(2).
+
+int nvqr_ipc_socket(void);
+ssize_t nvqr_ipc_send(int fd, const void *buf, size_t len);
+
 #endif
 
+//------------------------------------------------------------------------------
+// Return the current time in microseconds on a monotonic clock, with an
+// unspecified starting point.
+
+long long nvqr_ipc_get_time_us(void);
+
+//------------------------------------------------------------------------------
+// Map a duration in microseconds to its bucket in a latency histogram of
+// NVQR_HIST_BUCKETS buckets, and a bucket to the shortest duration it holds.
+// Durations below 8 us get a bucket each; above that, each power of two is
+// split into four buckets, so that no bucket is more than 25% wide. Durations
+// too long for the last bucket are counted in it.
+
+int nvqr_ipc_histogram_bucket(long long us);
+long long nvqr_ipc_histogram_bucket_min(int bucket);
+
 //------------------------------------------------------------------------------
 // Both ULONG_MAX and LONG_MIN (including the negative sign '-') are twenty
 // characters long in decimal representation. It shouldn't be necessary to
@@ -23,6 +23,8 @@
 #ifndef __NVIDIA_QUERY_RESOURCE_OPENGL_IPC_H__
 #define __NVIDIA_QUERY_RESOURCE_OPENGL_IPC_H__
 
+#include <stddef.h>
+
 #include "nvidia-query-resource-opengl-data.h"
 
 // Data types used by the IPC between queryResource client and server
@@ -30,19 +32,240 @@
 typedef enum {
     NVQR_QUERY_CONNECT = 1,
     NVQR_QUERY_MEMORY_INFO,
-    NVQR_QUERY_DISCONNECT
+    NVQR_QUERY_DISCONNECT,
+    NVQR_QUERY_MEMORY_INFO_DELTA,
+    NVQR_QUERY_DELTA_RESET,
+    NVQR_QUERY_BATCH,
+    NVQR_QUERY_ONESHOT,
+    NVQR_QUERY_STATS,
+    NVQR_QUERY_THROTTLED,
+    NVQR_QUERY_SUBSCRIBE,
+    NVQR_QUERY_UNSUBSCRIBE,
+    NVQR_QUERY_MAP_SNAPSHOT,
+    NVQR_QUERY_HISTORY,
+    NVQR_QUERY_PEAKS
 } NVQRqueryOp;
 
+// requestId (Unix only) is echoed back in the header of the response, so that
+// a client with several commands in flight on a connection can tell which
+// command a response belongs to. It trails the other fields, since the
+// driver's server on Windows expects commands of NVQR_LEGACY_CMD_SIZE bytes.
 typedef struct NVQRQueryCmdBufferRec {
     NVQRqueryOp op;
     int         queryType;
     int         pid;
+    int         requestId;
 } NVQRQueryCmdBuffer;
 
+#define NVQR_LEGACY_CMD_SIZE        offsetof(NVQRQueryCmdBuffer, requestId)
+
+// Batched queries (Unix only). NVQR_QUERY_BATCH performs several queries on a
+// connected client in a single round trip. NVQR_QUERY_ONESHOT does the same
+// without NVQR_QUERY_CONNECT first, and the server closes the connection
+// after responding. For both, queryType holds the number of query types, at
+// most NVQR_MAX_BATCH_TYPES, and the command is followed by that many query
+// types as ints. For each query type in order, the response data holds the
+// query type, the number of words in its result (0 if the query failed), and
+// the result.
+#define NVQR_MAX_BATCH_TYPES        16
+
+// Admission control (Unix only). The server may answer a query command, or
+// any command of a client over its user's connection limit, with
+// NVQR_QUERY_THROTTLED instead of performing it. The response data is a
+// single word: the number of microseconds after which the command is likely
+// to be admitted. The connection stays open, unless the command was
+// NVQR_QUERY_ONESHOT or the connection is over the limit.
+
+// sampleAgeUs is the time in microseconds between sampling the data and
+// sending the response; nonzero values indicate a result that was shared with
+// other clients or served from the server's cache. It trails the data so that
+// the layout of the remaining fields is unchanged.
 typedef struct NVQRQueryDataBufferRec {
     NVQRqueryOp     op;
     int             cnt;
     NVQRQueryData_t data[NVQR_MAX_DATA_BUFFER_LEN];
+    int             sampleAgeUs;
 } NVQRQueryDataBuffer;
 
+// On Unix, where both ends of the connection are implemented here, each
+// response is sent as an NVQRQueryResponseHeader followed by cnt words of
+// data, and may be longer than NVQR_MAX_DATA_BUFFER_LEN words. Responses are
+// limited to NVQR_MAX_RESPONSE_LEN words.
+#define NVQR_MAX_RESPONSE_LEN       (1 << 20)
+
+typedef struct NVQRQueryResponseHeaderRec {
+    NVQRqueryOp     op;
+    int             cnt;
+    int             sampleAgeUs;
+    int             requestId;
+} NVQRQueryResponseHeader;
+
+// Delta responses (Unix only). A client that queries a process repeatedly may
+// send NVQR_QUERY_MEMORY_INFO_DELTA instead of NVQR_QUERY_MEMORY_INFO. The
+// server then remembers the result it sent on the connection, and describes
+// the next one in terms of it. The response data starts with NVQR_DELTA_FULL,
+// followed by the complete result, or with NVQR_DELTA_PATCH and the length of
+// the result in words, followed by instructions that build the result from
+// the previous one:
+//
+//   NVQR_DELTA_COPY, offset, len: copy len words of the previous result,
+//                                 starting at offset
+//   NVQR_DELTA_DATA, len, ...:    the next len words of the result
+//
+// NVQR_QUERY_DELTA_RESET makes the server forget the previous result, so that
+// the next delta response is a full one.
+typedef enum {
+    NVQR_DELTA_FULL = 0,
+    NVQR_DELTA_PATCH
+} NVQRDeltaKind;
+
+typedef enum {
+    NVQR_DELTA_COPY = 0,
+    NVQR_DELTA_DATA
+} NVQRDeltaInstruction;
+
+// Subscriptions (Unix only). Instead of polling, a connected client may send
+// NVQR_QUERY_SUBSCRIBE, followed by an NVQRSubscribeParams, to have the server
+// sample queryType by itself, at most every intervalMs milliseconds (and no
+// more often than every NVQR_MIN_SUBSCRIBE_INTERVAL_MS), and push a new
+// result only when memory usage has changed since the last one it sent: when
+// the usage of a watched device, detail block (an object type in a memory
+// type) or tag has changed by at least thresholdKiB kiB or thresholdPct
+// percent, whichever are nonzero, or at all if neither is. Blocks that appear
+// or disappear count as changing from 0 kiB. The response to the command and
+// the pushed responses have op NVQR_QUERY_SUBSCRIBE and the requestId of the
+// command, and the data of delta responses, each relative to the one before;
+// the first is a full result. A client that does not keep up with the pushes
+// is sent the latest change once it does. While subscribed, a connection only
+// accepts NVQR_QUERY_UNSUBSCRIBE and NVQR_QUERY_DISCONNECT, whose response may
+// be preceded by further pushes.
+typedef enum {
+    NVQR_WATCH_DEVICES = 1 << 0,
+    NVQR_WATCH_DETAILS = 1 << 1,
+    NVQR_WATCH_TAGS = 1 << 2
+} NVQRWatchFlags;
+
+typedef struct NVQRSubscribeParamsRec {
+    int intervalMs;
+    int thresholdKiB;
+    int thresholdPct;
+    int watch;          // NVQRWatchFlags, or 0 to watch everything
+} NVQRSubscribeParams;
+
+#define NVQR_MIN_SUBSCRIBE_INTERVAL_MS  10
+
+// Shared snapshots (Unix only). A connected client may send
+// NVQR_QUERY_MAP_SNAPSHOT, followed by a sampling interval in milliseconds as
+// an int, to read the results of queryType from shared memory instead of the
+// socket. The server answers with an empty response, and passes a read-only
+// file descriptor of a shared memory region with it as SCM_RIGHTS ancillary
+// data. The region holds an NVQRSnapshotHeader followed by the latest result
+// of queryType, which the server updates with every result it obtains for
+// queryType, and samples by itself at the given interval (subject to
+// NVQR_MIN_SUBSCRIBE_INTERVAL_MS) while the connection stays open or until
+// NVQR_QUERY_UNSUBSCRIBE. The connection may be used for other commands in
+// the meantime, but not to subscribe or to map another snapshot.
+//
+// The header is a sequence lock: the server makes sequence odd before it
+// writes a result and even again after, so a reader that sees the same even
+// sequence before and after copying the result has a consistent copy. A
+// sequence of 0 means no result has been written yet. The region grows when
+// a result does not fit, so a reader whose mapping is too small for cnt words
+// has to map it again, with the size of the file.
+#define NVQR_SNAPSHOT_MAGIC         0x5351564e      // "NVQS"
+
+typedef struct NVQRSnapshotHeaderRec {
+    unsigned int    magic;
+    unsigned int    sequence;
+    int             queryType;
+    int             cnt;
+    long long       timestampUs;    // clock of nvqr_ipc_get_time_us()
+} NVQRSnapshotHeader;
+
+// Sample history (Unix only). If NVQR_HISTORY_INTERVAL_MS is set in the
+// environment of the process, the server samples the per-device totals of
+// GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV in the background at that interval,
+// and keeps the latest samples in a ring. Each sample is numbered, starting
+// from 0. NVQR_QUERY_HISTORY is followed by the number of the first sample
+// wanted as a 64-bit value of two ints, low word first, and does not need
+// NVQR_QUERY_CONNECT first, like NVQR_QUERY_STATS. The response holds
+// NVQR_HISTORY_VERSION, the sampling interval in milliseconds (0 if history
+// is not being kept), the number of the first sample returned as two words,
+// low word first (later than the one asked for if that has already been
+// overwritten), and the number of samples, followed by the samples from then
+// on, oldest first, each of NVQR_HISTORY_SAMPLE_LEN words: the time of the
+// sample on the clock of nvqr_ipc_get_time_us() as two words, low word first,
+// the number of devices, and the total allocations, vidmem in use in kiB and
+// free vidmem in kiB of each of the first NVQR_HISTORY_MAX_DEVICES devices.
+#define NVQR_HISTORY_VERSION        1
+#define NVQR_HISTORY_MAX_DEVICES    4
+#define NVQR_HISTORY_HEADER_LEN     5
+#define NVQR_HISTORY_SAMPLE_LEN     (3 + 3 * NVQR_HISTORY_MAX_DEVICES)
+
+// Peak usage (Unix only). The server keeps the highest vidmem usage seen in
+// any GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV result, whether queried by a
+// client or sampled for the history, with the time it was first seen: for
+// each device, for each object type on each device (the sum of its vidmem
+// detail blocks), and for each tag. NVQR_QUERY_PEAKS does not need
+// NVQR_QUERY_CONNECT first. The response holds NVQR_PEAKS_VERSION and the
+// number of peaks, followed by that many peaks of NVQR_PEAK_LEN words each:
+// its NVQRPeakKind, the device, the object type or tag ID (0 for a device),
+// the peak usage in kiB, the time on the clock of nvqr_ipc_get_time_us() as
+// two words, low word first, and the NUL-padded name of a tag, truncated to
+// NVQR_PEAK_TAG_LEN bytes.
+#define NVQR_PEAKS_VERSION          1
+#define NVQR_PEAKS_HEADER_LEN       2
+#define NVQR_PEAK_TAG_LEN           32
+#define NVQR_PEAK_LEN               (6 + NVQR_PEAK_TAG_LEN / 4)
+
+typedef enum {
+    NVQR_PEAK_DEVICE = 0,
+    NVQR_PEAK_OBJECT_TYPE,
+    NVQR_PEAK_TAG
+} NVQRPeakKind;
+
+// Server statistics (Unix only). NVQR_QUERY_STATS does not need
+// NVQR_QUERY_CONNECT first; on a connection that is not connected, the server
+// closes the connection after responding. The response holds
+// NVQR_STATS_VERSION, the number of counters, the number of histograms and
+// the number of buckets per histogram, followed by the counters and then, for
+// each histogram, the number of samples, their sum and maximum, and the count
+// of each bucket, all as 64-bit values of two words each, low word first.
+// Histograms are of durations in microseconds, bucketed by
+// nvqr_ipc_histogram_bucket().
+#define NVQR_STATS_VERSION          1
+
+typedef enum {
+    NVQR_STAT_CONNECTIONS = 0,      // connections accepted
+    NVQR_STAT_COMMANDS,             // commands received
+    NVQR_STAT_QUERIES,              // query results sent
+    NVQR_STAT_CACHE_HITS,           // results served from the cache
+    NVQR_STAT_COALESCED,            // results shared with a query in flight
+    NVQR_STAT_BACKEND_QUERIES,      // calls into the query backend
+    NVQR_STAT_ERRORS,               // commands that failed
+    NVQR_STAT_BYTES_SENT,           // response bytes written
+    NVQR_STAT_THROTTLED,            // commands refused by admission control
+    NVQR_STAT_SAMPLES,              // results checked for subscribers
+    NVQR_STAT_UPDATES,              // results pushed to subscribers
+    NVQR_STAT_SNAPSHOTS,            // results written to shared snapshots
+    NVQR_STAT_HISTORY_SAMPLES,      // samples added to the history
+    NVQR_NUM_STATS
+} NVQRStatCounter;
+
+typedef enum {
+    NVQR_HIST_QUEUE_WAIT = 0,       // job waiting for the GL worker thread
+    NVQR_HIST_CONTEXT,              // acquiring the backend's context
+    NVQR_HIST_BACKEND_QUERY,        // one call into the query backend
+    NVQR_HIST_COMPLETION,           // completed job waiting for the server
+    NVQR_HIST_SEND,                 // writing a response to the socket
+    NVQR_HIST_TOTAL,                // command received until response sent
+    NVQR_NUM_HISTOGRAMS
+} NVQRStatHistogram;
+
+#define NVQR_HIST_BUCKETS           128
+
+#define NVQR_STATS_LEN              (4 + 2 * NVQR_NUM_STATS + \
+                                     2 * NVQR_NUM_HISTOGRAMS * \
+                                     (3 + NVQR_HIST_BUCKETS))
+
 #endif
@@ -35,11 +35,52 @@ typedef DWORD pid_t;
 
 typedef enum {
     NVQR_SUCCESS = 0,
+    NVQR_IN_PROGRESS = 1,
     NVQR_ERROR_INVALID_ARGUMENT = 2,
     NVQR_ERROR_NOT_SUPPORTED = 3,
+    NVQR_ERROR_INSUFFICIENT_BUFFER = 4,
+    NVQR_ERROR_TIMEOUT = 5,
+    NVQR_ERROR_THROTTLED = 6,
     NVQR_ERROR_UNKNOWN = 999,
 } nvqrReturn_t;
 
+typedef enum {
+    NVQR_FORMAT_JSON = 1,   // one JSON object per line
+    NVQR_FORMAT_CSV,        // one row per device, detail block and tag
+    NVQR_FORMAT_BINARY,     // NVQRBinaryRecordHeader and friends
+} nvqrFormat_t;
+
+// A growable buffer that formatted records are appended to. Zero initialize it
+// before first use; the caller consumes the first len bytes of data and then
+// sets len back to 0, so that the memory is reused for the next record.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+
+    // Scratch space for decoding query results, reused between records
+    NVQRDeviceRecord *devices;
+    NVQRDetailRecord *details;
+    NVQRTagRecord *tags;
+    int maxDevices, maxDetails, maxTags;
+} NVQROutputBuffer;
+
+#define NVQR_PROCESS_NAME_LEN   256
+#define NVQR_PROCESS_COMM_LEN   16
+#define NVQR_PROCESS_CGROUP_LEN 256
+
+// Metadata about a process, as returned by nvqr_get_process_info(). The start
+// time is in clock ticks since boot, and fields that could not be determined
+// are 0, -1 or empty, as appropriate.
+typedef struct {
+    pid_t pid;
+    unsigned long long startTime;
+    char name[NVQR_PROCESS_NAME_LEN];       // argv[0], without leading path
+    char comm[NVQR_PROCESS_COMM_LEN];       // the kernel's name for it
+    long uid;                               // real user ID
+    char cgroup[NVQR_PROCESS_CGROUP_LEN];   // control group path
+} NVQRProcessInfo;
+
 typedef struct {
     pid_t pid;
     char *process_name;
@@ -49,6 +90,10 @@ typedef struct {
 #else
     int server_handle;
 #endif
+    struct NVQRAsyncStateRec *async; // NULL for blocking connections
+    struct NVQRDeltaStateRec *delta; // NULL unless delta responses are used
+    struct NVQRPipelineStateRec *pipeline; // NULL unless shared by threads
+    struct NVQRClientStatsRec *stats; // NULL unless kept per connection
 } NVQRConnection;
 
 //------------------------------------------------------------------------------
@@ -66,13 +111,438 @@ nvqrReturn_t nvqr_connect(NVQRConnection *connection, pid_t pid);
 
 nvqrReturn_t nvqr_disconnect(NVQRConnection *connection);
 
+//------------------------------------------------------------------------------
+// On Unix, the preload DSO may be configured to limit how often each user and
+// connection may query the process, and how many queries may keep its GL
+// worker thread busy. A query that it refuses fails with
+// NVQR_ERROR_THROTTLED, and its result is a single word: the number of
+// microseconds after which to retry it. nvqr_request_meminfo() sets buf->op
+// to NVQR_QUERY_THROTTLED and stores it in buf->data[0]; the other query
+// functions return it as their data, *buffer for batches, and pass it to the
+// callback of nvqr_query_pids(). Connecting fails with NVQR_ERROR_THROTTLED
+// if the user already has as many connections to the process as allowed.
+
 //------------------------------------------------------------------------------
 // Perform a glQueryResourceNV() query in the remote OpenGL process. The
-// process must be in the connected state when performing the query.
+// process must be in the connected state when performing the query. If the
+// result is longer than NVQR_MAX_DATA_BUFFER_LEN words, only that many words
+// are returned, buf->cnt is set to the full length of the result, and
+// NVQR_ERROR_INSUFFICIENT_BUFFER is returned.
 
 nvqrReturn_t nvqr_request_meminfo(NVQRConnection c, GLenum queryType,
                                   NVQRQueryDataBuffer *buf);
 
+//------------------------------------------------------------------------------
+// Like nvqr_request_meminfo(), but return the result, however long, in a newly
+// heap-allocated buffer of *cnt words. The caller is responsible for freeing
+// the buffer.
+
+nvqrReturn_t nvqr_request_meminfo_alloc(NVQRConnection c, GLenum queryType,
+                                        NVQRQueryData_t **data, int *cnt);
+
+//------------------------------------------------------------------------------
+// Ask the server to send only what changed since the previous result in
+// response to further queries on a connection opened with nvqr_connect(), and
+// rebuild the full result on this side. This saves bandwidth and copying when
+// a process is queried at a high rate. Results are returned exactly as
+// without delta responses. Returns NVQR_ERROR_NOT_SUPPORTED on Windows.
+
+nvqrReturn_t nvqr_enable_delta(NVQRConnection *connection);
+
+//------------------------------------------------------------------------------
+// Allow a connection opened with nvqr_connect() to be shared between threads.
+// Afterwards, any number of threads may call nvqr_request_meminfo(),
+// nvqr_request_meminfo_alloc() and nvqr_request_meminfo_batch() on the
+// connection at the same time: their commands are pipelined on the one
+// socket, and each response is matched to its command by request ID. The
+// connection must not be used for anything else while it is shared, and must
+// only be disconnected once no other thread is using it. Cannot be combined
+// with delta responses. Returns NVQR_ERROR_NOT_SUPPORTED on Windows.
+
+nvqrReturn_t nvqr_enable_pipelining(NVQRConnection *connection);
+
+//------------------------------------------------------------------------------
+// A pool of connections, for tools that query many processes repeatedly and
+// want to keep their connections open (Unix only; on Windows these functions
+// return NVQR_ERROR_NOT_SUPPORTED). The pool may be used from any thread.
+//
+// nvqr_pool_acquire() hands out an idle connection to the process, after
+// checking that the process is still the one the connection was opened to
+// (by pid and start time) and that the server has not closed it, or opens a
+// new one. The connection is for the exclusive use of the caller until it is
+// given back with nvqr_pool_release(), along with the result of the last
+// operation on it; connections that had an error are closed rather than
+// reused. nvqr_pool_evict() closes the connections that have been idle for
+// longer than the maxIdleMs given to nvqr_pool_create() (negative for no
+// limit), and those to processes that have exited, and returns how many were
+// closed; call it periodically. All connections must have been released
+// before the pool is destroyed.
+
+typedef struct NVQRPoolRec NVQRPool;
+
+nvqrReturn_t nvqr_pool_create(NVQRPool **pool, int maxIdleMs);
+void nvqr_pool_destroy(NVQRPool *pool);
+nvqrReturn_t nvqr_pool_acquire(NVQRPool *pool, pid_t pid,
+                               NVQRConnection **connection);
+void nvqr_pool_release(NVQRPool *pool, NVQRConnection *connection,
+                       nvqrReturn_t result);
+int nvqr_pool_evict(NVQRPool *pool);
+
+//------------------------------------------------------------------------------
+// The result of one query type of a batch. On success, data points at the cnt
+// words returned by glQueryResourceNV() for queryType.
+
+typedef struct {
+    GLenum queryType;
+    nvqrReturn_t result;
+    const NVQRQueryData_t *data;
+    int cnt;
+} NVQRBatchResult;
+
+//------------------------------------------------------------------------------
+// Perform the glQueryResourceNV() queries for count (at most
+// NVQR_MAX_BATCH_TYPES) query types in a single round trip, filling in one
+// entry of results for each of them, in order. The results point into a
+// newly heap-allocated *buffer, which the caller is responsible for freeing.
+// A query type that fails does not fail the others. Returns
+// NVQR_ERROR_NOT_SUPPORTED on Windows.
+
+nvqrReturn_t nvqr_request_meminfo_batch(NVQRConnection c,
+                                        const GLenum *queryTypes, int count,
+                                        NVQRBatchResult *results,
+                                        NVQRQueryData_t **buffer);
+
+//------------------------------------------------------------------------------
+// Like nvqr_request_meminfo_batch(), but without the need to connect to the
+// process first: the connection is set up, queried and torn down with a
+// single command, for tools that query a process only once.
+
+nvqrReturn_t nvqr_query_oneshot(pid_t pid, const GLenum *queryTypes,
+                                int count, NVQRBatchResult *results,
+                                NVQRQueryData_t **buffer);
+
+//------------------------------------------------------------------------------
+// Called by nvqr_query_pids() with the outcome of the query of each process.
+// On success, data holds the cnt words returned by glQueryResourceNV(); data
+// and process_name (which may be NULL) are only valid during the call.
+
+typedef void (*nvqrQueryCallback)(pid_t pid, const char *process_name,
+                                  nvqrReturn_t result,
+                                  const NVQRQueryData_t *data, int cnt,
+                                  void *user_data);
+
+//------------------------------------------------------------------------------
+// Perform a glQueryResourceNV() query in each of count OpenGL processes,
+// without the need to connect to them first. On Unix, the processes are
+// queried concurrently over non-blocking connections, so the whole batch
+// takes about as long as the slowest single query. The callback is invoked
+// from the calling thread as each result arrives. Processes that have not
+// answered within timeoutMs milliseconds fail with NVQR_ERROR_TIMEOUT; pass
+// a negative timeout to wait indefinitely.
+
+nvqrReturn_t nvqr_query_pids(const pid_t *pids, int count, GLenum queryType,
+                             int timeoutMs, nvqrQueryCallback callback,
+                             void *user_data);
+
+//------------------------------------------------------------------------------
+// Look up metadata about a process. On Linux, the metadata is cached per pid
+// and process start time, so that repeated lookups only cost a read of
+// /proc/<pid>/stat, and a pid that has been reused by a new process is looked
+// up afresh. The cache may be used from any thread. Returns
+// NVQR_ERROR_INVALID_ARGUMENT if there is no such process. Elsewhere, only
+// the name is filled in, and nothing is cached.
+
+nvqrReturn_t nvqr_get_process_info(pid_t pid, NVQRProcessInfo *info);
+
+//------------------------------------------------------------------------------
+// Empty the process metadata cache, freeing its memory.
+
+void nvqr_clear_process_cache(void);
+
+//------------------------------------------------------------------------------
+// Find the processes that are ready to be queried, i.e. those that have the
+// preload DSO loaded on Unix, or that are served by the driver on Windows. On
+// Linux, this takes a single pass over /proc/net/unix rather than probing
+// each process. Returns a newly heap-allocated, sorted array of *count pids,
+// which the caller is responsible for freeing.
+
+nvqrReturn_t nvqr_find_processes(pid_t **pids, int *count);
+
+//------------------------------------------------------------------------------
+// A histogram of durations in microseconds, in the log-linear buckets of
+// nvqr_ipc_histogram_bucket().
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long sumUs;
+    unsigned long long maxUs;
+    unsigned long long buckets[NVQR_HIST_BUCKETS];
+} NVQRHistogram;
+
+//------------------------------------------------------------------------------
+// The statistics kept by the preload DSO in a process: the NVQRStatCounter
+// counters, and the NVQRStatHistogram histograms of the time spent in each
+// stage of serving a command, all since the process started.
+
+typedef struct {
+    unsigned long long counters[NVQR_NUM_STATS];
+    NVQRHistogram histograms[NVQR_NUM_HISTOGRAMS];
+} NVQRServerStats;
+
+//------------------------------------------------------------------------------
+// Fetch the statistics of the preload DSO in a process, without the need to
+// connect to it first. Returns NVQR_ERROR_NOT_SUPPORTED on Windows.
+
+nvqrReturn_t nvqr_query_stats(pid_t pid, NVQRServerStats *stats);
+
+//------------------------------------------------------------------------------
+// A sample of the history kept by the preload DSO in a process started with
+// NVQR_HISTORY_INTERVAL_MS set: its number in the history, the time it was
+// taken on the clock of nvqr_ipc_get_time_us(), and the totals of the first
+// numDevices devices (at most NVQR_HISTORY_MAX_DEVICES).
+
+typedef struct {
+    NVQRQueryData_t totalAllocs;
+    NVQRQueryData_t vidMemUsedkiB;
+    NVQRQueryData_t vidMemFreekiB;
+} NVQRHistoryDevice;
+
+typedef struct {
+    unsigned long long sequence;
+    long long timestampUs;
+    int numDevices;
+    NVQRHistoryDevice devices[NVQR_HISTORY_MAX_DEVICES];
+} NVQRHistorySample;
+
+//------------------------------------------------------------------------------
+// Fetch the samples in the history of a process from the one numbered since
+// onwards, oldest first, without the need to connect to it first. Samples that
+// have already dropped out of the history are skipped, which shows as a gap
+// in their numbers. Pass 0 to fetch the whole history, and the number of the
+// last sample plus one to fetch only newer ones later on. Returns a newly
+// heap-allocated array of *count samples, which the caller is responsible
+// for freeing, and NVQR_ERROR_NOT_SUPPORTED if the process keeps no history
+// or on Windows.
+
+nvqrReturn_t nvqr_query_history(pid_t pid, unsigned long long since,
+                                NVQRHistorySample **samples, int *count);
+
+//------------------------------------------------------------------------------
+// The highest vidmem usage of a device, of an object type on a device, or of a
+// tag seen by the preload DSO in a process, and the time it was first seen on
+// the clock of nvqr_ipc_get_time_us(). id is the object type or tag ID, and
+// tag the name of a tag, truncated to NVQR_PEAK_TAG_LEN bytes.
+
+typedef struct {
+    NVQRPeakKind kind;
+    int device;
+    NVQRQueryData_t id;
+    NVQRQueryData_t peakkiB;
+    long long timestampUs;
+    char tag[NVQR_PEAK_TAG_LEN + 1];
+} NVQRPeak;
+
+//------------------------------------------------------------------------------
+// Fetch the peak usage seen by the preload DSO in a process since it started,
+// in the results of every query made by any client and of every sample taken
+// for its history, without the need to connect to it first. Returns a newly
+// heap-allocated array of *count peaks, which the caller is responsible for
+// freeing. Returns NVQR_ERROR_NOT_SUPPORTED on Windows.
+
+nvqrReturn_t nvqr_query_peaks(pid_t pid, NVQRPeak **peaks, int *count);
+
+//------------------------------------------------------------------------------
+// Estimate the given percentile (0 to 100) of the durations in a histogram, as
+// the upper bound of the bucket it falls into. Returns 0 for an empty
+// histogram.
+
+double nvqr_histogram_percentile(const NVQRHistogram *histogram,
+                                 double percentile);
+
+//------------------------------------------------------------------------------
+// The statistics kept by this library about its own connections, for telling
+// a slow or failing monitoring pipeline apart from slow or failing processes.
+// Requests are the commands sent on connections (or with nvqr_query_oneshot(),
+// nvqr_query_pids(), nvqr_query_stats(), nvqr_query_history() and
+// nvqr_query_peaks()) other than those that connect and disconnect;
+// connecting is counted separately. Retries are connection attempts repeated
+// because the target's listen backlog was full, and the resynchronizations of
+// connections with delta responses after a failure.
+// Bytes are those of the commands and responses of the protocol.
+
+typedef enum {
+    NVQR_CLIENT_STAT_CONNECTS = 0,
+    NVQR_CLIENT_STAT_CONNECT_FAILURES,
+    NVQR_CLIENT_STAT_REQUESTS,
+    NVQR_CLIENT_STAT_FAILURES,      // requests that failed, timeouts included
+    NVQR_CLIENT_STAT_TIMEOUTS,      // of requests and of connecting
+    NVQR_CLIENT_STAT_RETRIES,
+    NVQR_CLIENT_STAT_BYTES_SENT,
+    NVQR_CLIENT_STAT_BYTES_RECEIVED,
+    NVQR_CLIENT_STAT_THROTTLED,     // requests and connects refused by the
+                                    // server's admission control
+    NVQR_NUM_CLIENT_STATS
+} NVQRClientStatCounter;
+
+typedef enum {
+    NVQR_CLIENT_HIST_CONNECT = 0,   // successful connections, handshake
+                                    // included
+    NVQR_CLIENT_HIST_ROUND_TRIP,    // requests, from sending the command to
+                                    // the end of the response or the failure
+    NVQR_NUM_CLIENT_HISTOGRAMS
+} NVQRClientStatHistogram;
+
+typedef struct {
+    unsigned long long counters[NVQR_NUM_CLIENT_STATS];
+    NVQRHistogram histograms[NVQR_NUM_CLIENT_HISTOGRAMS];
+} NVQRClientStats;
+
+//------------------------------------------------------------------------------
+// Take a snapshot of the statistics of all connections of this process, and
+// if reset is nonzero, start them over. The statistics are updated with
+// atomic operations rather than under a lock, so they may be read and reset
+// from any thread while queries are in progress; nothing is lost or counted
+// twice across a reset, but a snapshot taken during a query may, for
+// instance, count its request without its bytes yet.
+
+void nvqr_get_client_stats(NVQRClientStats *stats, int reset);
+
+//------------------------------------------------------------------------------
+// Keep statistics for each connection opened from now on (if enable is
+// nonzero) or not, in addition to those of the process as a whole. This
+// costs a few kilobytes per connection. nvqr_get_connection_stats() then
+// takes a snapshot of the statistics of a connection, like
+// nvqr_get_client_stats(); for a connection from a pool, do so before
+// releasing it. Returns NVQR_ERROR_NOT_SUPPORTED for connections opened
+// while statistics were not kept per connection.
+
+void nvqr_enable_connection_stats(int enable);
+nvqrReturn_t nvqr_get_connection_stats(NVQRConnection connection,
+                                       NVQRClientStats *stats, int reset);
+
+//------------------------------------------------------------------------------
+// Non-blocking API, for querying processes from an existing event loop (Unix
+// only; on Windows these functions return NVQR_ERROR_NOT_SUPPORTED).
+//
+// nvqr_connect_async() starts connecting to a process and returns
+// NVQR_IN_PROGRESS. The caller then polls nvqr_get_fd() for
+// nvqr_get_poll_events(), waking up no later than nvqr_get_timeout()
+// milliseconds from now (-1 means no limit), and calls
+// nvqr_complete_connect() until it returns something other than
+// NVQR_IN_PROGRESS. Queries work the same way: nvqr_begin_request_meminfo()
+// sends the query, and nvqr_complete_request_meminfo() returns NVQR_SUCCESS
+// with a newly heap-allocated result once it has arrived. Each operation
+// fails with NVQR_ERROR_TIMEOUT if it is not complete within its timeoutMs
+// milliseconds (negative for no limit), after which the connection can only
+// be closed with nvqr_disconnect(), which never blocks on these connections.
+// A connection must only be used by one thread at a time.
+
+nvqrReturn_t nvqr_connect_async(NVQRConnection *connection, pid_t pid,
+                                int timeoutMs);
+nvqrReturn_t nvqr_complete_connect(NVQRConnection *connection);
+nvqrReturn_t nvqr_begin_request_meminfo(NVQRConnection *connection,
+                                        GLenum queryType, int timeoutMs);
+nvqrReturn_t nvqr_complete_request_meminfo(NVQRConnection *connection,
+                                           NVQRQueryData_t **data, int *cnt);
+
+int nvqr_get_fd(NVQRConnection connection);
+int nvqr_get_poll_events(NVQRConnection connection);
+int nvqr_get_timeout(NVQRConnection connection);
+
+//------------------------------------------------------------------------------
+// Subscribe a connection opened with nvqr_connect() to the results of a query
+// type (Unix only; on Windows these functions return
+// NVQR_ERROR_NOT_SUPPORTED). Instead of being queried, the preload DSO then
+// samples the result itself, at most every params->intervalMs milliseconds,
+// and pushes it to the connection whenever the usage of a device, detail
+// block or tag selected by params->watch has changed by at least
+// params->thresholdKiB kiB or params->thresholdPct percent. nvqr_subscribe()
+// returns the current result; nvqr_wait_update() waits at most timeoutMs
+// milliseconds (negative for no limit) for the next one, or fails with
+// NVQR_ERROR_TIMEOUT. The results are newly heap-allocated buffers of *cnt
+// words, which the caller is responsible for freeing. To wait for updates
+// from an event loop, poll nvqr_get_fd() for POLLIN and then call
+// nvqr_wait_update() with a timeout of 0. Until nvqr_unsubscribe(), the
+// connection takes no other requests. Delta responses are enabled on the
+// connection, and pipelined connections cannot subscribe.
+
+nvqrReturn_t nvqr_subscribe(NVQRConnection *connection, GLenum queryType,
+                            const NVQRSubscribeParams *params,
+                            NVQRQueryData_t **data, int *cnt);
+nvqrReturn_t nvqr_wait_update(NVQRConnection *connection, int timeoutMs,
+                              NVQRQueryData_t **data, int *cnt);
+nvqrReturn_t nvqr_unsubscribe(NVQRConnection *connection);
+
+//------------------------------------------------------------------------------
+// Read the results of a query type from memory shared with the OpenGL process
+// rather than over its socket (Unix only; on Windows these functions return
+// NVQR_ERROR_NOT_SUPPORTED), for tools that sample a process at very high
+// rates. nvqr_map_snapshot() maps the shared snapshot of queryType through a
+// connection opened with nvqr_connect(). The preload DSO writes every result
+// it obtains for queryType to the snapshot, and samples queryType by itself
+// every intervalMs milliseconds while the connection stays open.
+// nvqr_read_snapshot() then copies the latest result into data without any
+// system call, filling in info with its length, the time since it was
+// sampled, and a generation that changes with every new result. It returns
+// NVQR_IN_PROGRESS if there is no result yet, and
+// NVQR_ERROR_INSUFFICIENT_BUFFER if the result is longer than maxCnt words,
+// in which case only its first maxCnt words are copied. A snapshot must only
+// be read by one thread at a time, and stays readable after the connection
+// is closed, but is no longer updated then. The connection may still be used
+// for other queries, but cannot map another snapshot or subscribe.
+
+typedef struct NVQRSnapshotRec NVQRSnapshot;
+
+typedef struct {
+    int cnt;
+    int sampleAgeUs;
+    unsigned int generation;
+} NVQRSnapshotInfo;
+
+nvqrReturn_t nvqr_map_snapshot(NVQRConnection *connection, GLenum queryType,
+                               int intervalMs, NVQRSnapshot **snapshot);
+nvqrReturn_t nvqr_read_snapshot(NVQRSnapshot *snapshot,
+                                NVQRQueryData_t *data, int maxCnt,
+                                NVQRSnapshotInfo *info);
+void nvqr_unmap_snapshot(NVQRSnapshot *snapshot);
+
+//------------------------------------------------------------------------------
+// Decode the cnt words of data returned from glQueryResourceNV() (for example,
+// buf->data and buf->cnt from nvqr_request_meminfo()) into the caller-provided
+// arrays of parsed, in a single pass and without allocating any memory. Every
+// block size and tag length is checked against cnt, and malformed data is
+// rejected with NVQR_ERROR_INVALID_ARGUMENT; data in a format version other
+// than NVQR_DATA_FORMAT_VERSION fails with NVQR_ERROR_NOT_SUPPORTED. If any of
+// the arrays is too small, as many records as fit are stored, the totals are
+// still counted, and NVQR_ERROR_INSUFFICIENT_BUFFER is returned.
+
+nvqrReturn_t nvqr_parse_memory_info(const NVQRQueryData_t *data, int cnt,
+                                    NVQRParsedData *parsed);
+
+//------------------------------------------------------------------------------
+// Append the cnt words of a glQueryResourceNV() result to out as a record in
+// the given format, labelled with the pid and name (which may be NULL) of the
+// process and a timestamp in microseconds since the Unix epoch. If the result
+// cannot be decoded, an error from nvqr_parse_memory_info() is returned and
+// nothing is appended.
+
+nvqrReturn_t nvqr_format_memory_info(NVQROutputBuffer *out,
+                                     nvqrFormat_t format, pid_t pid,
+                                     const char *process_name,
+                                     long long timestampUs,
+                                     const NVQRQueryData_t *data, int cnt);
+
+//------------------------------------------------------------------------------
+// Append anything that must precede the first record in the given format: the
+// header row for NVQR_FORMAT_CSV, and nothing for the other formats.
+
+nvqrReturn_t nvqr_format_header(NVQROutputBuffer *out, nvqrFormat_t format);
+
+//------------------------------------------------------------------------------
+// Free the memory held by an output buffer, leaving it ready for reuse.
+
+void nvqr_free_output_buffer(NVQROutputBuffer *out);
+
 //------------------------------------------------------------------------------
 // Decode and print out the dta buffer returned from glQueryResourceNV()
 // 
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// The GLX backend: resource queries are made through a GLX context created on
+// the default X display, which the GL worker thread keeps current for as long
+// as it runs.
+//
+// The DSO does not link against libGL or libX11, which would have to be
+// loaded and relocated in every process it is preloaded into. Their entry
+// points are resolved when the first client connects instead: from the
+// libraries the application has loaded already, or else by loading them on
+// the worker thread. Setting NVQR_EAGER_INIT=1 resolves them from the DSO
+// constructor, and calls XInitThreads() there too; this is only needed with
+// Xlib versions before 1.8, which do not initialize thread support by
+// themselves, for applications that make Xlib calls on several threads without
+// calling XInitThreads() first.
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <dlfcn.h>
+#include <X11/Xlib.h>
+#include <GL/gl.h>
+#include <GL/glx.h>
+
+#include "nvidia-query-resource-opengl-backend.h"
+
+/* XXX GL_NV_query_resource defines - these should be removed once the
+ * extension has been finalized and these values become part of real 
+ * OpenGL header files. */
+#ifndef GL_NV_query_resource
+#define GL_NV_query_resource 1
+
+#ifdef GL_GLEXT_PROTOTYPES
+GLAPI GLint GLAPIENTRY glQueryResourceNV (GLenum queryType, GLuint pname, GLuint bufSize, GLint *buffer);
+#endif /* GL_GLEXT_PROTOTYPES */
+typedef GLint (GLAPIENTRYP PFNGLQUERYRESOURCENVPROC) (GLenum queryType, GLuint pname, GLuint bufSize, GLint *buffer);
+
+#endif
+
+#define NVQR_EXTENSION ((const GLubyte *)"glQueryResourceNV")
+
+#define NVQR_LIBGL "libGL.so.1"
+#define NVQR_LIBX11 "libX11.so.6"
+
+static PFNGLQUERYRESOURCENVPROC glQueryResourceNV = NULL;
+
+// The Xlib and GLX entry points used by the backend
+static struct {
+    Status (*XInitThreads)(void);
+    Display *(*XOpenDisplay)(const char *display_name);
+    int (*XCloseDisplay)(Display *dpy);
+    int (*XFree)(void *data);
+    void (*(*glXGetProcAddressARB)(const GLubyte *procName))(void);
+    XVisualInfo *(*glXChooseVisual)(Display *dpy, int screen,
+                                    int *attribList);
+    GLXContext (*glXCreateContext)(Display *dpy, XVisualInfo *vis,
+                                   GLXContext shareList, Bool direct);
+    void (*glXDestroyContext)(Display *dpy, GLXContext ctx);
+    Bool (*glXMakeCurrent)(Display *dpy, GLXDrawable drawable,
+                           GLXContext ctx);
+} glx;
+
+// Whether the entry points have been loaded: 0 if not yet tried, 1 if they
+// were, and -1 if that failed.
+static int glx_loaded = 0;
+
+// X11/GLX resources: these are only touched by the GL worker thread.
+static Display *dpy = NULL;
+static GLXContext ctx = NULL;
+
+
+//------------------------------------------------------------------------------
+// Look up a symbol among the libraries already loaded into the process, and
+// failing that in the given library, which is loaded on first use.
+static void *resolve(void **handle, const char *library, const char *name)
+{
+    void *sym = dlsym(RTLD_DEFAULT, name);
+
+    if (!sym) {
+        if (!*handle) {
+            *handle = dlopen(library, RTLD_LAZY);
+        }
+        if (*handle) {
+            sym = dlsym(*handle, name);
+        }
+    }
+
+    if (!sym) {
+        error_msg("failed to resolve %s from %s", name, library);
+    }
+    return sym;
+}
+
+
+//------------------------------------------------------------------------------
+// Resolve the Xlib and GLX entry points and the query entry point, and
+// initialize Xlib for use from the worker thread. This is only done once;
+// later calls return the result of the first.
+static bool load_glx(void)
+{
+    static void *libgl = NULL, *libx11 = NULL;
+    bool ok = true;
+
+    if (glx_loaded) {
+        return glx_loaded > 0;
+    }
+
+#define LOAD(handle, library, fn) \
+    ok = ok && (*(void **) &glx.fn = resolve(&handle, library, #fn)) != NULL
+
+    LOAD(libx11, NVQR_LIBX11, XInitThreads);
+    LOAD(libx11, NVQR_LIBX11, XOpenDisplay);
+    LOAD(libx11, NVQR_LIBX11, XCloseDisplay);
+    LOAD(libx11, NVQR_LIBX11, XFree);
+    LOAD(libgl, NVQR_LIBGL, glXGetProcAddressARB);
+    LOAD(libgl, NVQR_LIBGL, glXChooseVisual);
+    LOAD(libgl, NVQR_LIBGL, glXCreateContext);
+    LOAD(libgl, NVQR_LIBGL, glXDestroyContext);
+    LOAD(libgl, NVQR_LIBGL, glXMakeCurrent);
+#undef LOAD
+
+    if (ok) {
+        glQueryResourceNV = (PFNGLQUERYRESOURCENVPROC)
+            glx.glXGetProcAddressARB(NVQR_EXTENSION);
+
+        if (glQueryResourceNV == NULL) {
+            // XXX should check extension string once extension is exported
+            // there
+            error_msg("failed to load %s", NVQR_EXTENSION);
+            ok = false;
+        }
+    }
+
+    if (ok && !glx.XInitThreads()) {
+        error_msg("failed to initialize X threads.");
+        ok = false;
+    }
+
+    glx_loaded = ok ? 1 : -1;
+    return ok;
+}
+
+
+//------------------------------------------------------------------------------
+// Nothing needs to be done until the first client connects, unless eager
+// initialization was requested.
+static bool glx_init(void)
+{
+    if (get_env_int("NVQR_EAGER_INIT", 0, 0, 1)) {
+        return load_glx();
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Release any X11/GLX resources that have been created
+static void glx_release_context(void)
+{
+    if (ctx) {
+        glx.glXDestroyContext(dpy, ctx);
+        ctx = NULL;
+    }
+    if (dpy) {
+        glx.XCloseDisplay(dpy);
+        dpy = NULL;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Load the GLX entry points if that has not been done yet, then create the
+// GLX context that will be used to service query requests and make it
+// current to the calling thread, where it stays current until the process
+// exits. Returns false on failure, leaving any partially created resources
+// to glx_release_context().
+static bool glx_acquire_context(void)
+{
+    int screen;
+    XVisualInfo *visual;
+    static int attribs[] = { GLX_RGBA, None };
+
+    if (!load_glx()) {
+        return false;
+    }
+
+    // connect to X and create a GLX context
+    // XOpenDisplay(NULL) + DefaultScreen(dpy) may not give same display app
+    // is using: may need to revisit this if issues come up
+    dpy = glx.XOpenDisplay(NULL);
+    if (dpy == NULL) {
+        error_msg("failed to open X11 display");
+        return false;
+    }
+    screen = DefaultScreen(dpy);
+
+    visual = glx.glXChooseVisual(dpy, screen, attribs);
+    if (visual == NULL) {
+        error_msg("failed to choose a GLX visual");
+        return false;
+    }
+
+    ctx = glx.glXCreateContext(dpy, visual, NULL, True);
+    glx.XFree(visual);
+
+    if (ctx == NULL) {
+        error_msg("failed to create GLX context");
+        return false;
+    }
+
+    if (!glx.glXMakeCurrent(dpy, None, ctx)) {
+        error_msg("failed to make GLX context current");
+        return false;
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Query the driver through the current context
+static int glx_query(unsigned int queryType, int len, NVQRQueryData_t *data)
+{
+    if (!ctx) {
+        return 0;
+    }
+
+    return glQueryResourceNV(queryType, -1, len * sizeof(*data), data);
+}
+
+
+//------------------------------------------------------------------------------
+// The context belongs to the worker thread, so leave it to process teardown.
+static void glx_shutdown(void)
+{
+}
+
+
+const NVQRBackend nvqr_glx_backend = {
+    "glx",
+    glx_init,
+    glx_acquire_context,
+    glx_query,
+    glx_release_context,
+    glx_shutdown,
+};
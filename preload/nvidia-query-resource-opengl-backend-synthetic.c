@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// The synthetic backend: generate well-formed results for a configurable
+// number of devices, detail blocks and tags, without an X server or an NVIDIA
+// driver, so that monitoring pipelines can be load tested at realistic scale.
+// It is configured with the following environment variables:
+//
+//   NVQR_SYNTHETIC_DEVICES:       number of devices (default 1)
+//   NVQR_SYNTHETIC_DETAIL_BLOCKS: detail blocks per device (default 4)
+//   NVQR_SYNTHETIC_TAGS:          number of tags (default 4)
+//   NVQR_SYNTHETIC_QUERY_US:      time each query takes (default 0)
+//   NVQR_SYNTHETIC_CHURN_PCT:     percentage of detail blocks whose memory
+//                                 usage changes with each query (default 10)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-backend.h"
+
+#define SYNTHETIC_DEVICE_MEMORY_KIB (8 * 1024 * 1024)
+#define SYNTHETIC_TAG_WORDS 4
+
+#define DEVICE_WORDS ((int) (sizeof(NVQRQueryDeviceInfo) / \
+                             sizeof(NVQRQueryData_t)))
+#define DETAIL_WORDS ((int) (sizeof(NVQRQueryDetailInfo) / \
+                             sizeof(NVQRQueryData_t)))
+#define TAG_WORDS 6
+
+static int num_devices, num_details, num_tags, churn;
+static long query_us;
+
+// The result is generated once, and only the memory usage in it is updated
+// on each query.
+static NVQRQueryData_t *result = NULL;
+static int result_len;
+static unsigned int seed;
+
+
+//------------------------------------------------------------------------------
+// Fill in the fixed parts of the result.
+static void build_result(void)
+{
+    static const NVQRQueryData_t object_types[] = {
+        GL_QUERY_RESOURCE_TEXTURE_NV,
+        GL_QUERY_RESOURCE_RENDERBUFFER_NV,
+        GL_QUERY_RESOURCE_BUFFEROBJECT_NV,
+        GL_QUERY_RESOURCE_SYS_RESERVED_NV,
+    };
+    NVQRQueryData_t *ptr = result;
+    int i, j;
+
+    *ptr++ = sizeof(NVQRQueryDataHeader) / sizeof(NVQRQueryData_t);
+    *ptr++ = NVQR_DATA_FORMAT_VERSION;
+    *ptr++ = num_devices;
+
+    for (i = 0; i < num_devices; i++) {
+        *ptr++ = DEVICE_WORDS + num_details * DETAIL_WORDS;
+        *ptr++ = DEVICE_WORDS;
+        // totalAllocs, vidMemUsedkiB and vidMemFreekiB are set per query
+        ptr += 3;
+        *ptr++ = num_details;
+
+        for (j = 0; j < num_details; j++) {
+            *ptr++ = DETAIL_WORDS;
+            *ptr++ = GL_QUERY_RESOURCE_MEMTYPE_VIDMEM_NV;
+            *ptr++ = object_types[j % 4];
+            *ptr++ = 1 + j % 16;
+            ptr++;
+        }
+    }
+
+    *ptr++ = num_tags;
+    for (i = 0; i < num_tags; i++) {
+        *ptr++ = TAG_WORDS;
+        *ptr++ = i + 1;
+        *ptr++ = i % num_devices;
+        *ptr++ = 1 + i % 8;
+        *ptr++ = 1024 * (1 + i % 8);
+        *ptr++ = SYNTHETIC_TAG_WORDS;
+        snprintf((char *) ptr, SYNTHETIC_TAG_WORDS * sizeof(*ptr),
+                 "tag%d", i + 1);
+        ptr += SYNTHETIC_TAG_WORDS;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Give churn percent of the detail blocks a new memory usage between 1 and 2
+// MiB per allocation, and update the device summaries to match.
+static void update_result(int churn)
+{
+    NVQRQueryData_t *ptr = result + 3;
+    int i, j;
+
+    for (i = 0; i < num_devices; i++) {
+        NVQRQueryDeviceInfo *device = (NVQRQueryDeviceInfo *) ptr;
+
+        device->totalAllocs = 0;
+        device->vidMemUsedkiB = 0;
+        ptr += DEVICE_WORDS;
+
+        for (j = 0; j < num_details; j++) {
+            NVQRQueryDetailInfo *detail = (NVQRQueryDetailInfo *) ptr;
+
+            if ((int) (rand_r(&seed) % 100) < churn) {
+                detail->memUsedkiB = detail->numAllocs *
+                                     (1024 + rand_r(&seed) % 1024);
+            }
+            device->totalAllocs += detail->numAllocs;
+            device->vidMemUsedkiB += detail->memUsedkiB;
+            ptr += DETAIL_WORDS;
+        }
+
+        device->vidMemFreekiB = device->vidMemUsedkiB <
+                                SYNTHETIC_DEVICE_MEMORY_KIB ?
+                                SYNTHETIC_DEVICE_MEMORY_KIB -
+                                device->vidMemUsedkiB : 0;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Read the configuration and allocate the result.
+static bool synthetic_init(void)
+{
+    long len;
+
+    num_devices = get_env_int("NVQR_SYNTHETIC_DEVICES", 1, 1, 64);
+    num_details = get_env_int("NVQR_SYNTHETIC_DETAIL_BLOCKS", 4, 0, 65536);
+    num_tags = get_env_int("NVQR_SYNTHETIC_TAGS", 4, 0, 65536);
+    query_us = get_env_int("NVQR_SYNTHETIC_QUERY_US", 0, 0, 10000000);
+    churn = get_env_int("NVQR_SYNTHETIC_CHURN_PCT", 10, 0, 100);
+
+    len = 3 + (long) num_devices * (DEVICE_WORDS + num_details * DETAIL_WORDS) +
+          1 + (long) num_tags * (TAG_WORDS + SYNTHETIC_TAG_WORDS);
+    if (len > NVQR_MAX_RESPONSE_LEN) {
+        error_msg("synthetic result of %ld words exceeds the maximum "
+                  "response length of %d words.", len, NVQR_MAX_RESPONSE_LEN);
+        return false;
+    }
+
+    result_len = len;
+    result = calloc(result_len, sizeof(*result));
+    if (!result) {
+        error_msg("failed to allocate the synthetic result.");
+        return false;
+    }
+
+    seed = getpid();
+    build_result();
+    update_result(100);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// There is no context to create
+static bool synthetic_acquire_context(void)
+{
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Copy as much of an updated result as fits, after sleeping for the
+// configured query time.
+static int synthetic_query(unsigned int queryType, int len,
+                           NVQRQueryData_t *data)
+{
+    if (queryType != GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV || len <= 0) {
+        return 0;
+    }
+
+    if (query_us) {
+        struct timespec ts;
+
+        ts.tv_sec = query_us / 1000000;
+        ts.tv_nsec = (query_us % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    }
+
+    update_result(churn);
+
+    if (len > result_len) {
+        len = result_len;
+    }
+    memcpy(data, result, len * sizeof(*data));
+    return len;
+}
+
+
+//------------------------------------------------------------------------------
+static void synthetic_release_context(void)
+{
+}
+
+
+//------------------------------------------------------------------------------
+// The result is used by the worker thread, which may still be running, so it
+// is left to process teardown.
+static void synthetic_shutdown(void)
+{
+}
+
+
+const NVQRBackend nvqr_synthetic_backend = {
+    "synthetic",
+    synthetic_init,
+    synthetic_acquire_context,
+    synthetic_query,
+    synthetic_release_context,
+    synthetic_shutdown,
+};
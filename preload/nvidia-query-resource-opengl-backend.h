@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __NVIDIA_QUERY_RESOURCE_OPENGL_BACKEND_H__
+#define __NVIDIA_QUERY_RESOURCE_OPENGL_BACKEND_H__
+
+#include <stdbool.h>
+
+#include "nvidia-query-resource-opengl-preload.h"
+
+//------------------------------------------------------------------------------
+// A source of resource query results for the preload server. The server
+// selects its backend by name from the NVQR_BACKEND environment variable, and
+// defaults to "glx".
+//
+// init() is called from the DSO constructor on the application's main thread,
+// and returns false if the backend cannot be used in this process; no query
+// server is started in that case. As it runs in every process the DSO is
+// preloaded into, before main(), it should be cheap: loading libraries and
+// talking to the driver are best left to acquire_context(). All other
+// functions except shutdown() are only ever called on the GL worker thread:
+// acquire_context() when the first client connects, or for the first sample
+// of the history if one is kept, returning false on failure, and query() for
+// each resource query once a context was acquired. query() has the semantics
+// of glQueryResourceNV(), writing at most len words to data and returning the
+// number of words written, or 0 on failure; results that do not fit are
+// truncated. release_context() drops any state left behind by a failed
+// acquire_context(). shutdown() is called from the DSO destructor, and may
+// only free state that the worker thread does not touch.
+typedef struct NVQRBackendRec {
+    const char *name;
+    bool (*init)(void);
+    bool (*acquire_context)(void);
+    int (*query)(unsigned int queryType, int len, NVQRQueryData_t *data);
+    void (*release_context)(void);
+    void (*shutdown)(void);
+} NVQRBackend;
+
+// Query GL_NV_query_resource through a GLX context on the default X display
+NVQR_HIDDEN extern const NVQRBackend nvqr_glx_backend;
+
+// Generate results without a driver, for testing the query pipeline at scale
+NVQR_HIDDEN extern const NVQRBackend nvqr_synthetic_backend;
+
+#endif
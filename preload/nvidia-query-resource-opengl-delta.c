@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Encoding of delta responses. In steady state, the layout of the result does
+// not change from one query to the next, only some of the numbers in it, so
+// results of the same length are first compared word by word, and only the
+// runs of changed words are sent. If that does not give a small enough patch,
+// both results are split into keyed blocks: the data header, each device
+// summary, each detail block, the tag count and each tag. Each block of the
+// new result is looked up in the previous result by its key, and copied from
+// there if it is unchanged, so that added or removed blocks do not cause the
+// rest of the result to be resent. The same keyed blocks tell whether the
+// memory usage in a result has changed enough to be pushed to a subscriber.
+// These functions are only called from the server loop, so the scratch space
+// is shared.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-preload.h"
+
+#define WORDS(type) ((int) (sizeof(type) / sizeof(NVQRQueryData_t)))
+#define TAG_WORDS ((int) (offsetof(NVQRTagBlock, tag) / \
+                          sizeof(NVQRQueryData_t)))
+
+typedef enum {
+    BLOCK_HEADER = 1,
+    BLOCK_DEVICE,
+    BLOCK_DETAIL,
+    BLOCK_DEVICE_REST,
+    BLOCK_TAG_COUNT,
+    BLOCK_TAG,
+    BLOCK_TRAILER
+} NVQRBlockKind;
+
+typedef struct {
+    int kind, a, b, c;
+    int offset, len;
+} NVQRBlock;
+
+typedef struct {
+    NVQRBlock *blocks;
+    int num, cap;
+} NVQRBlockList;
+
+static NVQRBlockList base_list, cur_list;
+
+// Open addressing hash table of the indices + 1 of the base blocks. Only the
+// first index_mask + 1 entries are in use.
+static int *index_table;
+static unsigned int index_size, index_mask;
+
+
+static bool add_block(NVQRBlockList *list, int kind, int a, int b, int c,
+                      int offset, int len)
+{
+    NVQRBlock *blk;
+
+    if (list->num == list->cap) {
+        int cap = list->cap ? 2 * list->cap : 256;
+
+        blk = realloc(list->blocks, cap * sizeof(*blk));
+        if (!blk) {
+            return false;
+        }
+        list->blocks = blk;
+        list->cap = cap;
+    }
+
+    blk = &list->blocks[list->num++];
+    blk->kind = kind;
+    blk->a = a;
+    blk->b = b;
+    blk->c = c;
+    blk->offset = offset;
+    blk->len = len;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Split a result into keyed blocks that cover it completely, in order.
+// Returns false if the result is malformed or memory runs out.
+static bool split_blocks(const NVQRQueryData_t *data, int cnt,
+                         NVQRBlockList *list)
+{
+    int pos, i, j, num;
+
+    list->num = 0;
+
+    if (cnt < WORDS(NVQRQueryDataHeader) ||
+        data[0] < WORDS(NVQRQueryDataHeader) || data[0] > cnt ||
+        data[2] < 0 || !add_block(list, BLOCK_HEADER, 0, 0, 0, 0, data[0])) {
+        return false;
+    }
+    pos = data[0];
+    num = data[2];
+
+    for (i = 0; i < num; i++) {
+        const NVQRQueryDeviceInfo *dev;
+        int end, dpos;
+
+        if (cnt - pos < WORDS(NVQRQueryDeviceInfo)) {
+            return false;
+        }
+        dev = (const NVQRQueryDeviceInfo *) (data + pos);
+        if (dev->summaryBlkSize < WORDS(NVQRQueryDeviceInfo) ||
+            dev->deviceBlkSize < dev->summaryBlkSize ||
+            dev->deviceBlkSize > cnt - pos || dev->numDetailBlocks < 0 ||
+            !add_block(list, BLOCK_DEVICE, i, 0, 0, pos,
+                       dev->summaryBlkSize)) {
+            return false;
+        }
+        end = pos + dev->deviceBlkSize;
+        dpos = pos + dev->summaryBlkSize;
+
+        for (j = 0; j < dev->numDetailBlocks; j++) {
+            const NVQRQueryDetailInfo *det;
+
+            if (end - dpos < WORDS(NVQRQueryDetailInfo)) {
+                return false;
+            }
+            det = (const NVQRQueryDetailInfo *) (data + dpos);
+            if (det->detailBlkSize < WORDS(NVQRQueryDetailInfo) ||
+                det->detailBlkSize > end - dpos ||
+                !add_block(list, BLOCK_DETAIL, i, det->memType,
+                           det->objectType, dpos, det->detailBlkSize)) {
+                return false;
+            }
+            dpos += det->detailBlkSize;
+        }
+
+        if (dpos < end &&
+            !add_block(list, BLOCK_DEVICE_REST, i, 0, 0, dpos, end - dpos)) {
+            return false;
+        }
+        pos = end;
+    }
+
+    // Results without any tag section are treated as having no tags
+    if (pos == cnt) {
+        return true;
+    }
+
+    num = data[pos];
+    if (num < 0 || !add_block(list, BLOCK_TAG_COUNT, 0, 0, 0, pos, 1)) {
+        return false;
+    }
+    pos++;
+
+    for (i = 0; i < num; i++) {
+        const NVQRTagBlock *blk;
+
+        if (cnt - pos < TAG_WORDS) {
+            return false;
+        }
+        blk = (const NVQRTagBlock *) (data + pos);
+        if (blk->tagBlkSize < TAG_WORDS || blk->tagLength < 0 ||
+            blk->tagBlkSize > cnt - pos ||
+            blk->tagLength > cnt - pos - blk->tagBlkSize ||
+            !add_block(list, BLOCK_TAG, blk->tagId, blk->deviceId, 0, pos,
+                       blk->tagBlkSize + blk->tagLength)) {
+            return false;
+        }
+        pos += blk->tagBlkSize + blk->tagLength;
+    }
+
+    return pos == cnt ||
+           add_block(list, BLOCK_TRAILER, 0, 0, 0, pos, cnt - pos);
+}
+
+
+static unsigned int hash_block(const NVQRBlock *blk)
+{
+    unsigned int h = blk->kind;
+
+    h = h * 0x9e3779b1u + blk->a;
+    h = h * 0x9e3779b1u + blk->b;
+    h = h * 0x9e3779b1u + blk->c;
+    return h ^ (h >> 16);
+}
+
+
+static bool same_key(const NVQRBlock *x, const NVQRBlock *y)
+{
+    return x->kind == y->kind && x->a == y->a && x->b == y->b &&
+           x->c == y->c;
+}
+
+
+//------------------------------------------------------------------------------
+// Index the base blocks by key. Where keys repeat, only the first block with
+// the key is indexed, which keeps the probe sequences short; the other blocks
+// are still found through the hint in find_block().
+static bool build_index(void)
+{
+    unsigned int size = 64, i;
+    int j;
+
+    while (size < 2u * base_list.num) {
+        size *= 2;
+    }
+
+    if (size > index_size) {
+        int *table = realloc(index_table, size * sizeof(*table));
+
+        if (!table) {
+            return false;
+        }
+        index_table = table;
+        index_size = size;
+    }
+    memset(index_table, 0, size * sizeof(*index_table));
+    index_mask = size - 1;
+
+    for (j = 0; j < base_list.num; j++) {
+        const NVQRBlock *blk = &base_list.blocks[j];
+
+        for (i = hash_block(blk) & index_mask; index_table[i] &&
+             !same_key(&base_list.blocks[index_table[i] - 1], blk);
+             i = (i + 1) & index_mask);
+        if (!index_table[i]) {
+            index_table[i] = j + 1;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Find the base block with the same key as blk. Blocks usually appear in the
+// same order in both results, so try the one after the last match first.
+// Returns the index of the base block, or -1 if there is none.
+static int find_block(const NVQRBlock *blk, int hint)
+{
+    unsigned int i;
+
+    if (hint < base_list.num && same_key(&base_list.blocks[hint], blk)) {
+        return hint;
+    }
+
+    for (i = hash_block(blk) & index_mask; index_table[i];
+         i = (i + 1) & index_mask) {
+        if (same_key(&base_list.blocks[index_table[i] - 1], blk)) {
+            return index_table[i] - 1;
+        }
+    }
+
+    return -1;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the position of the first word from pos on that differs between two
+// results, skipping over unchanged stretches a chunk at a time.
+static int skip_unchanged(const NVQRQueryData_t *base,
+                          const NVQRQueryData_t *cur, int pos, int cnt)
+{
+    while (cnt - pos >= 16 &&
+           memcmp(base + pos, cur + pos, 16 * sizeof(*cur)) == 0) {
+        pos += 16;
+    }
+    while (pos < cnt && base[pos] == cur[pos]) {
+        pos++;
+    }
+    return pos;
+}
+
+
+//------------------------------------------------------------------------------
+// Encode a patch between two results of the same length, copying the runs of
+// words that are unchanged in place. Runs of fewer than three unchanged words
+// are sent along with the changed words around them, since a copy
+// instruction takes three words.
+static int encode_in_place(const NVQRQueryData_t *base,
+                           const NVQRQueryData_t *cur, int cnt,
+                           NVQRQueryData_t *out, int maxOut)
+{
+    int len = 2, pos = 0;
+
+    out[0] = NVQR_DELTA_PATCH;
+    out[1] = cnt;
+
+    while (pos < cnt) {
+        int start = pos;
+
+        pos = skip_unchanged(base, cur, pos, cnt);
+        if (pos > start) {
+            if (maxOut - len < 3) {
+                return 0;
+            }
+            out[len++] = NVQR_DELTA_COPY;
+            out[len++] = start;
+            out[len++] = pos - start;
+        }
+
+        start = pos;
+        while (pos < cnt) {
+            int gap = pos;
+
+            while (gap < cnt && gap - pos < 3 && base[gap] == cur[gap]) {
+                gap++;
+            }
+            if (gap == cnt || gap - pos == 3) {
+                break;
+            }
+            pos = gap + 1;
+        }
+        if (pos > start) {
+            if (maxOut - len < 2 + pos - start) {
+                return 0;
+            }
+            out[len++] = NVQR_DELTA_DATA;
+            out[len++] = pos - start;
+            memcpy(out + len, cur + start, (pos - start) * sizeof(*cur));
+            len += pos - start;
+        }
+    }
+
+    return len;
+}
+
+
+int nvqr_encode_delta(const NVQRQueryData_t *base, int baseCnt,
+                      const NVQRQueryData_t *cur, int cnt,
+                      NVQRQueryData_t *out, int maxOut)
+{
+    int len = 2, copy_at = -1, data_at = -1, hint = 0, j;
+
+    if (maxOut < len) {
+        return 0;
+    }
+
+    if (cnt == baseCnt) {
+        if (memcmp(base, cur, cnt * sizeof(*cur)) == 0) {
+            if (maxOut < 5) {
+                return 0;
+            }
+            out[0] = NVQR_DELTA_PATCH;
+            out[1] = cnt;
+            out[2] = NVQR_DELTA_COPY;
+            out[3] = 0;
+            out[4] = cnt;
+            return 5;
+        }
+
+        // Settle for this if it takes less than a quarter of a full result
+        len = encode_in_place(base, cur, cnt, out, maxOut / 4);
+        if (len) {
+            return len;
+        }
+        len = 2;
+    }
+
+    if (!split_blocks(base, baseCnt, &base_list) ||
+        !split_blocks(cur, cnt, &cur_list) || !build_index()) {
+        return 0;
+    }
+
+    out[0] = NVQR_DELTA_PATCH;
+    out[1] = cnt;
+
+    for (j = 0; j < cur_list.num; j++) {
+        const NVQRBlock *blk = &cur_list.blocks[j];
+        int match = find_block(blk, hint);
+
+        if (match >= 0) {
+            hint = match + 1;
+        }
+
+        if (match >= 0 && base_list.blocks[match].len == blk->len &&
+            memcmp(base + base_list.blocks[match].offset, cur + blk->offset,
+                   blk->len * sizeof(*cur)) == 0) {
+            int offset = base_list.blocks[match].offset;
+
+            // Extend the previous copy if this block follows on from it
+            if (copy_at >= 0 && out[copy_at + 1] + out[copy_at + 2] == offset) {
+                out[copy_at + 2] += blk->len;
+            } else {
+                if (maxOut - len < 3) {
+                    return 0;
+                }
+                copy_at = len;
+                out[len++] = NVQR_DELTA_COPY;
+                out[len++] = offset;
+                out[len++] = blk->len;
+            }
+            data_at = -1;
+        } else {
+            if (data_at < 0) {
+                if (maxOut - len < 2) {
+                    return 0;
+                }
+                data_at = len;
+                out[len++] = NVQR_DELTA_DATA;
+                out[len++] = 0;
+            }
+            if (maxOut - len < blk->len) {
+                return 0;
+            }
+            memcpy(out + len, cur + blk->offset, blk->len * sizeof(*cur));
+            len += blk->len;
+            out[data_at + 1] += blk->len;
+            copy_at = -1;
+        }
+    }
+
+    return len;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the memory usage in kiB recorded in a block in *usage, along with the
+// watch flag that covers it, or 0 for blocks that record no usage.
+static int block_usage(const NVQRBlock *blk, const NVQRQueryData_t *data,
+                       int *usage)
+{
+    const NVQRQueryData_t *words = data + blk->offset;
+
+    switch (blk->kind) {
+        case BLOCK_DEVICE:
+            *usage = ((const NVQRQueryDeviceInfo *) words)->vidMemUsedkiB;
+            return NVQR_WATCH_DEVICES;
+        case BLOCK_DETAIL:
+            *usage = ((const NVQRQueryDetailInfo *) words)->memUsedkiB;
+            return NVQR_WATCH_DETAILS;
+        case BLOCK_TAG:
+            *usage = ((const NVQRTagBlock *) words)->vidmemUsedkiB;
+            return NVQR_WATCH_TAGS;
+    }
+
+    return 0;
+}
+
+
+static bool exceeds_threshold(const NVQRSubscribeParams *params,
+                              long long before, long long after)
+{
+    long long change = after > before ? after - before : before - after;
+
+    if (before < 0) {
+        before = -before;
+    }
+
+    return change > 0 &&
+           ((!params->thresholdKiB && !params->thresholdPct) ||
+            (params->thresholdKiB && change >= params->thresholdKiB) ||
+            (params->thresholdPct &&
+             100 * change >= params->thresholdPct * before));
+}
+
+
+bool nvqr_usage_changed(const NVQRSubscribeParams *params,
+                        const NVQRQueryData_t *base, int baseCnt,
+                        const NVQRQueryData_t *cur, int cnt)
+{
+    static bool *matched = NULL;
+    static int matched_cap = 0;
+    int watch = params->watch ? params->watch : ~0;
+    int hint = 0, usage, before, j;
+
+    if (cnt == baseCnt && memcmp(base, cur, cnt * sizeof(*cur)) == 0) {
+        return false;
+    }
+
+    // Results that cannot be compared are always worth sending
+    if (!split_blocks(base, baseCnt, &base_list) ||
+        !split_blocks(cur, cnt, &cur_list) || !build_index()) {
+        return true;
+    }
+
+    if (base_list.num > matched_cap) {
+        bool *m = realloc(matched, base_list.num * sizeof(*m));
+
+        if (!m) {
+            return true;
+        }
+        matched = m;
+        matched_cap = base_list.num;
+    }
+    memset(matched, 0, base_list.num * sizeof(*matched));
+
+    for (j = 0; j < cur_list.num; j++) {
+        const NVQRBlock *blk = &cur_list.blocks[j];
+        int match = find_block(blk, hint);
+
+        before = 0;
+        if (match >= 0) {
+            hint = match + 1;
+            matched[match] = true;
+            block_usage(&base_list.blocks[match], base, &before);
+        }
+
+        if ((block_usage(blk, cur, &usage) & watch) &&
+            exceeds_threshold(params, before, usage)) {
+            return true;
+        }
+    }
+
+    // Blocks that are gone count as dropping to no usage at all
+    for (j = 0; j < base_list.num; j++) {
+        if (!matched[j] &&
+            (block_usage(&base_list.blocks[j], base, &before) & watch) &&
+            exceeds_threshold(params, before, 0)) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nvidia-query-resource-opengl-data.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-preload.h"
+
+// The history is a ring of samples in their wire format, written by the GL
+// worker thread and read by the server loop without locking. Sample n is kept
+// in slot n % ring_size. The writer first advances claimed past the sample it
+// is about to overwrite the slot with, then writes it and advances head. A
+// reader copies samples below head, and afterwards drops any that claimed
+// shows may have been overwritten while it was copying. The counters are
+// native words, like the server statistics.
+
+#define DEFAULT_HISTORY_SAMPLES     6000
+#define MIN_HISTORY_SAMPLES         16
+#define MAX_HISTORY_SAMPLES         65536
+
+#define WORDS(type) ((int) (sizeof(type) / sizeof(NVQRQueryData_t)))
+
+static NVQRQueryData_t *ring = NULL;
+static unsigned long ring_size = 0;
+static unsigned long head = 0, claimed = 0;
+static int interval_ms = 0;
+
+
+int nvqr_init_history(void)
+{
+    int interval = get_env_int("NVQR_HISTORY_INTERVAL_MS", 0, 0, INT_MAX);
+    int samples = get_env_int("NVQR_HISTORY_SAMPLES", DEFAULT_HISTORY_SAMPLES,
+                              MIN_HISTORY_SAMPLES, MAX_HISTORY_SAMPLES);
+
+    if (interval == 0) {
+        return 0;
+    }
+
+    ring = calloc(samples, NVQR_HISTORY_SAMPLE_LEN * sizeof(*ring));
+    if (!ring) {
+        error_msg("failed to allocate the sample history.");
+        return 0;
+    }
+    ring_size = samples;
+    interval_ms = interval;
+
+    return interval;
+}
+
+
+int nvqr_history_interval_ms(void)
+{
+    return __atomic_load_n(&interval_ms, __ATOMIC_RELAXED);
+}
+
+
+void nvqr_disable_history(void)
+{
+    __atomic_store_n(&interval_ms, 0, __ATOMIC_RELAXED);
+}
+
+
+static void put_word(NVQRQueryData_t *sample, int *pos, NVQRQueryData_t value)
+{
+    __atomic_store_n(&sample[(*pos)++], value, __ATOMIC_RELAXED);
+}
+
+
+void nvqr_record_history(const NVQRQueryData_t *data, int cnt,
+                         long long timestampUs)
+{
+    unsigned long seq = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    NVQRQueryData_t *sample = ring + (seq % ring_size) *
+                              NVQR_HISTORY_SAMPLE_LEN;
+    int num = 0, pos = 0, i, off;
+
+    // Count the well-formed device summaries, up to the number kept
+    if (cnt >= WORDS(NVQRQueryDataHeader) &&
+        data[0] >= WORDS(NVQRQueryDataHeader) && data[0] <= cnt) {
+        for (off = data[0]; num < data[2] && num < NVQR_HISTORY_MAX_DEVICES;
+             num++) {
+            const NVQRQueryDeviceInfo *dev;
+
+            if (cnt - off < WORDS(NVQRQueryDeviceInfo)) {
+                break;
+            }
+            dev = (const NVQRQueryDeviceInfo *) (data + off);
+            if (dev->deviceBlkSize < WORDS(NVQRQueryDeviceInfo) ||
+                dev->deviceBlkSize > cnt - off) {
+                break;
+            }
+            off += dev->deviceBlkSize;
+        }
+    }
+
+    __atomic_store_n(&claimed, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    put_word(sample, &pos, (NVQRQueryData_t) (timestampUs & 0xffffffff));
+    put_word(sample, &pos, (NVQRQueryData_t) (timestampUs >> 32));
+    put_word(sample, &pos, num);
+    for (i = 0, off = num ? data[0] : 0; i < NVQR_HISTORY_MAX_DEVICES; i++) {
+        const NVQRQueryDeviceInfo *dev = i < num ?
+            (const NVQRQueryDeviceInfo *) (data + off) : NULL;
+
+        put_word(sample, &pos, dev ? dev->totalAllocs : 0);
+        put_word(sample, &pos, dev ? dev->vidMemUsedkiB : 0);
+        put_word(sample, &pos, dev ? dev->vidMemFreekiB : 0);
+        if (dev) {
+            off += dev->deviceBlkSize;
+        }
+    }
+
+    __atomic_store_n(&head, seq + 1, __ATOMIC_RELEASE);
+    nvqr_count_stat(NVQR_STAT_HISTORY_SAMPLES, 1);
+}
+
+
+static unsigned long first_sample(unsigned long long since, unsigned long end)
+{
+    unsigned long start = end > ring_size ? end - ring_size : 0;
+
+    if (since > start) {
+        start = since < end ? (unsigned long) since : end;
+    }
+
+    return start;
+}
+
+
+int nvqr_history_available(unsigned long long since)
+{
+    unsigned long end = __atomic_load_n(&head, __ATOMIC_RELAXED);
+
+    return (int) (end - first_sample(since, end));
+}
+
+
+int nvqr_read_history(unsigned long long since, int max,
+                      unsigned long long *first, NVQRQueryData_t *out)
+{
+    unsigned long end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    unsigned long start = first_sample(since, end);
+    unsigned long seq, lost;
+    int i, n = 0;
+
+    if (end - start > (unsigned long) max) {
+        end = start + max;
+    }
+
+    for (seq = start; seq < end; seq++) {
+        const NVQRQueryData_t *sample = ring + (seq % ring_size) *
+                                        NVQR_HISTORY_SAMPLE_LEN;
+
+        for (i = 0; i < NVQR_HISTORY_SAMPLE_LEN; i++) {
+            out[n++] = __atomic_load_n(&sample[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    // Drop the samples the writer may have overwritten in the meantime
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq = __atomic_load_n(&claimed, __ATOMIC_RELAXED);
+    lost = seq > ring_size && seq - ring_size > start ?
+           seq - ring_size - start : 0;
+    if (lost > end - start) {
+        lost = end - start;
+    }
+    if (lost) {
+        n -= lost * NVQR_HISTORY_SAMPLE_LEN;
+        memmove(out, out + lost * NVQR_HISTORY_SAMPLE_LEN, n * sizeof(*out));
+        start += lost;
+    }
+
+    *first = start;
+    return (int) (end - start);
+}
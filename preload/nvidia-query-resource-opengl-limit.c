@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Admission control for the server loop, which is the only thread that uses
+// these functions. Queries are limited by token buckets, one per connection
+// and one per user ID shared by all connections of that user, holding up to
+// a burst of tokens and refilled at a steady rate. A query command is
+// admitted while both of its buckets hold at least one token, and takes a
+// token per query type from each, which may leave a bucket in debt after a
+// large batch. It is configured with the following environment variables:
+//
+//   NVQR_RATE_LIMIT:         queries per second per connection (default 0,
+//                            no limit)
+//   NVQR_RATE_BURST:         tokens per connection (default: one second's)
+//   NVQR_UID_RATE_LIMIT:     queries per second per user (default 0)
+//   NVQR_UID_RATE_BURST:     tokens per user (default: one second's)
+//   NVQR_UID_MAX_CLIENTS:    connections per user (default 0, no limit)
+//   NVQR_MAX_PENDING_QUERIES: backend queries queued for or running on the
+//                            GL worker thread (default 0, no limit)
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for struct ucred
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-preload.h"
+
+// The shortest wait suggested for the GL worker thread to catch up
+#define NVQR_MIN_PENDING_RETRY_US 1000
+
+typedef struct {
+    double perUs;       // tokens added per microsecond; 0 for no limit
+    double burst;
+} NVQRRate;
+
+struct NVQRUserLimitRec {
+    struct NVQRUserLimitRec *next;
+    long uid;
+    int clients;
+    NVQRTokenBucket bucket;
+};
+
+static NVQRRate client_rate, user_rate;
+static int max_user_clients, max_pending_queries;
+static NVQRUserLimit *users = NULL;
+
+
+static void init_rate(NVQRRate *rate, const char *limitName,
+                      const char *burstName)
+{
+    int limit = get_env_int(limitName, 0, 0, INT_MAX);
+
+    rate->perUs = limit / 1e6;
+    rate->burst = get_env_int(burstName, limit > 1 ? limit : 1, 1, INT_MAX);
+}
+
+
+void nvqr_init_limits(void)
+{
+    init_rate(&client_rate, "NVQR_RATE_LIMIT", "NVQR_RATE_BURST");
+    init_rate(&user_rate, "NVQR_UID_RATE_LIMIT", "NVQR_UID_RATE_BURST");
+    max_user_clients = get_env_int("NVQR_UID_MAX_CLIENTS", 0, 0, INT_MAX);
+    max_pending_queries = get_env_int("NVQR_MAX_PENDING_QUERIES", 0, 0,
+                                      INT_MAX);
+}
+
+
+//------------------------------------------------------------------------------
+// Refill a bucket for the time since it was last used; a new bucket starts
+// full. Returns the number of microseconds until it holds a token, or 0 if it
+// does.
+static long long refill(NVQRTokenBucket *bucket, const NVQRRate *rate,
+                        long long now)
+{
+    if (!rate->perUs) {
+        return 0;
+    }
+
+    if (bucket->updated) {
+        bucket->tokens += (now - bucket->updated) * rate->perUs;
+        if (bucket->tokens > rate->burst) {
+            bucket->tokens = rate->burst;
+        }
+    } else {
+        bucket->tokens = rate->burst;
+    }
+    bucket->updated = now;
+
+    return bucket->tokens >= 1 ? 0 :
+           (long long) ((1 - bucket->tokens) / rate->perUs) + 1;
+}
+
+
+long nvqr_get_peer_uid(int fd)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        return cred.uid;
+    }
+#elif defined(__FreeBSD__)
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) == 0) {
+        return uid;
+    }
+#endif
+
+    return -1;
+}
+
+
+NVQRUserLimit *nvqr_add_user_client(long uid, bool *admitted)
+{
+    long long now = nvqr_ipc_get_time_us();
+    NVQRUserLimit **link = &users, *user = NULL;
+
+    // Find the user, forgetting those without connections whose buckets
+    // have refilled, and who are therefore no different from new users
+    while (*link) {
+        NVQRUserLimit *cur = *link;
+
+        if (cur->uid == uid) {
+            user = cur;
+        } else if (!cur->clients &&
+                   (!user_rate.perUs ||
+                    (refill(&cur->bucket, &user_rate, now) == 0 &&
+                     cur->bucket.tokens >= user_rate.burst))) {
+            *link = cur->next;
+            free(cur);
+            continue;
+        }
+        link = &cur->next;
+    }
+
+    if (!user) {
+        user = calloc(1, sizeof(*user));
+        if (!user) {
+            *admitted = true;
+            return NULL;
+        }
+        user->uid = uid;
+        user->next = users;
+        users = user;
+    }
+
+    user->clients++;
+    *admitted = !max_user_clients || user->clients <= max_user_clients;
+    return user;
+}
+
+
+void nvqr_remove_user_client(NVQRUserLimit *user)
+{
+    if (user) {
+        user->clients--;
+    }
+}
+
+
+long long nvqr_take_tokens(NVQRTokenBucket *bucket, NVQRUserLimit *user,
+                           int cost)
+{
+    long long now = nvqr_ipc_get_time_us(), wait, user_wait = 0;
+
+    wait = refill(bucket, &client_rate, now);
+    if (user) {
+        user_wait = refill(&user->bucket, &user_rate, now);
+    }
+    if (wait || user_wait) {
+        return wait > user_wait ? wait : user_wait;
+    }
+
+    if (client_rate.perUs) {
+        bucket->tokens -= cost;
+    }
+    if (user && user_rate.perUs) {
+        user->bucket.tokens -= cost;
+    }
+
+    return 0;
+}
+
+
+long long nvqr_check_pending_queries(int pending, int added)
+{
+    long long wait;
+
+    // An idle worker always takes the queries, however many there are
+    if (!max_pending_queries || !pending ||
+        pending + added <= max_pending_queries) {
+        return 0;
+    }
+
+    // The queries run one at a time, so expect to wait for all of them
+    wait = nvqr_mean_time(NVQR_HIST_BACKEND_QUERY) * pending;
+    return wait > NVQR_MIN_PENDING_RETRY_US ? wait
+                                            : NVQR_MIN_PENDING_RETRY_US;
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-data.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-preload.h"
+
+// The peaks are only updated by the GL worker thread, which also owns the
+// scratch arrays the results are parsed into. The table itself is read by the
+// server loop and at exit, so it is guarded by a lock. It is bounded, as tags
+// may come and go over the lifetime of the application; once it is full, new
+// tags are not tracked. Records mostly come in the same order with every
+// result, so each lookup starts where the previous one left off.
+
+#define MAX_PEAKS   4096
+
+typedef struct {
+    NVQRPeakKind kind;
+    int device;
+    NVQRQueryData_t id;
+    NVQRQueryData_t peakkiB;
+    long long timestamp;
+    char tag[NVQR_PEAK_TAG_LEN];
+} NVQRPeakRecord;
+
+static pthread_mutex_t peaks_lock = PTHREAD_MUTEX_INITIALIZER;
+static NVQRPeakRecord *peaks = NULL;
+static int num_peaks = 0, peaks_cap = 0, hint = 0;
+
+// Scratch space of the GL worker thread
+static NVQRParsedData parsed;
+static NVQRDetailRecord *sums = NULL;
+
+
+//------------------------------------------------------------------------------
+// Grow the arrays of parsed to hold every record of a result. Returns false
+// if out of memory.
+static bool grow_parsed(void)
+{
+    if (parsed.numDevices > parsed.maxDevices) {
+        NVQRDeviceRecord *d = realloc(parsed.devices,
+                                      parsed.numDevices * sizeof(*d));
+
+        if (!d) {
+            return false;
+        }
+        parsed.devices = d;
+        parsed.maxDevices = parsed.numDevices;
+    }
+
+    if (parsed.numDetails > parsed.maxDetails) {
+        NVQRDetailRecord *d = realloc(parsed.details,
+                                      parsed.numDetails * sizeof(*d));
+        NVQRDetailRecord *s = realloc(sums, parsed.numDetails * sizeof(*s));
+
+        if (d) {
+            parsed.details = d;
+        }
+        if (s) {
+            sums = s;
+        }
+        if (!d || !s) {
+            return false;
+        }
+        parsed.maxDetails = parsed.numDetails;
+    }
+
+    if (parsed.numTags > parsed.maxTags) {
+        NVQRTagRecord *t = realloc(parsed.tags, parsed.numTags * sizeof(*t));
+
+        if (!t) {
+            return false;
+        }
+        parsed.tags = t;
+        parsed.maxTags = parsed.numTags;
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Find the peak of a device, object type or tag, adding it if it is new and
+// the table is not full. Called with peaks_lock held.
+static NVQRPeakRecord *find_peak(NVQRPeakKind kind, int device,
+                                 NVQRQueryData_t id)
+{
+    NVQRPeakRecord *peak;
+    int i;
+
+    for (i = 0; i < num_peaks; i++) {
+        peak = &peaks[(hint + i) % num_peaks];
+        if (peak->kind == kind && peak->device == device && peak->id == id) {
+            hint = (hint + i + 1) % num_peaks;
+            return peak;
+        }
+    }
+
+    if (num_peaks == peaks_cap) {
+        int cap = peaks_cap ? 2 * peaks_cap : 64;
+
+        if (peaks_cap >= MAX_PEAKS ||
+            !(peak = realloc(peaks, cap * sizeof(*peak)))) {
+            return NULL;
+        }
+        peaks = peak;
+        peaks_cap = cap;
+    }
+
+    peak = &peaks[num_peaks++];
+    memset(peak, 0, sizeof(*peak));
+    peak->kind = kind;
+    peak->device = device;
+    peak->id = id;
+    peak->peakkiB = -1;
+    hint = 0;
+    return peak;
+}
+
+
+//------------------------------------------------------------------------------
+// Record a usage, and the tag name if any, if it is a new peak. Called with
+// peaks_lock held.
+static void update_peak(NVQRPeakKind kind, int device, NVQRQueryData_t id,
+                        NVQRQueryData_t kiB, long long timestamp,
+                        const char *tag, int tagLen)
+{
+    NVQRPeakRecord *peak = find_peak(kind, device, id);
+
+    if (!peak || kiB <= peak->peakkiB) {
+        return;
+    }
+
+    peak->peakkiB = kiB;
+    peak->timestamp = timestamp;
+    if (tag) {
+        memset(peak->tag, 0, sizeof(peak->tag));
+        memcpy(peak->tag, tag, tagLen < NVQR_PEAK_TAG_LEN ? tagLen :
+                                                            NVQR_PEAK_TAG_LEN);
+    }
+}
+
+
+void nvqr_update_peaks(const NVQRQueryData_t *data, int cnt,
+                       long long timestampUs)
+{
+    nvqrReturn_t ret = nvqr_parse_memory_info(data, cnt, &parsed);
+    int i, j, k;
+
+    if (ret == NVQR_ERROR_INSUFFICIENT_BUFFER && grow_parsed()) {
+        ret = nvqr_parse_memory_info(data, cnt, &parsed);
+    }
+    if (ret != NVQR_SUCCESS) {
+        return;
+    }
+
+    pthread_mutex_lock(&peaks_lock);
+
+    for (i = 0; i < parsed.numDevices; i++) {
+        const NVQRDeviceRecord *dev = &parsed.devices[i];
+        int num = 0;
+
+        update_peak(NVQR_PEAK_DEVICE, i, 0, dev->vidMemUsedkiB, timestampUs,
+                    NULL, 0);
+
+        // Sum up the vidmem detail blocks of each object type
+        for (j = 0; j < dev->numDetails; j++) {
+            const NVQRDetailRecord *det = &parsed.details[dev->firstDetail + j];
+
+            if (det->memType != GL_QUERY_RESOURCE_MEMTYPE_VIDMEM_NV) {
+                continue;
+            }
+            for (k = 0; k < num && sums[k].objectType != det->objectType; k++);
+            if (k == num) {
+                sums[num].objectType = det->objectType;
+                sums[num++].memUsedkiB = 0;
+            }
+            sums[k].memUsedkiB += det->memUsedkiB;
+        }
+
+        for (k = 0; k < num; k++) {
+            update_peak(NVQR_PEAK_OBJECT_TYPE, i, sums[k].objectType,
+                        sums[k].memUsedkiB, timestampUs, NULL, 0);
+        }
+    }
+
+    for (i = 0; i < parsed.numTags; i++) {
+        const NVQRTagRecord *tag = &parsed.tags[i];
+
+        update_peak(NVQR_PEAK_TAG, tag->deviceId, tag->tagId,
+                    tag->vidmemUsedkiB, timestampUs, tag->tag, tag->tagLen);
+    }
+
+    pthread_mutex_unlock(&peaks_lock);
+}
+
+
+int nvqr_num_peaks(void)
+{
+    int num;
+
+    pthread_mutex_lock(&peaks_lock);
+    num = num_peaks;
+    pthread_mutex_unlock(&peaks_lock);
+
+    return num;
+}
+
+
+int nvqr_write_peaks(NVQRQueryData_t *data, int max)
+{
+    int i;
+
+    pthread_mutex_lock(&peaks_lock);
+
+    for (i = 0; i < num_peaks && i < max; i++, data += NVQR_PEAK_LEN) {
+        const NVQRPeakRecord *peak = &peaks[i];
+
+        data[0] = peak->kind;
+        data[1] = peak->device;
+        data[2] = peak->id;
+        data[3] = peak->peakkiB;
+        data[4] = (NVQRQueryData_t) (peak->timestamp & 0xffffffff);
+        data[5] = (NVQRQueryData_t) (peak->timestamp >> 32);
+        memcpy(data + 6, peak->tag, NVQR_PEAK_TAG_LEN);
+    }
+
+    pthread_mutex_unlock(&peaks_lock);
+
+    return i;
+}
+
+
+static const char *object_type_name(NVQRQueryData_t objectType)
+{
+    switch (objectType) {
+        case GL_QUERY_RESOURCE_SYS_RESERVED_NV:     return "SYSTEM RESERVED";
+        case GL_QUERY_RESOURCE_TEXTURE_NV:          return "TEXTURE";
+        case GL_QUERY_RESOURCE_RENDERBUFFER_NV:     return "RENDERBUFFER";
+        case GL_QUERY_RESOURCE_BUFFEROBJECT_NV:     return "BUFFEROBJ_ARRAY";
+        default:                                    return "UNKNOWN";
+    }
+}
+
+
+void nvqr_dump_peaks(FILE *stream, long pid)
+{
+    struct timespec ts;
+    long long offset;
+    int i;
+
+    // Report the times on the wall clock
+    clock_gettime(CLOCK_REALTIME, &ts);
+    offset = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 -
+             nvqr_ipc_get_time_us();
+
+    pthread_mutex_lock(&peaks_lock);
+
+    if (num_peaks) {
+        fprintf(stream, "Peak vidmem usage of pid %ld:\n", pid);
+    }
+
+    for (i = 0; i < num_peaks; i++) {
+        const NVQRPeakRecord *peak = &peaks[i];
+        long long t = peak->timestamp + offset;
+
+        fprintf(stream, "  device %d", peak->device);
+        if (peak->kind == NVQR_PEAK_OBJECT_TYPE) {
+            fprintf(stream, ", %s", object_type_name(peak->id));
+        } else if (peak->kind == NVQR_PEAK_TAG) {
+            fprintf(stream, ", tag %d \"%.*s\"", peak->id, NVQR_PEAK_TAG_LEN,
+                    peak->tag);
+        }
+        fprintf(stream, ": %d kiB at %lld.%03lld\n", peak->peakkiB,
+                t / 1000000, t / 1000 % 1000);
+    }
+
+    pthread_mutex_unlock(&peaks_lock);
+}
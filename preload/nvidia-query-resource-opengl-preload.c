@@ -33,62 +33,168 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <stdarg.h>
-#include <X11/Xlib.h>
-#include <GL/gl.h>
-#include <GL/glx.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
 
+#include "nvidia-query-resource-opengl.h"
 #include "nvidia-query-resource-opengl-ipc.h"
 #include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-preload.h"
+#include "nvidia-query-resource-opengl-backend.h"
 
 __attribute__((constructor)) void queryResourcePreloadInit(void);
 __attribute__((destructor)) void queryResourcePreloadExit(void);
 
 #define NVQR_QUEUE_MAX 8
+#define NVQR_MAX_CLIENTS 64
+#define NVQR_MAX_COMMANDS_PER_WAKEUP 16
+#define NVQR_MAX_QUERY_SLOTS 16
 
-/* XXX GL_NV_query_resource defines - these should be removed once the
- * extension has been finalized and these values become part of real 
- * OpenGL header files. */
-#ifndef GL_NV_query_resource
-#define GL_NV_query_resource 1
+// How long a client over its user's connection limit is asked to wait
+#define NVQR_REFUSED_RETRY_US 1000000
 
-#ifdef GL_GLEXT_PROTOTYPES
-GLAPI GLint GLAPIENTRY glQueryResourceNV (GLenum queryType, GLuint pname, GLuint bufSize, GLint *buffer);
-#endif /* GL_GLEXT_PROTOTYPES */
-typedef GLint (GLAPIENTRYP PFNGLQUERYRESOURCENVPROC) (GLenum queryType, GLuint pname, GLuint bufSize, GLint *buffer);
-
-#endif
-
-#define NVQR_EXTENSION ((const GLubyte *)"glQueryResourceNV")
+// The stack size of the server thread, which only runs the poll loop
+#define NVQR_SERVER_STACK_SIZE (256 * 1024)
 
 #define SOCKET_NAME_MAX_LENGTH sizeof(((struct sockaddr_un *)0)->sun_path)
 static char socket_name[SOCKET_NAME_MAX_LENGTH];
 static int socket_fd = -1;
 
-static int clientsConnected = 0;
-// Mutex around connect/disconnect requests from clients
-static pthread_mutex_t connect_lock;
-// Mutex around query requests from clients: the GLXContext needs to be made
-// current to the thread that is making the query
-static pthread_mutex_t query_lock;
+// The backend serving the queries, and whether the GL worker thread has
+// acquired its context from it.
+static const NVQRBackend *backend = NULL;
+static bool context_acquired = false;
 
-static PFNGLQUERYRESOURCENVPROC glQueryResourceNV = NULL;
+static const NVQRBackend *const backends[] = {
+    &nvqr_glx_backend,
+    &nvqr_synthetic_backend,
+};
 
-static Display *dpy = NULL;
-static GLXContext ctx = NULL;
+typedef enum {
+    NVQR_JOB_CONNECT = 1,
+    NVQR_JOB_QUERY
+} NVQRJobType;
 
+typedef struct NVQRClientRec NVQRClient;
+typedef struct NVQRQuerySlotRec NVQRQuerySlot;
 
 //------------------------------------------------------------------------------
-// Release any X11/GLX resources that have been created
-static void cleanup_glx_resources(void) {
-    if (ctx) {
-        glXDestroyContext(dpy, ctx);
-        ctx = NULL;
-    }
-    if (dpy) {
-        XCloseDisplay(dpy);
-        dpy = NULL;
-    }
-}
+// A request for the GL worker thread. Connect jobs are embedded in the client
+// that issued them, and query jobs in the query slot for their query type.
+typedef struct NVQRJobRec {
+    struct NVQRJobRec *next;
+    NVQRJobType type;
+    unsigned int queryType;
+    int len;
+    NVQRQueryData_t *data;
+    int result;
+    long long timestamp;
+    long long submitted, finished;  // for the server statistics
+    NVQRClient *client;
+    NVQRQuerySlot *slot;
+} NVQRJob;
+
+//------------------------------------------------------------------------------
+// The most recent result for one query type, and the clients waiting for the
+// query that is in flight for it, if any. Requests for a query type that
+// arrive while its query is in flight are added to the waiters rather than
+// causing another driver call, and results younger than NVQR_CACHE_TTL_MS are
+// served without calling into the driver at all. Since a query is only
+// started once the cached result has expired, the data buffer of the job is
+// never accessed by the server loop while the GL worker thread may grow or
+// write to it. Once a client has mapped the shared snapshot of a query type,
+// every result for it is also written there.
+struct NVQRQuerySlotRec {
+    struct NVQRQuerySlotRec *next;
+    bool in_flight;
+    NVQRJob job;
+    NVQRClient *waiters;
+    int cnt;
+    long long timestamp;
+    NVQRSnapshot *snapshot;
+};
+
+//------------------------------------------------------------------------------
+// Per-connection state for the server loop. Each client owns exactly one
+// command buffer and one response buffer, so the memory used by a connection
+// is bounded no matter how fast the client sends requests: while a command is
+// being processed or its response is still being written, no further commands
+// are read from that client. The response buffer holds a response header
+// followed by resp_cap words of data; it only grows beyond
+// NVQR_MAX_DATA_BUFFER_LEN words while a larger response is being sent.
+struct NVQRClientRec {
+    int fd;
+    int index;
+    bool connected;
+    bool job_pending, closing;
+
+    // Admission control: the connection's token bucket, and its user
+    NVQRTokenBucket bucket;
+    NVQRUserLimit *user;
+
+    NVQRJob job;
+    NVQRQuerySlot *waiting_on;
+    NVQRClient *next_waiter;
+    size_t cmd_bytes;
+    NVQRQueryCmdBuffer cmd;
+    int cmd_types[NVQR_MAX_BATCH_TYPES];    // or an NVQRSubscribeParams
+    int batch_next;
+    size_t resp_bytes, resp_sent;
+    NVQRQueryResponseHeader *resp;
+    int resp_cap;
+
+    // When the current command was received and its response queued, for the
+    // server statistics
+    long long cmd_time, resp_time;
+
+    // The last result sent in response to NVQR_QUERY_MEMORY_INFO_DELTA, if
+    // delta_cnt is nonzero
+    NVQRQueryData_t *delta_base;
+    int delta_cnt, delta_cap;
+    unsigned int delta_type;
+
+    // The client's subscription, if subscribed is set: the query type and
+    // parameters, the request ID its pushes are sent with, when the query type
+    // is to be sampled next, and whether a sample is in flight. The last
+    // result pushed is the delta base. If shared is set, the samples are
+    // written to the query type's shared snapshot instead of being pushed,
+    // and send_snapshot is set until its descriptor has been sent.
+    bool subscribed, sampling, shared;
+    NVQRSnapshot *send_snapshot;
+    unsigned int sub_type;
+    NVQRSubscribeParams sub;
+    int sub_request_id;
+    long long next_sample;
+};
+
+static NVQRClient **clients = NULL;
+static int num_clients = 0;
+
+// Set by the server loop once the GL worker has created its context
+static bool context_ready = false;
+
+static NVQRQuerySlot *query_slots = NULL;
+static int num_query_slots = 0;
+static int queries_in_flight = 0;
+static long long cache_ttl = 0;
+
+// Job queues between the server loop and the GL worker thread. The worker
+// signals completed jobs by writing to wakeup_fds[1], which the server loop
+// polls alongside the client sockets.
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static NVQRJob *pending_jobs = NULL, **pending_jobs_tail = &pending_jobs;
+static NVQRJob *completed_jobs = NULL;
+static bool worker_started = false;
+static int wakeup_fds[2] = { -1, -1 };
+
+// The GL worker thread also takes the samples for the history, if any, with
+// a job of its own, every history_interval microseconds. history_interval is
+// set before the worker is started, and only cleared by the worker itself.
+static long long history_interval = 0;
+static long long next_history_sample = 0;
+static NVQRJob history_job;
 
 
 //------------------------------------------------------------------------------
@@ -104,7 +210,7 @@ static void print_msg(FILE *stream, const char *type, const char *fmt,
 
 //------------------------------------------------------------------------------
 // Print an error message to stderr with the NVQR header
-static void error_msg(const char *fmt, ...)
+void error_msg(const char *fmt, ...)
 {
     va_list vargs;
 
@@ -116,7 +222,7 @@ static void error_msg(const char *fmt, ...)
 
 //------------------------------------------------------------------------------
 // Print a warning message to stderr with the NVQR header
-static void warning_msg(const char *fmt, ...)
+void warning_msg(const char *fmt, ...)
 {
     va_list vargs;
 
@@ -127,255 +233,1759 @@ static void warning_msg(const char *fmt, ...)
 
 
 //------------------------------------------------------------------------------
-// Lazily create the GLX context that will be used to service query requests,
-// if no clients are currently connected, and increment the connected client
-// refcount if the context was successfully created.
-static bool connectToClient(void)
+// Perform the resource query for a job. The driver truncates its output to
+// the size of the buffer, so grow the buffer and query again for as long as
+// the output fills it completely, up to NVQR_MAX_RESPONSE_LEN words. Returns
+// the number of words written, or 0 on failure.
+static int run_query(NVQRJob *job)
+{
+    int ret = 0;
+
+    while (context_acquired) {
+        NVQRQueryData_t *data;
+        long long start = nvqr_ipc_get_time_us();
+
+        ret = backend->query(job->queryType, job->len, job->data);
+        nvqr_record_time(NVQR_HIST_BACKEND_QUERY,
+                         nvqr_ipc_get_time_us() - start);
+        nvqr_count_stat(NVQR_STAT_BACKEND_QUERIES, 1);
+        if (ret < job->len) {
+            break;
+        }
+
+        if (job->len >= NVQR_MAX_RESPONSE_LEN ||
+            !(data = realloc(job->data, 2 * job->len * sizeof(*data)))) {
+            warning_msg("truncating resource query result at %d words.",
+                        job->len);
+            ret = job->len;
+            break;
+        }
+
+        job->data = data;
+        job->len *= 2;
+    }
+
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+// Acquire the backend's context for the GL worker thread, unless it already
+// has. Returns false on failure.
+static bool acquire_context(void)
+{
+    if (!context_acquired) {
+        long long start = nvqr_ipc_get_time_us();
+
+        context_acquired = backend->acquire_context();
+        if (!context_acquired) {
+            backend->release_context();
+        }
+        nvqr_record_time(NVQR_HIST_CONTEXT, nvqr_ipc_get_time_us() - start);
+    }
+
+    return context_acquired;
+}
+
+
+//------------------------------------------------------------------------------
+// Add a sample to the history, acquiring the context first if no client has
+// connected yet. Samples that were missed because the worker was busy are
+// skipped rather than taken late in a burst. If the context cannot be
+// acquired, stop keeping history.
+static void take_history_sample(long long now)
+{
+    int cnt;
+
+    next_history_sample += history_interval;
+    if (next_history_sample <= now) {
+        next_history_sample = now + history_interval;
+    }
+
+    if (!acquire_context()) {
+        warning_msg("failed to acquire a context; not keeping a history.");
+        nvqr_disable_history();
+        history_interval = 0;
+        return;
+    }
+
+    cnt = run_query(&history_job);
+    if (cnt > 0) {
+        long long timestamp = nvqr_ipc_get_time_us();
+
+        nvqr_record_history(history_job.data, cnt, timestamp);
+        nvqr_update_peaks(history_job.data, cnt, timestamp);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Wait on worker_cond, with worker_lock held, until signalled or, if history
+// is being kept, until the next sample is due.
+static void wait_for_work(long long now)
 {
-    bool success = false;
+    struct timespec deadline;
+    long long us = next_history_sample - now;
+
+    if (!history_interval) {
+        pthread_cond_wait(&worker_cond, &worker_lock);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += us / 1000000;
+    deadline.tv_nsec += (us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&worker_cond, &worker_lock, &deadline);
+}
 
-    pthread_mutex_lock(&connect_lock);
 
-    if (clientsConnected == 0) {
-        int screen;
-        XVisualInfo *visual;
-        static int attribs[] = { GLX_RGBA, None };
+//------------------------------------------------------------------------------
+// The GL worker thread: lazily acquire the backend's context on the first
+// connect request, then serve resource queries from the job queue with the
+// context kept current, so that no glXMakeCurrent() calls are needed per query
+// and the server loop never blocks on the driver. If history is being kept,
+// the context is acquired for the first sample instead, and samples that are
+// due are taken before the next job, so that a busy queue cannot starve them.
+// The peaks are updated from a query result only after it has been handed
+// back, so as not to delay it; the server loop never writes to the data of a
+// query job, and the job cannot be run again before this thread is done.
+static void *queryResourceWorkerThread(void *ptr)
+{
+    for (;;) {
+        NVQRJob *job;
+        long long now = nvqr_ipc_get_time_us();
+        const NVQRQueryData_t *peak_data = NULL;
+        int peak_cnt = 0;
+        long long peak_time = 0;
+
+        pthread_mutex_lock(&worker_lock);
+        while (!pending_jobs &&
+               !(history_interval && now >= next_history_sample)) {
+            wait_for_work(now);
+            now = nvqr_ipc_get_time_us();
+        }
+        job = pending_jobs;
+        if (job) {
+            pending_jobs = job->next;
+            if (!pending_jobs) {
+                pending_jobs_tail = &pending_jobs;
+            }
+        }
+        pthread_mutex_unlock(&worker_lock);
+
+        if (history_interval && now >= next_history_sample) {
+            take_history_sample(now);
+        }
 
-        // connect to X and create a GLX context
-        // XOpenDisplay(NULL) + DefaultScreen(dpy) may not give same display app
-        // is using: may need to revisit this if issues come up
-        dpy = XOpenDisplay(NULL);
-        if (dpy == NULL) {
-            error_msg("failed to open X11 display");
-            goto done;
+        if (!job) {
+            continue;
         }
-        screen = DefaultScreen(dpy);
 
-        visual = glXChooseVisual(dpy, screen, attribs);
-        if (visual == NULL) {
-            error_msg("failed to choose a GLX visual");
-            goto done;
+        nvqr_record_time(NVQR_HIST_QUEUE_WAIT,
+                         nvqr_ipc_get_time_us() - job->submitted);
+
+        switch (job->type) {
+            case NVQR_JOB_CONNECT:
+                job->result = acquire_context();
+                break;
+            case NVQR_JOB_QUERY:
+                job->result = run_query(job);
+                job->timestamp = nvqr_ipc_get_time_us();
+                if (job->queryType == GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV) {
+                    peak_data = job->data;
+                    peak_cnt = job->result;
+                    peak_time = job->timestamp;
+                }
+                break;
         }
 
-        ctx = glXCreateContext(dpy, visual, NULL, True);
-        XFree(visual);
+        job->finished = nvqr_ipc_get_time_us();
+
+        pthread_mutex_lock(&worker_lock);
+        job->next = completed_jobs;
+        completed_jobs = job;
+        pthread_mutex_unlock(&worker_lock);
 
-        if (ctx == NULL) {
-            error_msg("failed to create GLX context");
-            goto done;
+        // A full pipe already guarantees a pending wakeup, so EAGAIN is fine.
+        while (write(wakeup_fds[1], "", 1) == -1 && errno == EINTR);
+
+        if (peak_cnt > 0) {
+            nvqr_update_peaks(peak_data, peak_cnt, peak_time);
         }
     }
 
-    clientsConnected++;
-    success = true;
+    return NULL;
+}
+
 
-  done:
+//------------------------------------------------------------------------------
+// Start the GL worker thread, with worker_lock held, unless it is running
+// already. Returns false on failure.
+static bool start_worker(void)
+{
+    pthread_t thread;
 
-    if (!success) {
-        cleanup_glx_resources();
+    if (worker_started) {
+        return true;
     }
 
-    pthread_mutex_unlock(&connect_lock);
+    if (pthread_create(&thread, NULL, queryResourceWorkerThread, NULL) != 0) {
+        error_msg("failed to create GL worker thread.");
+        return false;
+    }
 
-    return success;
+    pthread_detach(thread);
+    worker_started = true;
+    return true;
 }
 
+
 //------------------------------------------------------------------------------
-// Decrement the connected clients refcount and clean up the GLX context and
-// X11 resources if the last client has disconnected.
-static void disconnectFromClient(void)
+// Set up the history and start the GL worker thread to take its samples, if
+// NVQR_HISTORY_INTERVAL_MS asks for a history. The first sample is taken one
+// interval from now, so that the application can set itself up first.
+static void start_history(void)
 {
-    pthread_mutex_lock(&connect_lock);
+    int interval = nvqr_init_history();
 
-    clientsConnected--;
+    if (!interval) {
+        return;
+    }
 
-    if (clientsConnected == 0) {
-        cleanup_glx_resources();
+    history_job.len = NVQR_MAX_DATA_BUFFER_LEN;
+    history_job.data = malloc(history_job.len * sizeof(history_job.data[0]));
+    if (!history_job.data) {
+        error_msg("failed to allocate the sample history.");
+        nvqr_disable_history();
+        return;
     }
+    history_job.type = NVQR_JOB_QUERY;
+    history_job.queryType = GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV;
 
-    pthread_mutex_unlock(&connect_lock);
+    history_interval = interval * 1000LL;
+    next_history_sample = nvqr_ipc_get_time_us() + history_interval;
+
+    pthread_mutex_lock(&worker_lock);
+    if (!start_worker()) {
+        history_interval = 0;
+        nvqr_disable_history();
+    }
+    pthread_mutex_unlock(&worker_lock);
 }
 
 
 //------------------------------------------------------------------------------
-// Make the GLX context current to the current thread and perform the resource
-// query. Returns 0 on failure, and passes along the return value of the
-// resource query operation on success.
-static int do_query(GLenum queryType, size_t len, int *data)
+// Hand a job to the GL worker thread, starting the thread if necessary.
+static bool submit_job(NVQRJob *job)
 {
-    int ret = 0;
+    bool ret;
 
-    pthread_mutex_lock(&query_lock);
+    pthread_mutex_lock(&worker_lock);
 
-    if (glXMakeCurrent(dpy, None, ctx)) {
-        ret = glQueryResourceNV(queryType, -1, len, data);
-        if (!glXMakeCurrent(dpy, None, NULL)) {
-            ret = 0;
-        }
+    ret = start_worker();
+    if (ret) {
+        job->submitted = nvqr_ipc_get_time_us();
+        job->next = NULL;
+        *pending_jobs_tail = job;
+        pending_jobs_tail = &job->next;
+        pthread_cond_signal(&worker_cond);
     }
 
-    pthread_mutex_unlock(&query_lock);
+    pthread_mutex_unlock(&worker_lock);
 
     return ret;
 }
 
+
 //------------------------------------------------------------------------------
-// Handle client requests over an accept(2)ed (accept(3socket) on Solaris)
-// domain socket connection. Keep the connection open until a disconnect
-// request is received from the client or an error occurs.
-static void *process_client_commands(void *fdp)
+// Read an integer tunable from the environment, falling back to the given
+// default if the variable is unset or out of the range [min, max].
+int get_env_int(const char *name, int def, int min, int max)
 {
-    NVQRQueryCmdBuffer readBuffer;
-    NVQRQueryDataBuffer writeBuffer;
-    int fd = *(int*)fdp;
-    bool connected = false, connection_successful = false;
-    sigset_t block_signals;
+    const char *str = getenv(name);
+    char *end;
+    long val;
 
-    // Suppress SIGPIPE in this thread, in case a client closes its connection
-    // before the server can respond to a request.
-    sigemptyset(&block_signals);
-    sigaddset(&block_signals, SIGPIPE);
-    pthread_sigmask(SIG_BLOCK, &block_signals, NULL);
+    if (!str || !*str) {
+        return def;
+    }
 
-    do {
-        memset(&writeBuffer, 0, sizeof(writeBuffer));
-
-        // read a command from the query tool
-        read(fd, &readBuffer, sizeof(readBuffer));
-        // by default, echo back the command op to the caller
-        writeBuffer.op = readBuffer.op;
-
-        // handle query commands appropriately
-        switch(readBuffer.op) {
-            // connect the client
-            case NVQR_QUERY_CONNECT:
-                    connected = connection_successful = connectToClient();
-
-                    if (connected) {
-                        break; // fall through to error if connection fails
-                    }
-
-            // perform the resource query
-            case NVQR_QUERY_MEMORY_INFO:
-                if (connected) {
-                    writeBuffer.cnt =  do_query(readBuffer.queryType,
-                                                sizeof(writeBuffer.data),
-                                                writeBuffer.data);
-                    if (writeBuffer.cnt) {
-                        break; // fall through to error if the query fails
-                    }
-                } // also fall through if the client was not connected
-
-            // Handle connection/query errors and unknown commands
-            default:
-                writeBuffer.op = 0; // tell the client there was an error
-                // fall through to disconnect
-
-            // disconnect the client
-            case NVQR_QUERY_DISCONNECT:
-                connected = false;
-                break;
+    val = strtol(str, &end, 10);
+    if (*end || val < min || val > max) {
+        warning_msg("ignoring invalid value '%s' for %s.", str, name);
+        return def;
+    }
+
+    return val;
+}
+
+
+//------------------------------------------------------------------------------
+// Put a file descriptor into non-blocking, close-on-exec mode.
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return false;
+    }
+
+    flags = fcntl(fd, F_GETFD);
+    return flags != -1 && fcntl(fd, F_SETFD, flags | FD_CLOEXEC) != -1;
+}
+
+
+//------------------------------------------------------------------------------
+// Queue the response in a client's response buffer for sending.
+static void queue_response(NVQRClient *client)
+{
+    client->resp_time = nvqr_ipc_get_time_us();
+    client->resp_bytes = sizeof(*client->resp) +
+                         client->resp->cnt * sizeof(NVQRQueryData_t);
+    client->resp_sent = 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Queue the response to the current command for sending. On failure, tell the
+// client there was an error and disconnect it once the response is sent.
+static void finish_command(NVQRClient *client, bool success)
+{
+    if (!success) {
+        client->resp->op = 0;
+        client->resp->cnt = 0;
+        client->connected = false;
+        nvqr_count_stat(NVQR_STAT_ERRORS, 1);
+    }
+
+    client->cmd_bytes = 0;
+    queue_response(client);
+}
+
+
+//------------------------------------------------------------------------------
+// Resize a client's response buffer to hold cnt words of data.
+static bool resize_response(NVQRClient *client, int cnt)
+{
+    NVQRQueryResponseHeader *resp;
+
+    resp = realloc(client->resp,
+                   sizeof(*resp) + cnt * sizeof(NVQRQueryData_t));
+    if (!resp) {
+        return false;
+    }
+
+    client->resp = resp;
+    client->resp_cap = cnt;
+    return true;
+}
+
+
+static void free_client(NVQRClient *client)
+{
+    free(client->delta_base);
+    free(client->resp);
+    free(client);
+}
+
+
+//------------------------------------------------------------------------------
+// Remember the result sent to a client for the next delta response. Without a
+// copy of it, the next response has to be a full one.
+static void set_delta_base(NVQRClient *client, NVQRQuerySlot *slot)
+{
+    if (slot->cnt > client->delta_cap) {
+        NVQRQueryData_t *base = realloc(client->delta_base,
+                                        slot->cnt * sizeof(*base));
+
+        if (!base) {
+            client->delta_cnt = 0;
+            return;
         }
+        client->delta_base = base;
+        client->delta_cap = slot->cnt;
+    }
+
+    memcpy(client->delta_base, slot->job.data,
+           slot->cnt * sizeof(slot->job.data[0]));
+    client->delta_cnt = slot->cnt;
+    client->delta_type = slot->job.queryType;
+}
+
+
+//------------------------------------------------------------------------------
+// Answer an NVQR_QUERY_MEMORY_INFO_DELTA command with a patch against the last
+// result sent to the client, if there is one and the patch is smaller than
+// the result. The patch is encoded into scratch space first, so that the
+// client's response buffer only has to grow for full responses. Returns false
+// if a full response has to be sent instead.
+static bool send_delta_patch(NVQRClient *client, NVQRQuerySlot *slot)
+{
+    static NVQRQueryData_t *patch = NULL;
+    static int patch_cap = 0;
+    int cnt;
 
-        // write a response to the client: if the client is already disconnected
-        // the write will fail with EPIPE. handle all write failures by closing
-        // the connection.
-        if (write(fd, &writeBuffer, sizeof(writeBuffer)) !=
-            sizeof(writeBuffer)) {
-            connected = false;
+    if (!client->delta_cnt || client->delta_type != slot->job.queryType) {
+        return false;
+    }
+
+    if (slot->cnt > patch_cap) {
+        NVQRQueryData_t *data = realloc(patch, slot->cnt * sizeof(*data));
+
+        if (!data) {
+            return false;
         }
-    } while (connected);
+        patch = data;
+        patch_cap = slot->cnt;
+    }
 
-    if (connection_successful) {
-        disconnectFromClient();
+    cnt = nvqr_encode_delta(client->delta_base, client->delta_cnt,
+                            slot->job.data, slot->cnt, patch, slot->cnt);
+    if (!cnt || (cnt > client->resp_cap && !resize_response(client, cnt))) {
+        return false;
     }
 
-    close(fd);
-    return NULL;
+    memcpy(client->resp + 1, patch, cnt * sizeof(*patch));
+    client->resp->cnt = cnt;
+    return true;
 }
 
+
 //------------------------------------------------------------------------------
-// Bind the domain socket and begin accepting client connections, spawning
-// a new thread for each connection.
-static void *queryResourcePreloadThread(void *ptr)
+// Write the result cached in the given slot to a client's response buffer, as
+// a delta response if delta is set. Returns false if out of memory.
+static bool write_result(NVQRClient *client, NVQRQuerySlot *slot, bool delta)
 {
-    struct sockaddr_un addr;
-    socklen_t addrlen = sizeof(addr);
-    int accept_fd;
-    pid_t my_pid = getpid();
+    long long age = nvqr_ipc_get_time_us() - slot->timestamp;
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    // socket_name may begin with '\0', so use memcpy(3) instead of strncpy(3)
-    memcpy(addr.sun_path, socket_name, SOCKET_NAME_MAX_LENGTH);
+    if (!delta || !send_delta_patch(client, slot)) {
+        NVQRQueryData_t *data;
+        int cnt = delta ? slot->cnt + 1 : slot->cnt;
 
-    if (bind(socket_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
-        error_msg("failed to bind socket for pid %ld.", (long) my_pid);
-        return NULL;
+        if (cnt > client->resp_cap && !resize_response(client, cnt)) {
+            return false;
+        }
+
+        data = (NVQRQueryData_t *) (client->resp + 1);
+        if (delta) {
+            *data++ = NVQR_DELTA_FULL;
+        }
+        memcpy(data, slot->job.data, slot->cnt * sizeof(*data));
+        client->resp->cnt = cnt;
     }
 
-    if (listen(socket_fd, NVQR_QUEUE_MAX) != 0) {
-        error_msg("failed to listen on pid %ld's socket.", (long) my_pid);
-        return NULL;
+    if (delta) {
+        set_delta_base(client, slot);
     }
 
-    while ((accept_fd = accept(socket_fd, (struct sockaddr*) &addr, &addrlen))
-           != -1) {
-        pthread_t thread;
+    client->resp->sampleAgeUs = age < INT_MAX ? age : INT_MAX;
+
+    nvqr_count_stat(NVQR_STAT_QUERIES, 1);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Answer a client's query from the result cached in the given slot. The
+// results of subscriptions are always sent as delta responses.
+static void send_cached_result(NVQRClient *client, NVQRQuerySlot *slot)
+{
+    bool delta = client->cmd.op == NVQR_QUERY_MEMORY_INFO_DELTA ||
+                 client->cmd.op == NVQR_QUERY_SUBSCRIBE;
+
+    finish_command(client, write_result(client, slot, delta));
+}
+
+
+//------------------------------------------------------------------------------
+// Look up the query slot for a query type, if there is one.
+static NVQRQuerySlot *find_query_slot(unsigned int queryType)
+{
+    NVQRQuerySlot *slot;
 
-        pthread_create(&thread, NULL, process_client_commands, &accept_fd);
+    for (slot = query_slots; slot; slot = slot->next) {
+        if (slot->job.queryType == queryType) {
+            return slot;
+        }
     }
 
     return NULL;
 }
 
+
 //------------------------------------------------------------------------------
-// Create a domain socket and spawn a thread to accept connections over it.
-__attribute__((constructor)) void queryResourcePreloadInit(void)
+// Look up the query slot for a query type, creating it if necessary. The
+// number of slots is bounded, since query types come from the clients.
+static NVQRQuerySlot *get_query_slot(unsigned int queryType)
 {
-    pthread_t queryThreadId;
-    pid_t my_pid = getpid();
+    NVQRQuerySlot *slot = find_query_slot(queryType);
+
+    if (slot || num_query_slots >= NVQR_MAX_QUERY_SLOTS) {
+        return slot;
+    }
+
+    slot = calloc(1, sizeof(*slot));
+    if (slot) {
+        slot->job.len = NVQR_MAX_DATA_BUFFER_LEN;
+        slot->job.data = malloc(slot->job.len * sizeof(slot->job.data[0]));
+        if (!slot->job.data) {
+            free(slot);
+            return NULL;
+        }
+        slot->job.type = NVQR_JOB_QUERY;
+        slot->job.queryType = queryType;
+        slot->job.slot = slot;
+        slot->next = query_slots;
+        query_slots = slot;
+        num_query_slots++;
+    }
 
-    pthread_mutex_init(&connect_lock, NULL);
+    return slot;
+}
 
-    glQueryResourceNV =
-        (PFNGLQUERYRESOURCENVPROC) glXGetProcAddressARB(NVQR_EXTENSION);
 
-    if (glQueryResourceNV == NULL) {
-        // XXX should check extension string once extension is exported there
-        error_msg("failed to load %s", NVQR_EXTENSION);
-        return;
+//------------------------------------------------------------------------------
+// Whether a slot's cached result may still be served.
+static bool is_fresh(const NVQRQuerySlot *slot)
+{
+    return slot->cnt && nvqr_ipc_get_time_us() - slot->timestamp < cache_ttl;
+}
+
+
+//------------------------------------------------------------------------------
+// Submit the query for a slot to the GL worker thread.
+static bool start_query(NVQRQuerySlot *slot)
+{
+    slot->in_flight = submit_job(&slot->job);
+    if (slot->in_flight) {
+        queries_in_flight++;
     }
+    return slot->in_flight;
+}
 
-    socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (socket_fd == -1) {
-        error_msg("failed to create socket.");
+
+//------------------------------------------------------------------------------
+// Answer a client's resource query: serve a fresh enough cached result if
+// there is one, and otherwise wait for the result of the query in flight for
+// the same query type, starting one if necessary. Returns false on failure.
+static bool request_query(NVQRClient *client)
+{
+    NVQRQuerySlot *slot = get_query_slot(client->cmd.queryType);
+
+    if (!slot) {
+        return false;
+    }
+
+    if (!slot->in_flight) {
+        if (is_fresh(slot)) {
+            nvqr_count_stat(NVQR_STAT_CACHE_HITS, 1);
+            send_cached_result(client, slot);
+            return true;
+        }
+
+        if (!start_query(slot)) {
+            return false;
+        }
+    } else {
+        nvqr_count_stat(NVQR_STAT_COALESCED, 1);
+    }
+
+    client->waiting_on = slot;
+    client->next_waiter = slot->waiters;
+    slot->waiters = client;
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Whether the client's current command queries several query types.
+static bool is_batch(const NVQRClient *client)
+{
+    return client->cmd.op == NVQR_QUERY_BATCH ||
+           client->cmd.op == NVQR_QUERY_ONESHOT;
+}
+
+
+//------------------------------------------------------------------------------
+// Append the result of the next query type of a batch to the response, or a
+// failed result if slot is NULL or holds no result. Room for a failed result
+// is kept for each query type still to come, so that running out of memory
+// fails the query type rather than the batch.
+static void append_batch_result(NVQRClient *client, NVQRQuerySlot *slot)
+{
+    int used = client->resp->cnt;
+    int cnt = slot ? slot->cnt : 0;
+    int need = used + 2 * (client->cmd.queryType - client->batch_next) + cnt;
+    NVQRQueryData_t *data;
+
+    if (need > client->resp_cap && !resize_response(client, need)) {
+        cnt = 0;
+    }
+
+    data = (NVQRQueryData_t *) (client->resp + 1) + used;
+    data[0] = client->cmd_types[client->batch_next++];
+    data[1] = cnt;
+    if (cnt) {
+        long long age = nvqr_ipc_get_time_us() - slot->timestamp;
+
+        memcpy(data + 2, slot->job.data, cnt * sizeof(*data));
+        if (age > client->resp->sampleAgeUs) {
+            client->resp->sampleAgeUs = age < INT_MAX ? age : INT_MAX;
+        }
+        nvqr_count_stat(NVQR_STAT_QUERIES, 1);
+    }
+    client->resp->cnt = used + 2 + cnt;
+}
+
+
+//------------------------------------------------------------------------------
+// Work through the query types of a batch in order, appending the results
+// that are cached and waiting for the others to be queried. Once all results
+// are in, send the response; one-shot clients are disconnected after that.
+static void continue_batch(NVQRClient *client)
+{
+    while (client->batch_next < client->cmd.queryType) {
+        NVQRQuerySlot *slot =
+            get_query_slot(client->cmd_types[client->batch_next]);
+
+        if (slot && !slot->in_flight) {
+            if (is_fresh(slot)) {
+                nvqr_count_stat(NVQR_STAT_CACHE_HITS, 1);
+                append_batch_result(client, slot);
+                continue;
+            }
+            start_query(slot);
+        } else if (slot) {
+            nvqr_count_stat(NVQR_STAT_COALESCED, 1);
+        }
+
+        if (!slot || !slot->in_flight) {
+            append_batch_result(client, NULL);
+            continue;
+        }
+
+        client->waiting_on = slot;
+        client->next_waiter = slot->waiters;
+        slot->waiters = client;
         return;
     }
 
-    if (nvqr_ipc_get_socket_name(socket_name, SOCKET_NAME_MAX_LENGTH, my_pid) >=
-        SOCKET_NAME_MAX_LENGTH) {
-        warning_msg("socket name for pid %ld truncated - "
-                    "name collision may be possible.", (long) my_pid);
+    if (client->cmd.op == NVQR_QUERY_ONESHOT) {
+        client->connected = false;
     }
+    finish_command(client, true);
+}
 
-    // create the thread
-    if (!XInitThreads()) {
-        error_msg("failed to initialize X threads.");
+
+//------------------------------------------------------------------------------
+// Start a batch of queries, after checking its query types.
+static void start_batch(NVQRClient *client)
+{
+    int count = client->cmd.queryType;
+
+    if (count < 1 || count > NVQR_MAX_BATCH_TYPES ||
+        (2 * count > client->resp_cap &&
+         !resize_response(client, 2 * count))) {
+        finish_command(client, false);
         return;
     }
-    pthread_create(&queryThreadId, NULL, &queryResourcePreloadThread, NULL);
+
+    client->batch_next = 0;
+    continue_batch(client);
 }
 
+
 //------------------------------------------------------------------------------
-// Clean up resources
-__attribute__((destructor)) void queryResourcePreloadExit(void)
+// Subscribe a client to pushed results with the parameters that followed the
+// command, and answer the command with the current result, which becomes the
+// base of the first push. Returns false on failure.
+static bool start_subscription(NVQRClient *client)
 {
-    pthread_mutex_destroy(&connect_lock);
-    pthread_mutex_destroy(&query_lock);
+    NVQRSubscribeParams *params = &client->sub;
 
-    if (socket_fd != -1) {
-        close(socket_fd);
-        unlink(socket_name);
+    memcpy(params, client->cmd_types, sizeof(*params));
+    if (params->intervalMs < 0 || params->thresholdKiB < 0 ||
+        params->thresholdPct < 0) {
+        return false;
+    }
+    if (params->intervalMs < NVQR_MIN_SUBSCRIBE_INTERVAL_MS) {
+        params->intervalMs = NVQR_MIN_SUBSCRIBE_INTERVAL_MS;
+    }
+
+    client->sub_type = client->cmd.queryType;
+    client->sub_request_id = client->cmd.requestId;
+    client->next_sample = nvqr_ipc_get_time_us() + params->intervalMs * 1000LL;
+    client->sampling = false;
+    client->delta_cnt = 0;
+
+    client->subscribed = request_query(client);
+    return client->subscribed;
+}
+
+
+//------------------------------------------------------------------------------
+// Have the results of the command's query type written to its shared
+// snapshot, creating the snapshot if necessary, and sampled at the interval
+// that followed the command. The response carries the snapshot's descriptor.
+// Returns false on failure.
+static bool start_snapshot(NVQRClient *client)
+{
+    NVQRQuerySlot *slot = get_query_slot(client->cmd.queryType);
+    int intervalMs = client->cmd_types[0];
+
+    if (!slot || intervalMs < 0) {
+        return false;
+    }
+
+    if (!slot->snapshot) {
+        slot->snapshot = nvqr_create_snapshot(slot->job.queryType);
+        if (!slot->snapshot) {
+            return false;
+        }
+
+        // Start with the cached result, unless it is being replaced
+        if (slot->cnt && !slot->in_flight) {
+            nvqr_publish_snapshot(slot->snapshot, slot->job.data, slot->cnt,
+                                  slot->timestamp);
+        }
+    }
+
+    memset(&client->sub, 0, sizeof(client->sub));
+    client->sub.intervalMs = intervalMs > NVQR_MIN_SUBSCRIBE_INTERVAL_MS ?
+                             intervalMs : NVQR_MIN_SUBSCRIBE_INTERVAL_MS;
+    client->sub_type = slot->job.queryType;
+    client->next_sample = nvqr_ipc_get_time_us();
+    client->subscribed = client->shared = true;
+    client->sampling = false;
+    client->send_snapshot = slot->snapshot;
+
+    client->resp->cnt = 0;
+    finish_command(client, true);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Respond to NVQR_QUERY_HISTORY with the samples in the history from the one
+// asked for onwards. Returns false on failure.
+static bool write_history(NVQRClient *client)
+{
+    unsigned long long since = (unsigned int) client->cmd_types[0] |
+        (unsigned long long) (unsigned int) client->cmd_types[1] << 32;
+    unsigned long long first;
+    int avail = nvqr_history_available(since), cnt;
+    NVQRQueryData_t *data;
+
+    cnt = NVQR_HISTORY_HEADER_LEN + avail * NVQR_HISTORY_SAMPLE_LEN;
+    if (cnt > client->resp_cap && !resize_response(client, cnt)) {
+        return false;
+    }
+
+    data = (NVQRQueryData_t *) (client->resp + 1);
+    avail = nvqr_read_history(since, avail, &first,
+                              data + NVQR_HISTORY_HEADER_LEN);
+    data[0] = NVQR_HISTORY_VERSION;
+    data[1] = nvqr_history_interval_ms();
+    data[2] = (NVQRQueryData_t) (first & 0xffffffff);
+    data[3] = (NVQRQueryData_t) (first >> 32);
+    data[4] = avail;
+
+    client->resp->cnt = NVQR_HISTORY_HEADER_LEN +
+                        avail * NVQR_HISTORY_SAMPLE_LEN;
+    finish_command(client, true);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Respond to NVQR_QUERY_PEAKS with the peak usage seen so far. Returns false
+// on failure.
+static bool write_peaks(NVQRClient *client)
+{
+    int num = nvqr_num_peaks();
+    int cnt = NVQR_PEAKS_HEADER_LEN + num * NVQR_PEAK_LEN;
+    NVQRQueryData_t *data;
+
+    if (cnt > client->resp_cap && !resize_response(client, cnt)) {
+        return false;
+    }
+
+    data = (NVQRQueryData_t *) (client->resp + 1);
+    num = nvqr_write_peaks(data + NVQR_PEAKS_HEADER_LEN, num);
+    data[0] = NVQR_PEAKS_VERSION;
+    data[1] = num;
+
+    client->resp->cnt = NVQR_PEAKS_HEADER_LEN + num * NVQR_PEAK_LEN;
+    finish_command(client, true);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Answer the current command with NVQR_QUERY_THROTTLED, asking the client to
+// retry after retryUs microseconds.
+static void throttle_command(NVQRClient *client, long long retryUs)
+{
+    client->resp->op = NVQR_QUERY_THROTTLED;
+    client->resp->cnt = 1;
+    ((NVQRQueryData_t *) (client->resp + 1))[0] =
+        retryUs < INT_MAX ? retryUs : INT_MAX;
+
+    if (client->cmd.op == NVQR_QUERY_ONESHOT) {
+        client->connected = false;
+    }
+
+    nvqr_count_stat(NVQR_STAT_THROTTLED, 1);
+    finish_command(client, true);
+}
+
+
+//------------------------------------------------------------------------------
+// Check the current command against the admission limits, before it can cause
+// any work for the GL worker thread. Returns false if the command has been
+// throttled.
+static bool admit_command(NVQRClient *client)
+{
+    int cost = 1, added = 0, i;
+    long long retryUs;
+
+    switch (client->cmd.op) {
+        case NVQR_QUERY_MEMORY_INFO:
+        case NVQR_QUERY_MEMORY_INFO_DELTA:
+        case NVQR_QUERY_SUBSCRIBE:
+        case NVQR_QUERY_MAP_SNAPSHOT:
+            break;
+        case NVQR_QUERY_BATCH:
+        case NVQR_QUERY_ONESHOT:
+            // Malformed batches are rejected later on
+            if (client->cmd.queryType < 1 ||
+                client->cmd.queryType > NVQR_MAX_BATCH_TYPES) {
+                return true;
+            }
+            cost = client->cmd.queryType;
+            break;
+        default:
+            return true;
+    }
+
+    // Count the queries that cannot be answered from the cache or joined
+    for (i = 0; i < cost; i++) {
+        NVQRQuerySlot *slot = find_query_slot(is_batch(client) ?
+                                              client->cmd_types[i] :
+                                              client->cmd.queryType);
+
+        if (!slot || (!slot->in_flight && !is_fresh(slot))) {
+            added++;
+        }
+    }
+
+    retryUs = nvqr_check_pending_queries(queries_in_flight, added);
+    if (!retryUs) {
+        retryUs = nvqr_take_tokens(&client->bucket, client->user, cost);
+    }
+    if (retryUs) {
+        throttle_command(client, retryUs);
+        return false;
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Handle a fully received command from a client. The response is either
+// queued right away, or once the GL worker thread has completed the job that
+// was submitted for the command. Keep the connection open until a disconnect
+// request is received from the client or an error occurs.
+static void process_client_command(NVQRClient *client)
+{
+    NVQRQueryCmdBuffer *readBuffer = &client->cmd;
+    NVQRQueryResponseHeader *writeBuffer = client->resp;
+
+    memset(writeBuffer, 0, sizeof(*writeBuffer));
+
+    client->cmd_time = nvqr_ipc_get_time_us();
+    nvqr_count_stat(NVQR_STAT_COMMANDS, 1);
+
+    // by default, echo back the command op to the caller
+    writeBuffer->op = readBuffer->op;
+    writeBuffer->requestId = readBuffer->requestId;
+
+    // A subscribed client may only end its subscription, unless it reads the
+    // results from a shared snapshot
+    if (client->subscribed && !client->shared &&
+        readBuffer->op != NVQR_QUERY_UNSUBSCRIBE &&
+        readBuffer->op != NVQR_QUERY_DISCONNECT) {
+        finish_command(client, false);
+        return;
+    }
+
+    if (!admit_command(client)) {
+        return;
+    }
+
+    // handle query commands appropriately
+    switch(readBuffer->op) {
+        // connect the client, acquiring the backend's context on first use
+        case NVQR_QUERY_CONNECT:
+            if (context_ready) {
+                client->connected = true;
+                finish_command(client, true);
+            } else {
+                NVQRJob *job = &client->job;
+
+                memset(job, 0, sizeof(*job));
+                job->type = NVQR_JOB_CONNECT;
+                job->client = client;
+
+                client->job_pending = submit_job(job);
+                if (!client->job_pending) {
+                    finish_command(client, false);
+                }
+            }
+            break;
+
+        // perform the resource query
+        case NVQR_QUERY_MEMORY_INFO:
+        case NVQR_QUERY_MEMORY_INFO_DELTA:
+            if (!client->connected || !request_query(client)) {
+                finish_command(client, false);
+            }
+            break;
+
+        // forget the last result sent for delta responses
+        case NVQR_QUERY_DELTA_RESET:
+            client->delta_cnt = 0;
+            finish_command(client, client->connected);
+            break;
+
+        // perform several queries at once
+        case NVQR_QUERY_BATCH:
+            if (!client->connected) {
+                finish_command(client, false);
+            } else {
+                start_batch(client);
+            }
+            break;
+
+        // connect, perform several queries at once and disconnect
+        case NVQR_QUERY_ONESHOT:
+            if (context_ready) {
+                client->connected = true;
+                start_batch(client);
+            } else {
+                NVQRJob *job = &client->job;
+
+                memset(job, 0, sizeof(*job));
+                job->type = NVQR_JOB_CONNECT;
+                job->client = client;
+
+                client->job_pending = submit_job(job);
+                if (!client->job_pending) {
+                    finish_command(client, false);
+                }
+            }
+            break;
+
+        // push results to the client whenever they change enough
+        case NVQR_QUERY_SUBSCRIBE:
+            if (!client->connected || client->subscribed ||
+                !start_subscription(client)) {
+                finish_command(client, false);
+            }
+            break;
+
+        // write results to shared memory, and hand it to the client
+        case NVQR_QUERY_MAP_SNAPSHOT:
+            if (!client->connected || client->subscribed ||
+                !start_snapshot(client)) {
+                finish_command(client, false);
+            }
+            break;
+
+        // stop pushing or sharing results, and forget the last one sent
+        case NVQR_QUERY_UNSUBSCRIBE:
+            client->subscribed = client->sampling = client->shared = false;
+            client->delta_cnt = 0;
+            finish_command(client, client->connected);
+            break;
+
+        // report the server statistics, which needs no context
+        case NVQR_QUERY_STATS:
+            if (NVQR_STATS_LEN > client->resp_cap &&
+                !resize_response(client, NVQR_STATS_LEN)) {
+                finish_command(client, false);
+                break;
+            }
+            nvqr_write_stats((NVQRQueryData_t *) (client->resp + 1));
+            client->resp->cnt = NVQR_STATS_LEN;
+            finish_command(client, true);
+            break;
+
+        // report the samples in the history from the one asked for onwards,
+        // which needs no context either
+        case NVQR_QUERY_HISTORY:
+            if (!write_history(client)) {
+                finish_command(client, false);
+            }
+            break;
+
+        // report the peak usage seen so far, which needs no context
+        case NVQR_QUERY_PEAKS:
+            if (!write_peaks(client)) {
+                finish_command(client, false);
+            }
+            break;
+
+        // disconnect the client
+        case NVQR_QUERY_DISCONNECT:
+            client->connected = false;
+            finish_command(client, true);
+            break;
+
+        // Handle unknown commands
+        default:
+            finish_command(client, false);
+            break;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// The length in bytes of the command being received from a client, which is
+// only known once the fixed part has been received.
+static size_t command_length(const NVQRClient *client)
+{
+    size_t len = sizeof(client->cmd);
+
+    if (client->cmd_bytes >= len && is_batch(client) &&
+        client->cmd.queryType > 0 &&
+        client->cmd.queryType <= NVQR_MAX_BATCH_TYPES) {
+        len += client->cmd.queryType * sizeof(client->cmd_types[0]);
+    } else if (client->cmd_bytes >= len &&
+               client->cmd.op == NVQR_QUERY_SUBSCRIBE) {
+        len += sizeof(NVQRSubscribeParams);
+    } else if (client->cmd_bytes >= len &&
+               client->cmd.op == NVQR_QUERY_MAP_SNAPSHOT) {
+        len += sizeof(client->cmd_types[0]);
+    } else if (client->cmd_bytes >= len &&
+               client->cmd.op == NVQR_QUERY_HISTORY) {
+        len += 2 * sizeof(client->cmd_types[0]);
+    }
+
+    return len;
+}
+
+
+//------------------------------------------------------------------------------
+// Close a client connection and remove it from the client list. The last
+// client is moved into the freed slot, so callers iterating over the client
+// list must do so backwards. If the GL worker thread still holds a job for
+// this client, the client is freed once that job completes.
+static void close_client(NVQRClient *client)
+{
+    int index = client->index;
+
+    close(client->fd);
+    nvqr_remove_user_client(client->user);
+
+    num_clients--;
+    if (index != num_clients) {
+        clients[index] = clients[num_clients];
+        clients[index]->index = index;
+    }
+
+    if (client->waiting_on) {
+        NVQRClient **waiter = &client->waiting_on->waiters;
+
+        while (*waiter != client) {
+            waiter = &(*waiter)->next_waiter;
+        }
+        *waiter = client->next_waiter;
+    }
+
+    if (client->job_pending) {
+        client->closing = true;
+    } else {
+        free_client(client);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Write as much of a client's response as the socket takes. The descriptor of
+// a shared snapshot that is to be sent goes along with the first byte.
+static ssize_t write_response(NVQRClient *client)
+{
+    char *buf = (char *) client->resp + client->resp_sent;
+    size_t len = client->resp_bytes - client->resp_sent;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t ret;
+    int fd;
+
+    if (!client->send_snapshot) {
+        return write(client->fd, buf, len);
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    fd = nvqr_snapshot_fd(client->send_snapshot);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    ret = sendmsg(client->fd, &msg, 0);
+    if (ret > 0) {
+        client->send_snapshot = NULL;
+    }
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+// Make progress on a client connection without blocking: flush any pending
+// response, then read and dispatch the next command. Returns false if the
+// connection should be closed.
+static bool service_client(NVQRClient *client, short revents)
+{
+    long long now;
+    ssize_t ret;
+    int i;
+
+    if (revents & (POLLERR | POLLNVAL)) {
+        return false;
+    }
+
+    // Bound the number of commands handled per wakeup, so that one client
+    // issuing back-to-back requests cannot starve the others.
+    for (i = 0; i < NVQR_MAX_COMMANDS_PER_WAKEUP; i++) {
+        if (client->job_pending || client->waiting_on) {
+            // Nothing to do until the GL worker thread is done; only notice
+            // a client that has gone away in the meantime.
+            return !(revents & POLLHUP);
+        }
+
+        if (client->resp_bytes) {
+            // A failed write (e.g. EPIPE if the client already went away)
+            // closes the connection.
+            while (client->resp_sent < client->resp_bytes) {
+                ret = write_response(client);
+                if (ret < 0) {
+                    return errno == EAGAIN || errno == EWOULDBLOCK ||
+                           errno == EINTR;
+                }
+                client->resp_sent += ret;
+            }
+
+            now = nvqr_ipc_get_time_us();
+            nvqr_record_time(NVQR_HIST_SEND, now - client->resp_time);
+            nvqr_record_time(NVQR_HIST_TOTAL, now - client->cmd_time);
+            nvqr_count_stat(NVQR_STAT_BYTES_SENT, client->resp_bytes);
+
+            client->resp_bytes = client->resp_sent = 0;
+
+            // Don't hold on to the memory used for an unusually large
+            // response while the client is idle.
+            if (client->resp_cap > NVQR_MAX_DATA_BUFFER_LEN) {
+                resize_response(client, NVQR_MAX_DATA_BUFFER_LEN);
+            }
+
+            if (!client->connected) {
+                return false;
+            }
+        }
+
+        while (client->cmd_bytes < command_length(client)) {
+            char *buf;
+            size_t len;
+
+            // Batch, subscribe and map commands are followed by their query
+            // types or parameters
+            if (client->cmd_bytes < sizeof(client->cmd)) {
+                buf = (char *) &client->cmd + client->cmd_bytes;
+                len = sizeof(client->cmd) - client->cmd_bytes;
+            } else {
+                buf = (char *) client->cmd_types +
+                      (client->cmd_bytes - sizeof(client->cmd));
+                len = command_length(client) - client->cmd_bytes;
+            }
+
+            ret = read(client->fd, buf, len);
+            if (ret == 0) {
+                return false;
+            }
+            if (ret < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ||
+                       errno == EINTR;
+            }
+            client->cmd_bytes += ret;
+        }
+
+        // Try to send the response right away; most of the time the socket
+        // buffer has room for it and we save a trip through poll(2).
+        process_client_command(client);
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Queue a new result for a subscriber if its memory usage has changed enough
+// since the last result pushed. A subscriber that is still being sent the
+// previous push, or is busy with a command, is skipped: since changes are
+// measured against what it was sent last, it gets this one with a later
+// sample. Returns false if the connection should be closed.
+static bool queue_update(NVQRClient *client, NVQRQuerySlot *slot)
+{
+    // Shared snapshots have already been written with the result
+    if (client->shared || !slot->cnt || client->resp_bytes ||
+        client->job_pending || client->waiting_on) {
+        return true;
+    }
+
+    nvqr_count_stat(NVQR_STAT_SAMPLES, 1);
+    if (client->delta_cnt &&
+        !nvqr_usage_changed(&client->sub, client->delta_base,
+                            client->delta_cnt, slot->job.data, slot->cnt)) {
+        return true;
+    }
+
+    memset(client->resp, 0, sizeof(*client->resp));
+    client->resp->op = NVQR_QUERY_SUBSCRIBE;
+    client->resp->requestId = client->sub_request_id;
+    if (!write_result(client, slot, true)) {
+        return false;
+    }
+
+    nvqr_count_stat(NVQR_STAT_UPDATES, 1);
+    client->cmd_time = nvqr_ipc_get_time_us();
+    queue_response(client);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Queue a new result for a subscriber, as above, and start sending it.
+static bool push_update(NVQRClient *client, NVQRQuerySlot *slot)
+{
+    return queue_update(client, slot) && service_client(client, 0);
+}
+
+
+//------------------------------------------------------------------------------
+// Cache the result of a completed query and send it to all clients that were
+// waiting for it or sampled it for a subscription. The result is copied to
+// every one of them before any is serviced further, since that may start the
+// next query for this slot.
+static void complete_query(NVQRQuerySlot *slot)
+{
+    NVQRClient *waiters, *client, *next;
+    int i;
+
+    slot->in_flight = false;
+    queries_in_flight--;
+    slot->cnt = slot->job.result;
+    slot->timestamp = slot->job.timestamp;
+
+    if (slot->snapshot && slot->cnt) {
+        nvqr_publish_snapshot(slot->snapshot, slot->job.data, slot->cnt,
+                              slot->timestamp);
+    }
+
+    waiters = slot->waiters;
+    slot->waiters = NULL;
+
+    for (client = waiters; client; client = client->next_waiter) {
+        client->waiting_on = NULL;
+
+        if (is_batch(client)) {
+            append_batch_result(client, slot);
+        } else if (slot->cnt) {
+            send_cached_result(client, slot);
+        } else {
+            finish_command(client, false);
+        }
+    }
+
+    for (i = num_clients - 1; i >= 0; i--) {
+        client = clients[i];
+
+        if (client->sampling && client->sub_type == slot->job.queryType &&
+            !queue_update(client, slot)) {
+            close_client(client);
+        }
+    }
+
+    for (client = waiters; client; client = next) {
+        next = client->next_waiter;
+
+        if (is_batch(client)) {
+            continue_batch(client);
+        }
+
+        if (!service_client(client, 0)) {
+            close_client(client);
+        }
+    }
+
+    for (i = num_clients - 1; i >= 0; i--) {
+        client = clients[i];
+
+        if (client->sampling && client->sub_type == slot->job.queryType) {
+            client->sampling = false;
+            if (!service_client(client, 0)) {
+                close_client(client);
+            }
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Sample the query type of a subscription: check the cached result if it is
+// fresh enough, and otherwise wait for the query in flight for it, starting
+// one if the limit on pending queries allows. Returns false if the connection
+// should be closed.
+static bool sample_subscription(NVQRClient *client)
+{
+    NVQRQuerySlot *slot = get_query_slot(client->sub_type);
+
+    if (!slot) {
+        return true;
+    }
+
+    if (!slot->in_flight) {
+        if (is_fresh(slot)) {
+            nvqr_count_stat(NVQR_STAT_CACHE_HITS, 1);
+            return push_update(client, slot);
+        }
+
+        if (nvqr_check_pending_queries(queries_in_flight, 1) ||
+            !start_query(slot)) {
+            return true;
+        }
+    } else {
+        nvqr_count_stat(NVQR_STAT_COALESCED, 1);
+    }
+
+    client->sampling = true;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Sample the subscriptions that are due, and return the number of milliseconds
+// until the next one is, or -1 if there are none. Samples that were missed
+// because a previous one took too long are skipped rather than made up for.
+static int sample_subscriptions(void)
+{
+    long long now = nvqr_ipc_get_time_us(), next = -1;
+    int i;
+
+    for (i = num_clients - 1; i >= 0; i--) {
+        NVQRClient *client = clients[i];
+
+        if (!client->subscribed || client->sampling) {
+            continue;
+        }
+
+        if (client->next_sample <= now) {
+            client->next_sample += client->sub.intervalMs * 1000LL;
+            if (client->next_sample <= now) {
+                client->next_sample = now + client->sub.intervalMs * 1000LL;
+            }
+            if (!sample_subscription(client)) {
+                close_client(client);
+                continue;
+            }
+        }
+
+        if (client->subscribed && !client->sampling &&
+            (next < 0 || client->next_sample < next)) {
+            next = client->next_sample;
+        }
+    }
+
+    if (next < 0) {
+        return -1;
+    }
+    return next <= now ? 0 : (int) ((next - now + 999) / 1000);
+}
+
+
+//------------------------------------------------------------------------------
+// Deliver the results of the jobs completed by the GL worker thread to the
+// clients that submitted them.
+static void process_completed_jobs(void)
+{
+    NVQRJob *job, *next;
+    char drain[64];
+
+    while (read(wakeup_fds[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&worker_lock);
+    job = completed_jobs;
+    completed_jobs = NULL;
+    pthread_mutex_unlock(&worker_lock);
+
+    for (; job; job = next) {
+        NVQRClient *client = job->client;
+
+        next = job->next;
+        nvqr_record_time(NVQR_HIST_COMPLETION,
+                         nvqr_ipc_get_time_us() - job->finished);
+
+        if (job->type == NVQR_JOB_QUERY) {
+            complete_query(job->slot);
+            continue;
+        }
+
+        client->job_pending = false;
+
+        if (client->closing) {
+            free_client(client);
+            continue;
+        }
+
+        if (job->result) {
+            context_ready = client->connected = true;
+        }
+        if (job->result && client->cmd.op == NVQR_QUERY_ONESHOT) {
+            start_batch(client);
+        } else {
+            finish_command(client, job->result != 0);
+        }
+
+        if (!service_client(client, 0)) {
+            close_client(client);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Turn away a new connection from a user who already has as many as allowed,
+// without giving it a client slot: answer the command it is about to send
+// with NVQR_QUERY_THROTTLED right away, and close it. Shutting the socket down
+// first makes the client's write of the command fail with EPIPE, and once any
+// part of the command that did arrive has been drained, closing the socket no
+// longer resets the connection, so the client can still read the response.
+static void refuse_connection(int fd)
+{
+    struct {
+        NVQRQueryResponseHeader header;
+        NVQRQueryData_t retryUs;
+    } resp;
+    char drain[64];
+
+    memset(&resp, 0, sizeof(resp));
+    resp.header.op = NVQR_QUERY_THROTTLED;
+    resp.header.cnt = 1;
+    resp.retryUs = NVQR_REFUSED_RETRY_US;
+
+    if (write(fd, &resp, sizeof(resp)) == sizeof(resp)) {
+        nvqr_count_stat(NVQR_STAT_THROTTLED, 1);
+    }
+
+    shutdown(fd, SHUT_RDWR);
+    while (read(fd, drain, sizeof(drain)) > 0);
+    close(fd);
+}
+
+
+//------------------------------------------------------------------------------
+// Accept as many pending connections as there are free client slots.
+static void accept_clients(int max_clients)
+{
+    while (num_clients < max_clients) {
+        NVQRClient *client;
+        NVQRUserLimit *user;
+        bool admitted;
+        int fd = accept(socket_fd, NULL, NULL);
+
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        nvqr_count_stat(NVQR_STAT_CONNECTIONS, 1);
+        user = nvqr_add_user_client(nvqr_get_peer_uid(fd), &admitted);
+        if (!admitted) {
+            nvqr_remove_user_client(user);
+            refuse_connection(fd);
+            continue;
+        }
+
+        client = calloc(1, sizeof(*client));
+        if (!client || !resize_response(client, NVQR_MAX_DATA_BUFFER_LEN) ||
+            !set_nonblocking(fd)) {
+            if (client) {
+                free_client(client);
+            }
+            nvqr_remove_user_client(user);
+            close(fd);
+            continue;
+        }
+
+        client->fd = fd;
+        client->user = user;
+        client->index = num_clients;
+        clients[num_clients++] = client;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Serve all client connections to the listening socket from this thread with
+// a single poll(2) loop. The maximum number of simultaneous clients can be set
+// with NVQR_MAX_CLIENTS; while all client slots are in use, new connections
+// wait in the listen backlog. Resource queries are handed off to the GL worker
+// thread. The poll timeout is set to wake up for the next subscription due to
+// be sampled.
+static void *queryResourcePreloadThread(void *ptr)
+{
+    struct pollfd *fds;
+    pid_t my_pid = getpid();
+    int max_clients = get_env_int("NVQR_MAX_CLIENTS", NVQR_MAX_CLIENTS,
+                                  1, 65536);
+    sigset_t block_signals;
+
+    cache_ttl = get_env_int("NVQR_CACHE_TTL_MS", 0, 0, INT_MAX) * 1000LL;
+    nvqr_init_limits();
+
+    // Suppress SIGPIPE in this thread, in case a client closes its connection
+    // before the server can respond to a request.
+    sigemptyset(&block_signals);
+    sigaddset(&block_signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block_signals, NULL);
+
+    if (!set_nonblocking(socket_fd) || pipe(wakeup_fds) != 0 ||
+        !set_nonblocking(wakeup_fds[0]) || !set_nonblocking(wakeup_fds[1])) {
+        error_msg("failed to configure pid %ld's socket.", (long) my_pid);
+        return NULL;
+    }
+
+    clients = calloc(max_clients, sizeof(*clients));
+    fds = calloc(max_clients + 2, sizeof(*fds));
+    if (!clients || !fds) {
+        error_msg("failed to allocate client connection table.");
+        free(clients);
+        free(fds);
+        clients = NULL;
+        return NULL;
+    }
+
+    start_history();
+
+    for (;;) {
+        int i, base, nfds = 0, timeout = sample_subscriptions();
+        bool listening = num_clients < max_clients;
+
+        fds[nfds].fd = wakeup_fds[0];
+        fds[nfds].events = POLLIN;
+        nfds++;
+
+        // Only watch the listening socket while there are free client slots
+        if (listening) {
+            fds[nfds].fd = socket_fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        for (i = 0; i < num_clients; i++) {
+            fds[nfds].fd = clients[i]->fd;
+            fds[nfds].events = (clients[i]->job_pending ||
+                                clients[i]->waiting_on) ? 0 :
+                               clients[i]->resp_bytes ? POLLOUT : POLLIN;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_msg("failed to poll client connections.");
+            break;
+        }
+
+        // Service existing clients first. The poll results of the clients
+        // start at fds[base], in the order clients[] had before polling.
+        // Walk backwards, so that closing a client, which moves the last
+        // client into the freed slot, only moves a client that has already
+        // been serviced, and the clients still to come keep their indices.
+        base = nfds - num_clients;
+        for (i = num_clients - 1; i >= 0; i--) {
+            struct pollfd *pfd = &fds[base + i];
+
+            if (pfd->revents && !service_client(clients[i], pfd->revents)) {
+                close_client(clients[i]);
+            }
+        }
+
+        if (listening && fds[1].revents) {
+            accept_clients(max_clients);
+        }
+
+        if (fds[0].revents) {
+            process_completed_jobs();
+        }
+    }
+
+    free(fds);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Select the backend named by NVQR_BACKEND, defaulting to GLX.
+static const NVQRBackend *select_backend(void)
+{
+    const char *name = getenv("NVQR_BACKEND");
+    size_t i;
+
+    if (!name || !*name) {
+        return &nvqr_glx_backend;
+    }
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(name, backends[i]->name) == 0) {
+            return backends[i];
+        }
+    }
+
+    error_msg("unknown query backend '%s'.", name);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Create the domain socket and start listening on it, with the listen backlog
+// set by NVQR_LISTEN_BACKLOG. Returns false on failure, closing the socket.
+static bool open_listener(void)
+{
+    struct sockaddr_un addr;
+    pid_t my_pid = getpid();
+    int backlog = get_env_int("NVQR_LISTEN_BACKLOG", NVQR_QUEUE_MAX,
+                              1, INT_MAX);
+
+    socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        error_msg("failed to create socket.");
+        return false;
+    }
+
+    if (nvqr_ipc_get_socket_name(socket_name, SOCKET_NAME_MAX_LENGTH, my_pid) >=
+        SOCKET_NAME_MAX_LENGTH) {
+        warning_msg("socket name for pid %ld truncated - "
+                    "name collision may be possible.", (long) my_pid);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    // socket_name may begin with '\0', so use memcpy(3) instead of strncpy(3)
+    memcpy(addr.sun_path, socket_name, SOCKET_NAME_MAX_LENGTH);
+
+    if (bind(socket_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        error_msg("failed to bind socket for pid %ld.", (long) my_pid);
+    } else if (listen(socket_fd, backlog) != 0) {
+        error_msg("failed to listen on pid %ld's socket.", (long) my_pid);
+    } else {
+        return true;
+    }
+
+    close(socket_fd);
+    socket_fd = -1;
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Start listening on a domain socket and spawn a thread to serve connections
+// over it. This runs in every process the DSO is preloaded into, before
+// main(), so everything else is deferred: the server thread sets itself up
+// while the application starts, and the backend loads its libraries when the
+// first client connects. The server thread gets a small stack, as it never
+// runs application or driver code.
+__attribute__((constructor)) void queryResourcePreloadInit(void)
+{
+    pthread_t queryThreadId;
+    pthread_attr_t attr;
+
+    backend = select_backend();
+    if (!backend || !backend->init()) {
+        backend = NULL;
+        return;
+    }
+
+    if (!open_listener()) {
+        return;
+    }
+
+    // create the thread
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, NVQR_SERVER_STACK_SIZE);
+    if (pthread_create(&queryThreadId, &attr, &queryResourcePreloadThread,
+                       NULL) != 0) {
+        error_msg("failed to create query server thread.");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+//------------------------------------------------------------------------------
+// Print the peak usage to the file named by NVQR_PEAK_DUMP, or to stderr if
+// it is "-". The file is appended to, so that several processes may share it.
+static void dump_peaks(void)
+{
+    const char *name = getenv("NVQR_PEAK_DUMP");
+    FILE *stream;
+
+    if (!name || !*name) {
+        return;
+    }
+
+    stream = strcmp(name, "-") == 0 ? stderr : fopen(name, "a");
+    if (!stream) {
+        error_msg("failed to open '%s' for the peak usage.", name);
+        return;
+    }
+
+    nvqr_dump_peaks(stream, (long) getpid());
+
+    if (stream != stderr) {
+        fclose(stream);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Clean up resources. The listening socket itself is left to process teardown,
+// as the server thread may still be setting up or polling it; short-lived
+// processes often exit before it has even started.
+__attribute__((destructor)) void queryResourcePreloadExit(void)
+{
+    if (socket_fd != -1) {
+        unlink(socket_name);
+        dump_peaks();
+    }
+    if (backend) {
+        backend->shutdown();
     }
 }
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __NVIDIA_QUERY_RESOURCE_OPENGL_PRELOAD_H__
+#define __NVIDIA_QUERY_RESOURCE_OPENGL_PRELOAD_H__
+
+// Functions shared between the source files of the preload DSO
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "nvidia-query-resource-opengl-data.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+
+// Symbols shared between the files of the preload DSO are kept out of its
+// dynamic symbol table, so that they cannot clash with the application's.
+#define NVQR_HIDDEN __attribute__((visibility("hidden")))
+
+//------------------------------------------------------------------------------
+// Print an error or warning message to stderr with the NVQR header
+
+NVQR_HIDDEN void error_msg(const char *fmt, ...);
+NVQR_HIDDEN void warning_msg(const char *fmt, ...);
+
+//------------------------------------------------------------------------------
+// Read an integer tunable from the environment, returning def if the
+// variable is unset or outside the range [min, max].
+
+NVQR_HIDDEN int get_env_int(const char *name, int def, int min, int max);
+
+//------------------------------------------------------------------------------
+// Encode the cnt word result cur as an NVQR_DELTA_PATCH against the baseCnt
+// word result base, matching their device summaries, detail blocks and tags
+// by device, object type and tag ID. Writes at most maxOut words to out, and
+// returns the number of words written, or 0 if either result is malformed or
+// the patch would not fit, in which case a full response should be sent.
+
+NVQR_HIDDEN int nvqr_encode_delta(const NVQRQueryData_t *base, int baseCnt,
+                                  const NVQRQueryData_t *cur, int cnt,
+                                  NVQRQueryData_t *out, int maxOut);
+
+//------------------------------------------------------------------------------
+// Whether the memory usage in the cnt word result cur differs from that in the
+// baseCnt word result base by enough to push cur to a subscriber with the
+// given parameters. Blocks are matched as for nvqr_encode_delta(); results
+// that cannot be compared count as changed.
+
+NVQR_HIDDEN bool nvqr_usage_changed(const NVQRSubscribeParams *params,
+                                    const NVQRQueryData_t *base, int baseCnt,
+                                    const NVQRQueryData_t *cur, int cnt);
+
+//------------------------------------------------------------------------------
+// Shared snapshots of the results of a query type, for NVQR_QUERY_MAP_SNAPSHOT.
+// nvqr_create_snapshot() returns NULL on failure, and nvqr_snapshot_fd() the
+// read-only descriptor to pass to clients. nvqr_publish_snapshot() writes a
+// result of cnt words sampled at timestampUs, growing the shared region if
+// needed, and returns false if it could not.
+
+typedef struct NVQRSnapshotRec NVQRSnapshot;
+
+NVQR_HIDDEN NVQRSnapshot *nvqr_create_snapshot(unsigned int queryType);
+NVQR_HIDDEN int nvqr_snapshot_fd(const NVQRSnapshot *snapshot);
+NVQR_HIDDEN bool nvqr_publish_snapshot(NVQRSnapshot *snapshot,
+                                       const NVQRQueryData_t *data, int cnt,
+                                       long long timestampUs);
+
+//------------------------------------------------------------------------------
+// The sample history for NVQR_QUERY_HISTORY. nvqr_init_history() sets it up
+// from the environment and returns the sampling interval in milliseconds, or
+// 0 if no history is kept, which nvqr_disable_history() also makes the case
+// for good. Samples are only added by the GL worker thread, with
+// nvqr_record_history() from a VIDMEM_ALLOC_NV result of cnt words. The
+// server loop reads the samples numbered since onwards, at most max of them:
+// nvqr_history_available() returns how many there are, and
+// nvqr_read_history() copies them to out in their wire format, sets *first
+// to the number of the first one copied, and returns how many it copied.
+
+NVQR_HIDDEN int nvqr_init_history(void);
+NVQR_HIDDEN int nvqr_history_interval_ms(void);
+NVQR_HIDDEN void nvqr_disable_history(void);
+NVQR_HIDDEN void nvqr_record_history(const NVQRQueryData_t *data, int cnt,
+                                     long long timestampUs);
+NVQR_HIDDEN int nvqr_history_available(unsigned long long since);
+NVQR_HIDDEN int nvqr_read_history(unsigned long long since, int max,
+                                  unsigned long long *first,
+                                  NVQRQueryData_t *out);
+
+//------------------------------------------------------------------------------
+// Peak usage for NVQR_QUERY_PEAKS. nvqr_update_peaks() is only called by the
+// GL worker thread, with each VIDMEM_ALLOC_NV result of cnt words and the time
+// it was taken. nvqr_write_peaks() writes at most max of the
+// nvqr_num_peaks() peaks to data in their wire format, and returns how many
+// it wrote. nvqr_dump_peaks() prints them to stream, if there are any.
+
+NVQR_HIDDEN void nvqr_update_peaks(const NVQRQueryData_t *data, int cnt,
+                                   long long timestampUs);
+NVQR_HIDDEN int nvqr_num_peaks(void);
+NVQR_HIDDEN int nvqr_write_peaks(NVQRQueryData_t *data, int max);
+NVQR_HIDDEN void nvqr_dump_peaks(FILE *stream, long pid);
+
+//------------------------------------------------------------------------------
+// Server statistics, which may be updated from any thread without locking:
+// add n to a counter, record a duration in microseconds in a histogram, and
+// write a snapshot of all statistics as the NVQR_STATS_LEN words of an
+// NVQR_QUERY_STATS response.
+
+NVQR_HIDDEN void nvqr_count_stat(NVQRStatCounter counter, unsigned long n);
+NVQR_HIDDEN void nvqr_record_time(NVQRStatHistogram histogram, long long us);
+NVQR_HIDDEN void nvqr_write_stats(NVQRQueryData_t *data);
+
+//------------------------------------------------------------------------------
+// Return the mean of the durations recorded in a histogram so far, in
+// microseconds.
+
+NVQR_HIDDEN long long nvqr_mean_time(NVQRStatHistogram histogram);
+
+//------------------------------------------------------------------------------
+// Admission control for the server loop. A token bucket of a connection must
+// be zero initialized, and each connection is accounted to the user that
+// opened it, which nvqr_add_user_client() looks up by the user ID from
+// nvqr_get_peer_uid() (-1 if unknown), setting *admitted to whether the user
+// may have another connection. It returns NULL if out of memory, in which
+// case only the connection's own limits apply. nvqr_take_tokens() and
+// nvqr_check_pending_queries() return 0 if a command that queries cost
+// query types, added of which need a new backend query while pending are
+// queued, may go ahead, or else the number of microseconds after which it
+// should be retried.
+
+typedef struct {
+    double tokens;
+    long long updated;
+} NVQRTokenBucket;
+
+typedef struct NVQRUserLimitRec NVQRUserLimit;
+
+NVQR_HIDDEN void nvqr_init_limits(void);
+NVQR_HIDDEN long nvqr_get_peer_uid(int fd);
+NVQR_HIDDEN NVQRUserLimit *nvqr_add_user_client(long uid, bool *admitted);
+NVQR_HIDDEN void nvqr_remove_user_client(NVQRUserLimit *user);
+NVQR_HIDDEN long long nvqr_take_tokens(NVQRTokenBucket *bucket,
+                                       NVQRUserLimit *user, int cost);
+NVQR_HIDDEN long long nvqr_check_pending_queries(int pending, int added);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Shared snapshots of query results, written by the server loop and read by
+// clients that have mapped them. On Linux, each snapshot lives in a memfd;
+// elsewhere, in a POSIX shared memory object that is unlinked as soon as it
+// has been opened. Clients are only given a read-only descriptor, so they
+// cannot write to the region or resize it.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for memfd_create()
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-preload.h"
+
+struct NVQRSnapshotRec {
+    int fd, read_fd;
+    NVQRSnapshotHeader *header;
+    size_t size;
+};
+
+
+//------------------------------------------------------------------------------
+// Create an anonymous shared memory object, and a read-only descriptor of it
+// for the clients. Returns false on failure.
+static bool create_region(int *fd, int *read_fd)
+{
+    static unsigned int serial;
+    char name[64];
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    *fd = memfd_create("nvidia-query-resource-opengl-snapshot", MFD_CLOEXEC);
+    if (*fd >= 0) {
+        // Reopening a memfd through /proc gives a descriptor of its own
+        snprintf(name, sizeof(name), "/proc/self/fd/%d", *fd);
+        *read_fd = open(name, O_RDONLY | O_CLOEXEC);
+        if (*read_fd >= 0) {
+            return true;
+        }
+        close(*fd);
+    }
+#endif
+
+    snprintf(name, sizeof(name), "/nvidia-query-resource-opengl-%ld-%u",
+             (long) getpid(), serial++);
+    *fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (*fd < 0) {
+        return false;
+    }
+    *read_fd = shm_open(name, O_RDONLY, 0);
+    shm_unlink(name);
+
+    if (*read_fd < 0) {
+        close(*fd);
+        return false;
+    }
+
+    fcntl(*fd, F_SETFD, FD_CLOEXEC);
+    fcntl(*read_fd, F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Grow the region of a snapshot to hold a result of cnt words. The new size
+// is set before the region is mapped again, so readers never see a file
+// smaller than what the header says it holds.
+static bool grow_region(NVQRSnapshot *snapshot, int cnt)
+{
+    size_t size = snapshot->size ? snapshot->size : sizeof(NVQRSnapshotHeader);
+    void *header;
+
+    while (size < sizeof(NVQRSnapshotHeader) + cnt * sizeof(NVQRQueryData_t)) {
+        size *= 2;
+    }
+
+    if (ftruncate(snapshot->fd, size) < 0) {
+        return false;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  snapshot->fd, 0);
+    if (header == MAP_FAILED) {
+        return false;
+    }
+
+    if (snapshot->header) {
+        munmap(snapshot->header, snapshot->size);
+    }
+    snapshot->header = header;
+    snapshot->size = size;
+    return true;
+}
+
+
+NVQRSnapshot *nvqr_create_snapshot(unsigned int queryType)
+{
+    NVQRSnapshot *snapshot = calloc(1, sizeof(*snapshot));
+
+    if (!snapshot) {
+        return NULL;
+    }
+
+    if (!create_region(&snapshot->fd, &snapshot->read_fd)) {
+        free(snapshot);
+        return NULL;
+    }
+
+    if (!grow_region(snapshot, NVQR_MAX_DATA_BUFFER_LEN)) {
+        close(snapshot->fd);
+        close(snapshot->read_fd);
+        free(snapshot);
+        return NULL;
+    }
+
+    // A new object is zero filled, so the sequence starts at 0
+    snapshot->header->queryType = queryType;
+    __atomic_store_n(&snapshot->header->magic, NVQR_SNAPSHOT_MAGIC,
+                     __ATOMIC_RELEASE);
+
+    return snapshot;
+}
+
+
+int nvqr_snapshot_fd(const NVQRSnapshot *snapshot)
+{
+    return snapshot->read_fd;
+}
+
+
+bool nvqr_publish_snapshot(NVQRSnapshot *snapshot,
+                           const NVQRQueryData_t *data, int cnt,
+                           long long timestampUs)
+{
+    NVQRSnapshotHeader *header;
+    unsigned int sequence;
+
+    if (cnt < 0 || cnt > NVQR_MAX_RESPONSE_LEN) {
+        return false;
+    }
+
+    if (sizeof(*header) + cnt * sizeof(*data) > snapshot->size &&
+        !grow_region(snapshot, cnt)) {
+        return false;
+    }
+
+    header = snapshot->header;
+    sequence = header->sequence;
+
+    // Odd while writing; the fence keeps the writes of the result from being
+    // seen before the odd sequence
+    __atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(header + 1, data, cnt * sizeof(*data));
+    header->cnt = cnt;
+    header->timestampUs = timestampUs;
+
+    __atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    nvqr_count_stat(NVQR_STAT_SNAPSHOTS, 1);
+    return true;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-preload.h"
+
+// The statistics are kept in native words, which can be updated atomically
+// without locks everywhere, and are only widened to 64 bits on the wire. A
+// snapshot is not taken atomically as a whole, so a histogram's count and sum
+// may be off by a sample or so from each other while it is being updated.
+
+typedef struct {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[NVQR_HIST_BUCKETS];
+} NVQRServerHistogram;
+
+static struct {
+    unsigned long counters[NVQR_NUM_STATS];
+    NVQRServerHistogram histograms[NVQR_NUM_HISTOGRAMS];
+} stats;
+
+
+void nvqr_count_stat(NVQRStatCounter counter, unsigned long n)
+{
+    __atomic_fetch_add(&stats.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+
+void nvqr_record_time(NVQRStatHistogram histogram, long long us)
+{
+    NVQRServerHistogram *h = &stats.histograms[histogram];
+    unsigned long max;
+
+    if (us < 0) {
+        us = 0;
+    }
+
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, (unsigned long) us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[nvqr_ipc_histogram_bucket(us)], 1,
+                       __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while ((unsigned long) us > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, (unsigned long) us,
+                                        true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+}
+
+
+long long nvqr_mean_time(NVQRStatHistogram histogram)
+{
+    NVQRServerHistogram *h = &stats.histograms[histogram];
+    unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+    return count ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count : 0;
+}
+
+
+static NVQRQueryData_t *put_value(NVQRQueryData_t *data, unsigned long *value)
+{
+    unsigned long long v = __atomic_load_n(value, __ATOMIC_RELAXED);
+
+    data[0] = (NVQRQueryData_t) (v & 0xffffffff);
+    data[1] = (NVQRQueryData_t) (v >> 32);
+    return data + 2;
+}
+
+
+void nvqr_write_stats(NVQRQueryData_t *data)
+{
+    int i, j;
+
+    *data++ = NVQR_STATS_VERSION;
+    *data++ = NVQR_NUM_STATS;
+    *data++ = NVQR_NUM_HISTOGRAMS;
+    *data++ = NVQR_HIST_BUCKETS;
+
+    for (i = 0; i < NVQR_NUM_STATS; i++) {
+        data = put_value(data, &stats.counters[i]);
+    }
+
+    for (i = 0; i < NVQR_NUM_HISTOGRAMS; i++) {
+        NVQRServerHistogram *h = &stats.histograms[i];
+
+        data = put_value(data, &h->count);
+        data = put_value(data, &h->sum);
+        data = put_value(data, &h->max);
+        for (j = 0; j < NVQR_HIST_BUCKETS; j++) {
+            data = put_value(data, &h->buckets[j]);
+        }
+    }
+}
@@ -24,47 +24,341 @@
 #include <sys/types.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
 #if defined (_WIN32)
 #include <Windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <time.h>
+#include <errno.h>
 #endif
 #include <GL/gl.h>
 
 #include "nvidia-query-resource-opengl.h"
 #include "nvidia-query-resource-opengl-data.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+
+typedef struct {
+    pid_t *pids;
+    int count, capacity;
+} PidList;
+
+typedef struct {
+    int intervalMs;
+    int count;
+    int thresholdKiB;   // with threshold set, subscribe to changes instead
+    int thresholdPct;
+    int watch;
+} SampleOptions;
+
+// Per-device totals, for reporting changes between samples
+typedef struct {
+    int totalAllocs;
+    int vidMemUsedkiB;
+    int vidMemFreekiB;
+} DeviceSummary;
+
+#define MAX_SUMMARY_DEVICES 16
+
+// What to print from the preload DSO instead of the resource usage
+typedef enum {
+    REPORT_NONE = 0,
+    REPORT_STATS,
+    REPORT_HISTORY,
+    REPORT_PEAKS
+} ReportType;
+
+// Names of the server statistics, in NVQRStatCounter and NVQRStatHistogram
+// order
+static const char *const stat_names[NVQR_NUM_STATS] = {
+    "connections", "commands", "queries", "cache_hits", "coalesced",
+    "backend_queries", "errors", "bytes_sent", "throttled", "samples",
+    "updates", "snapshots", "history_samples"
+};
+
+static const char *const histogram_names[NVQR_NUM_HISTOGRAMS] = {
+    "queue_wait", "context", "backend_query", "completion", "send", "total"
+};
+
+// How query results are written out: a format of 0 selects the human-readable
+// text from nvqr_print_memory_info(), anything else an nvqrFormat_t.
+typedef struct {
+    int format;
+    NVQROutputBuffer buffer;
+} OutputOptions;
+
 
 static void print_help(const char *progname)
 {
     printf("Query OpenGL resource (vidmem and GPU-mapped sysmem) usage\n\n"
-           "Usage: %s -p pid\n"
+           "Usage: %s -p pid[,pid...] [-p ...] [-f file] [-t timeout] "
+           "[-o format]\n"
+           "       %s --all [-t timeout] [-o format]\n"
+           "       %s -p pid [-i interval] [-n count] [-o format]\n"
+           "       %s -p pid -w threshold [-i interval] [-n count] "
+           "[-o format]\n"
+           "       %s --stats -p pid[,pid...] [-o format]\n"
+           "       %s --history -p pid[,pid...] [-o format]\n"
+           "       %s --peaks -p pid[,pid...] [-o format]\n"
            "       %s -h\n\n"
            "  -h: print this help message\n"
-           "  -p <pid>: select process to query\n",
+           "  -p <pid>[,<pid>...]: select process(es) to query\n"
+           "  --all: query every process that is ready to be queried\n"
+           "  -f <file>: read the pids of processes to query from a file,\n"
+           "             or from standard input if the file is '-'\n"
+           "  -t <ms>: when querying multiple processes, give up on any\n"
+           "           process that has not responded after ms milliseconds\n"
+           "  -i <ms>: query a single process repeatedly, every ms\n"
+           "           milliseconds, over the same connection\n"
+           "  -n <count>: stop after count queries (default: unlimited with\n"
+           "              -i; with -n alone, the interval is 1000 ms)\n"
+           "  -w <kiB>|<pct>%%: instead of querying a single process\n"
+           "                   repeatedly, have it print a sample whenever\n"
+           "                   the usage of a device, detail or tag changes\n"
+           "                   by at least kiB kiB or pct percent, checking\n"
+           "                   at most every -i milliseconds (Unix only)\n"
+           "  -o <format>: output format: text (the default), json (one\n"
+           "               JSON object per line), csv, or binary\n"
+           "  --stats: print the statistics kept by the preload DSO in each\n"
+           "           process (counters and per-stage latencies) instead of\n"
+           "           querying its resource usage; text or json only\n"
+           "  --history: print the samples of device usage kept by the\n"
+           "             preload DSO in each process started with\n"
+           "             NVQR_HISTORY_INTERVAL_MS set; text or json only\n"
+           "  --peaks: print the peak vidmem usage of each device, object\n"
+           "           type and tag seen by the preload DSO in each process;\n"
+           "           text or json only\n",
+           progname, progname, progname, progname, progname, progname,
            progname, progname);
 }
 
 
+static int add_pid(PidList *list, long pid)
+{
+    // PID 0 on Unix is the scheduler, and on Windows is the System Idle
+    // process, neither of which is a valid target for queryResources.
+    if (pid <= 0) {
+        return 0;
+    }
+
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? 2 * list->capacity : 16;
+        pid_t *pids = realloc(list->pids, capacity * sizeof(*pids));
+
+        if (!pids) {
+            return 0;
+        }
+        list->pids = pids;
+        list->capacity = capacity;
+    }
+
+    list->pids[list->count++] = (pid_t) pid;
+    return 1;
+}
+
+
+//------------------------------------------------------------------------------
+// Add the pids in a string of pids separated by commas and/or whitespace.
+static int add_pids_from_string(PidList *list, const char *str)
+{
+    while (*str) {
+        char *end;
+        long pid;
+
+        if (*str == ',' || isspace((unsigned char) *str)) {
+            str++;
+            continue;
+        }
+
+        pid = strtol(str, &end, 10);
+        if (end == str || (*end && *end != ',' &&
+                           !isspace((unsigned char) *end)) ||
+            !add_pid(list, pid)) {
+            return 0;
+        }
+        str = end;
+    }
+
+    return 1;
+}
+
+
+//------------------------------------------------------------------------------
+// Add the pids listed in a file, or on standard input if the name is "-".
+static int add_pids_from_file(PidList *list, const char *name)
+{
+    FILE *file = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+    char line[256];
+    size_t len = 0, end, keep;
+    int ret = file != NULL;
+
+    // Lines are read in chunks, so a pid at the end of a chunk may continue
+    // in the next one; carry it over rather than parse it in two halves.
+    while (ret && len < sizeof(line) - 1 &&
+           fgets(line + len, (int) (sizeof(line) - len), file)) {
+        char c;
+
+        end = len + strlen(line + len);
+        for (keep = end; keep > 0 && isdigit((unsigned char) line[keep - 1]);
+             keep--);
+
+        c = line[keep];
+        line[keep] = '\0';
+        ret = add_pids_from_string(list, line);
+        line[keep] = c;
+
+        len = end - keep;
+        memmove(line, line + keep, len + 1);
+    }
+
+    // A pid at the very end of the input, or one too long to be valid
+    if (ret && len) {
+        ret = len < sizeof(line) - 1 && add_pids_from_string(list, line);
+    }
+
+    if (file && file != stdin) {
+        fclose(file);
+    }
+
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+// Add the pids of all processes that are ready to be queried.
+static int add_all_pids(PidList *list)
+{
+    pid_t *found;
+    int count, ret = 1, i;
+
+    if (nvqr_find_processes(&found, &count) != NVQR_SUCCESS) {
+        fprintf(stderr, "Error: failed to list the processes that can be "
+                "queried.\n");
+        return 0;
+    }
+
+    for (i = 0; ret && i < count; i++) {
+        ret = add_pid(list, found[i]);
+    }
+
+    free(found);
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+// Parse an option value that must be a whole decimal number from min to
+// INT_MAX. Returns 0 if it is not.
+static int parse_int(const char *str, int min, int *value)
+{
+    char *end;
+    long v = strtol(str, &end, 10);
+
+    if (end == str || *end || v < min || v > INT_MAX) {
+        return 0;
+    }
+
+    *value = (int) v;
+    return 1;
+}
+
+
 //------------------------------------------------------------------------------
 // Parse the command line and pass the values of any parsed options.
 static nvqrReturn_t parse_commandline(int argc, char * const * const argv,
-                                      pid_t *pid, GLenum *queryType)
+                                      PidList *pids, GLenum *queryType,
+                                      int *timeoutMs, SampleOptions *sampling,
+                                      OutputOptions *output,
+                                      ReportType *report)
 {
-    int i;
+    int all = 0, i;
 
     // default values
     *queryType = GL_QUERY_RESOURCE_TYPE_VIDMEM_ALLOC_NV;
+    *timeoutMs = -1;
+    *report = REPORT_NONE;
+    sampling->intervalMs = 0;
+    sampling->count = 0;
+    sampling->thresholdKiB = 0;
+    sampling->thresholdPct = 0;
+    sampling->watch = 0;
+    output->format = 0;
 
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0) {
             // help
             print_help(argv[0]);
+            pids->count = 0;
             return NVQR_SUCCESS;
-        } else if (strcmp(argv[i], "-p") == 0) {
-            // specific pid
-            i++;
+        } else if (strcmp(argv[i], "--all") == 0) {
+            // every process that can be queried
+            if (!add_all_pids(pids)) {
+                return NVQR_ERROR_UNKNOWN;
+            }
+            all = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 ||
+                   strcmp(argv[i], "--history") == 0 ||
+                   strcmp(argv[i], "--peaks") == 0) {
+            // server statistics, sample history or peak usage instead of
+            // resource usage
+            if (*report) {
+                print_help(argv[0]);
+                return NVQR_ERROR_INVALID_ARGUMENT;
+            }
+            *report = argv[i][2] == 's' ? REPORT_STATS :
+                      argv[i][2] == 'h' ? REPORT_HISTORY : REPORT_PEAKS;
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-f") == 0 ||
+                   strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-i") == 0 ||
+                   strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "-o") == 0 ||
+                   strcmp(argv[i], "-w") == 0) {
+            const char *opt = argv[i++];
+            int valid = i < argc;
 
-            if (i < argc) {
-                *pid = atoi(argv[i]);
-            } else {
+            if (valid && opt[1] == 'p') {
+                // specific pid(s)
+                valid = add_pids_from_string(pids, argv[i]);
+            } else if (valid && opt[1] == 'f') {
+                // pids from a file
+                valid = add_pids_from_file(pids, argv[i]);
+            } else if (valid && opt[1] == 't') {
+                // timeout
+                valid = parse_int(argv[i], 0, timeoutMs);
+            } else if (valid && opt[1] == 'i') {
+                // sampling interval
+                valid = parse_int(argv[i], 1, &sampling->intervalMs);
+            } else if (valid && opt[1] == 'w') {
+                // change threshold, in kiB or percent
+                char *end;
+                long threshold = strtol(argv[i], &end, 10);
+
+                if (*end == '%') {
+                    sampling->thresholdPct = (int) threshold;
+                    end++;
+                } else {
+                    sampling->thresholdKiB = (int) threshold;
+                }
+                sampling->watch = 1;
+                valid = end != argv[i] && !*end && threshold >= 0 &&
+                        threshold <= INT_MAX;
+            } else if (valid && opt[1] == 'o') {
+                // output format
+                if (strcmp(argv[i], "json") == 0) {
+                    output->format = NVQR_FORMAT_JSON;
+                } else if (strcmp(argv[i], "csv") == 0) {
+                    output->format = NVQR_FORMAT_CSV;
+                } else if (strcmp(argv[i], "binary") == 0) {
+                    output->format = NVQR_FORMAT_BINARY;
+                } else {
+                    valid = strcmp(argv[i], "text") == 0;
+                }
+            } else if (valid) {
+                // sample count
+                valid = parse_int(argv[i], 1, &sampling->count);
+            }
+
+            if (!valid) {
                 print_help(argv[0]);
                 return NVQR_ERROR_INVALID_ARGUMENT;
             }
@@ -75,40 +369,389 @@ static nvqrReturn_t parse_commandline(int argc, char * const * const argv,
     }
 
     // validation
-    if (*pid == 0) {
-        // PID 0 on Unix is the scheduler, and on Windows is the System Idle
-        // process, neither of which is a valid target for queryResources.
-        // If the PID is zero, we may assume that the user did not set one,
-        // and if the user actually did set a PID of zero, we can treat that
-        // as an invalid request.
+    if (pids->count == 0 && all) {
+        fprintf(stderr, "No processes are ready to be queried.\n");
+        return NVQR_SUCCESS;
+    }
+
+    if (pids->count == 0) {
+        // If no PID was given, the user did not select a process to query.
         print_help(argv[0]);
         return NVQR_ERROR_INVALID_ARGUMENT;
     }
 
+    if ((sampling->count || sampling->watch) && !sampling->intervalMs) {
+        sampling->intervalMs = sampling->watch ?
+                               NVQR_MIN_SUBSCRIBE_INTERVAL_MS : 1000;
+    }
+
+    if (sampling->intervalMs && pids->count != 1) {
+        fprintf(stderr, "Repeated queries are only supported for a single "
+                "process.\n");
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (*report && (sampling->intervalMs ||
+                    output->format == NVQR_FORMAT_CSV ||
+                    output->format == NVQR_FORMAT_BINARY)) {
+        fprintf(stderr, "Statistics, history and peaks can only be printed "
+                "once, as text or JSON.\n");
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
     return NVQR_SUCCESS;
 }
 
 
-int main (int argc, char * const * const argv)
+//------------------------------------------------------------------------------
+// The wall clock time, in microseconds since the Unix epoch, for timestamping
+// machine-readable output.
+static long long get_wall_clock_us(void)
 {
-    NVQRConnection connection;
-    NVQRQueryDataBuffer buffer;
-    pid_t pid = 0;
+#if defined (_WIN32)
+    FILETIME ft;
+    ULARGE_INTEGER t;
+
+    // FILETIME counts 100 ns intervals since 1601-01-01
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    return (long long) ((t.QuadPart - 116444736000000000ULL) / 10);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+// Write out a query result as a record in a machine-readable format.
+static nvqrReturn_t write_record(OutputOptions *output, pid_t pid,
+                                 const char *process_name,
+                                 const NVQRQueryData_t *data, int cnt)
+{
+    nvqrReturn_t ret;
+
+    ret = nvqr_format_memory_info(&output->buffer, output->format, pid,
+                                  process_name, get_wall_clock_us(),
+                                  data, cnt);
+    if (ret != NVQR_SUCCESS) {
+        fprintf(stderr, "Error: failed to format the query result for pid "
+                "%ld.\n", (long) pid);
+        return ret;
+    }
+
+    fwrite(output->buffer.data, 1, output->buffer.len, stdout);
+    output->buffer.len = 0;
+    return NVQR_SUCCESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Check the data format version of a query result and print it out.
+static nvqrReturn_t print_result(pid_t pid, const char *process_name,
+                                 GLenum queryType, OutputOptions *output,
+                                 NVQRQueryData_t *data, int cnt)
+{
+    NVQRParsedData parsed;
+    nvqrReturn_t ret;
+
+    if (output->format) {
+        return write_record(output, pid, process_name, data, cnt);
+    }
+
+    // Validate the result before printing it; no records are needed for that
+    memset(&parsed, 0, sizeof(parsed));
+    ret = nvqr_parse_memory_info(data, cnt, &parsed);
+
+    if (ret == NVQR_ERROR_NOT_SUPPORTED) {
+        fprintf(stderr, "Error: unrecognized data format version '%d'. "
+                "(version supported: %d)\n",
+                parsed.version, NVQR_DATA_FORMAT_VERSION);
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+    if (ret != NVQR_SUCCESS && ret != NVQR_ERROR_INSUFFICIENT_BUFFER) {
+        fprintf(stderr, "Error: malformed query result for pid %ld.\n",
+                (long) pid);
+        return ret;
+    }
+
+    if (process_name) {
+        printf("%s, pid = %ld, data format version %d\n",
+               process_name, (long) pid, parsed.version);
+    }
+
+    nvqr_print_memory_info(queryType, data);
+    return NVQR_SUCCESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Explain why the query of a process failed. The data of a throttled query
+// is the time in microseconds after which to retry it.
+static void print_query_error(pid_t pid, nvqrReturn_t result,
+                              const NVQRQueryData_t *data)
+{
+    if (result == NVQR_ERROR_TIMEOUT) {
+        fprintf(stderr, "Error: timed out querying pid %ld\n", (long) pid);
+    } else if (result == NVQR_ERROR_THROTTLED && data) {
+        fprintf(stderr, "Error: pid %ld is throttling queries; retry in "
+                "%d ms\n", (long) pid, (data[0] + 999) / 1000);
+    } else {
+        fprintf(stderr, "Error: failed to query resource usage information "
+                "for pid %ld.\n", (long) pid);
+    }
+}
+
+
+typedef struct {
     GLenum queryType;
+    OutputOptions *output;
     nvqrReturn_t result;
+} QueryContext;
 
-    result = parse_commandline(argc, argv, &pid, &queryType);
-    if (result != NVQR_SUCCESS) {
-        fprintf(stderr, "%s: invalid command line\n", argv[0]);
-        return result;
+
+//------------------------------------------------------------------------------
+// Print the result of each query of a multiple process query as it arrives,
+// and remember the first failure for the exit status.
+static void query_callback(pid_t pid, const char *process_name,
+                           nvqrReturn_t result, const NVQRQueryData_t *data,
+                           int cnt, void *user_data)
+{
+    QueryContext *context = user_data;
+
+    if (result == NVQR_SUCCESS) {
+        result = print_result(pid, process_name, context->queryType,
+                              context->output, (NVQRQueryData_t *) data, cnt);
+    } else if (result == NVQR_ERROR_NOT_SUPPORTED && process_name) {
+        fprintf(context->output->format ? stderr : stdout,
+                "Resource query not supported for '%s' (pid %ld)\n",
+                process_name, (long) pid);
+    } else {
+        print_query_error(pid, result, data);
+    }
+
+    if (context->result == NVQR_SUCCESS) {
+        context->result = result;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Time keeping for repeated queries: a monotonic clock for scheduling, and the
+// wall clock for timestamping the samples.
+static double get_monotonic_ms(void)
+{
+#if defined (_WIN32)
+    LARGE_INTEGER count, frequency;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return count.QuadPart * 1000.0 / frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+
+static void sleep_until_ms(double deadline)
+{
+    double now = get_monotonic_ms();
+
+    if (deadline <= now) {
+        return;
+    }
+#if defined (_WIN32)
+    Sleep((DWORD) (deadline - now + 0.5));
+#else
+    {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t) (deadline / 1000);
+        ts.tv_nsec = (long) ((deadline - ts.tv_sec * 1000.0) * 1e6);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR);
+    }
+#endif
+}
+
+
+static void print_timestamp(void)
+{
+#if defined (_WIN32)
+    SYSTEMTIME t;
+
+    GetLocalTime(&t);
+    printf("%04d-%02d-%02d %02d:%02d:%02d.%03d", t.wYear, t.wMonth, t.wDay,
+           t.wHour, t.wMinute, t.wSecond, t.wMilliseconds);
+#else
+    struct timespec ts;
+    struct tm t;
+    char buf[32];
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &t);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &t);
+    printf("%s.%03ld", buf, ts.tv_nsec / 1000000);
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+// Extract the per-device totals from a query result. Returns the number of
+// devices summarized.
+static int summarize_devices(const NVQRQueryData_t *data, int cnt,
+                             DeviceSummary *summary)
+{
+    NVQRDeviceRecord devices[MAX_SUMMARY_DEVICES];
+    NVQRParsedData parsed;
+    nvqrReturn_t ret;
+    int i;
+
+    memset(&parsed, 0, sizeof(parsed));
+    parsed.devices = devices;
+    parsed.maxDevices = MAX_SUMMARY_DEVICES;
+
+    // Only the device totals are needed, so details and tags are just counted
+    ret = nvqr_parse_memory_info(data, cnt, &parsed);
+    if (ret != NVQR_SUCCESS && ret != NVQR_ERROR_INSUFFICIENT_BUFFER) {
+        return 0;
+    }
+
+    for (i = 0; i < parsed.numDevices && i < MAX_SUMMARY_DEVICES; i++) {
+        summary[i].totalAllocs = devices[i].totalAllocs;
+        summary[i].vidMemUsedkiB = devices[i].vidMemUsedkiB;
+        summary[i].vidMemFreekiB = devices[i].vidMemFreekiB;
+    }
+
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Query a single process every sampling->intervalMs milliseconds over one
+// connection. Samples are scheduled against the start time rather than the
+// end of the previous sample, so that the time taken by each query does not
+// accumulate; if a query overruns one or more intervals, the missed samples
+// are skipped. Each sample is printed with its timestamp, followed by the
+// per-device changes since the previous sample; in the machine-readable
+// formats, each sample is just written out as a timestamped record. When
+// watching for changes, the process pushes a sample whenever one crosses the
+// threshold instead, and the first sample is the current usage.
+static nvqrReturn_t sample_process(NVQRConnection *connection,
+                                   GLenum queryType,
+                                   const SampleOptions *sampling,
+                                   OutputOptions *output)
+{
+    DeviceSummary prev[MAX_SUMMARY_DEVICES], cur[MAX_SUMMARY_DEVICES];
+    int num_prev = 0, num_cur, sample, i;
+    double start = get_monotonic_ms(), last = start, deadline = start;
+    nvqrReturn_t result = NVQR_SUCCESS;
+    NVQRSubscribeParams params;
+
+    memset(&params, 0, sizeof(params));
+    params.intervalMs = sampling->intervalMs;
+    params.thresholdKiB = sampling->thresholdKiB;
+    params.thresholdPct = sampling->thresholdPct;
+
+    for (sample = 1; !sampling->count || sample <= sampling->count; sample++) {
+        NVQRQueryData_t *data;
+        int cnt;
+        double now;
+
+        if (sampling->watch && sample == 1) {
+            result = nvqr_subscribe(connection, queryType, &params,
+                                    &data, &cnt);
+        } else if (sampling->watch) {
+            result = nvqr_wait_update(connection, -1, &data, &cnt);
+        } else {
+            sleep_until_ms(deadline);
+            now = get_monotonic_ms();
+            result = nvqr_request_meminfo_alloc(*connection, queryType,
+                                                &data, &cnt);
+        }
+        if (result != NVQR_SUCCESS) {
+            print_query_error(connection->pid, result, data);
+            free(data);
+            break;
+        }
+        if (sampling->watch) {
+            now = get_monotonic_ms();
+        }
+
+        if (!output->format) {
+            printf("sample %d at ", sample);
+            print_timestamp();
+            printf(" (+%.1f ms)\n", now - last);
+        }
+        last = now;
+
+        result = print_result(connection->pid, connection->process_name,
+                              queryType, output, data, cnt);
+        if (result != NVQR_SUCCESS) {
+            free(data);
+            break;
+        }
+
+        num_cur = summarize_devices(data, cnt, cur);
+        free(data);
+
+        if (sample > 1 && !output->format) {
+            printf("\n  changes since previous sample:\n");
+            for (i = 0; i < num_cur; i++) {
+                DeviceSummary zero = { 0, 0, 0 };
+                const DeviceSummary *p = i < num_prev ? &prev[i] : &zero;
+
+                printf("    Device %d: in use %+d kiB, free %+d kiB, "
+                       "allocations %+d\n", i,
+                       cur[i].vidMemUsedkiB - p->vidMemUsedkiB,
+                       cur[i].vidMemFreekiB - p->vidMemFreekiB,
+                       cur[i].totalAllocs - p->totalAllocs);
+            }
+        }
+        if (!output->format) {
+            printf("\n");
+        }
+        fflush(stdout);
+
+        memcpy(prev, cur, num_cur * sizeof(cur[0]));
+        num_prev = num_cur;
+
+        // Schedule the next sample on the original grid of intervals
+        deadline += sampling->intervalMs;
+        now = get_monotonic_ms();
+        if (deadline < now) {
+            deadline += ((int) ((now - deadline) / sampling->intervalMs) + 1) *
+                        (double) sampling->intervalMs;
+        }
     }
 
+    return result;
+}
+
+
+static nvqrReturn_t query_single_process(pid_t pid, GLenum queryType,
+                                         const SampleOptions *sampling,
+                                         OutputOptions *output)
+{
+    NVQRConnection connection;
+    NVQRQueryData_t *data;
+    int cnt;
+    nvqrReturn_t result;
+
     result = nvqr_connect(&connection, pid);
     if (result != NVQR_SUCCESS) {
         if (result == NVQR_ERROR_NOT_SUPPORTED &&
             connection.process_name) {
-            printf("Resource query not supported for '%s' (pid %ld)\n",
-                   connection.process_name, (long) connection.pid);
+            // Keep machine-readable output free of messages
+            fprintf(output->format ? stderr : stdout,
+                    "Resource query not supported for '%s' (pid %ld)\n",
+                    connection.process_name, (long) connection.pid);
         } else {
             fprintf(stderr, "Error: failed to open connection to pid %ld\n",
                     (long) connection.pid);
@@ -116,28 +759,321 @@ int main (int argc, char * const * const argv)
         return result;
     }
 
-    result = nvqr_request_meminfo(connection, queryType, &buffer);
+    if (sampling->intervalMs) {
+        result = sample_process(&connection, queryType, sampling, output);
+        if (result != NVQR_SUCCESS) {
+            nvqr_disconnect(&connection);
+            return result;
+        }
+        result = nvqr_disconnect(&connection);
+        return result;
+    }
+
+    result = nvqr_request_meminfo_alloc(connection, queryType, &data, &cnt);
     if (result == NVQR_SUCCESS) {
-        NVQRQueryDataHeader *header = (NVQRQueryDataHeader *)&buffer.data;
-        if (header->version != NVQR_DATA_FORMAT_VERSION) {
-            fprintf(stderr, "Error: unrecognized data format version '%d'. "
-                    "(version supported: %d)\n", header->version,
-                    NVQR_DATA_FORMAT_VERSION);
+        if (print_result(connection.pid, connection.process_name, queryType,
+                         output, data, cnt) != NVQR_SUCCESS) {
+            free(data);
             result = nvqr_disconnect(&connection);
             return result;
         }
+        free(data);
+    } else {
+        print_query_error(connection.pid, result, data);
+        free(data);
+    }
 
-        if (connection.process_name) {
-            printf("%s, pid = %ld, data format version %d\n",
-                   connection.process_name, (long) connection.pid, header->version);
+    result = nvqr_disconnect(&connection);
+    return result;
+}
+
+
+//------------------------------------------------------------------------------
+// Fetch the statistics kept by the preload DSO in a process, and print the
+// counters and a summary of each latency histogram.
+static nvqrReturn_t print_stats(pid_t pid, const OutputOptions *output)
+{
+    NVQRServerStats stats;
+    NVQRProcessInfo info;
+    nvqrReturn_t result;
+    int i;
+
+    result = nvqr_query_stats(pid, &stats);
+    if (result != NVQR_SUCCESS) {
+        fprintf(stderr, "Error: failed to fetch the statistics of pid %ld.\n",
+                (long) pid);
+        return result;
+    }
+
+    if (output->format == NVQR_FORMAT_JSON) {
+        printf("{\"pid\":%ld,\"counters\":{", (long) pid);
+        for (i = 0; i < NVQR_NUM_STATS; i++) {
+            printf("%s\"%s\":%llu", i ? "," : "", stat_names[i],
+                   stats.counters[i]);
+        }
+        printf("},\"histograms\":{");
+    } else {
+        nvqr_get_process_info(pid, &info);
+        printf("%s, pid = %ld, server statistics\n",
+               info.name[0] ? info.name : "unknown", (long) pid);
+        for (i = 0; i < NVQR_NUM_STATS; i++) {
+            printf("  %-16s %llu\n", stat_names[i], stats.counters[i]);
+        }
+        printf("\n  %-16s %10s %10s %10s %10s %10s %10s\n", "stage", "count",
+               "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    }
+
+    for (i = 0; i < NVQR_NUM_HISTOGRAMS; i++) {
+        const NVQRHistogram *h = &stats.histograms[i];
+        double mean = h->count ? (double) h->sumUs / h->count : 0;
+
+        if (output->format == NVQR_FORMAT_JSON) {
+            printf("%s\"%s\":{\"count\":%llu,\"mean_us\":%.1f,"
+                   "\"p50_us\":%.0f,\"p90_us\":%.0f,\"p99_us\":%.0f,"
+                   "\"max_us\":%llu}", i ? "," : "", histogram_names[i],
+                   h->count, mean, nvqr_histogram_percentile(h, 50),
+                   nvqr_histogram_percentile(h, 90),
+                   nvqr_histogram_percentile(h, 99), h->maxUs);
+        } else {
+            printf("  %-16s %10llu %10.1f %10.0f %10.0f %10.0f %10llu\n",
+                   histogram_names[i], h->count, mean,
+                   nvqr_histogram_percentile(h, 50),
+                   nvqr_histogram_percentile(h, 90),
+                   nvqr_histogram_percentile(h, 99), h->maxUs);
         }
+    }
+
+    printf(output->format == NVQR_FORMAT_JSON ? "}}\n" : "\n");
+    return NVQR_SUCCESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Fetch the sample history kept by the preload DSO in a process, and print
+// each sample with the usage of each device.
+static nvqrReturn_t print_history(pid_t pid, const OutputOptions *output)
+{
+    NVQRHistorySample *samples;
+    NVQRProcessInfo info;
+    nvqrReturn_t result;
+    long long now, wallNow;
+    int count, i, j;
 
-        nvqr_print_memory_info(queryType, buffer.data);
+    result = nvqr_query_history(pid, 0, &samples, &count);
+    if (result != NVQR_SUCCESS) {
+        fprintf(stderr, "Error: failed to fetch the history of pid %ld.\n",
+                (long) pid);
+        return result;
+    }
+    now = nvqr_ipc_get_time_us();
+    wallNow = get_wall_clock_us();
+
+    if (output->format != NVQR_FORMAT_JSON) {
+        nvqr_get_process_info(pid, &info);
+        printf("%s, pid = %ld, history of %d samples\n",
+               info.name[0] ? info.name : "unknown", (long) pid, count);
+        printf("  %-10s %10s %6s %10s %12s %12s\n", "sample", "age ms",
+               "device", "allocs", "used kiB", "free kiB");
+    }
+
+    for (i = 0; i < count; i++) {
+        const NVQRHistorySample *s = &samples[i];
+
+        if (output->format == NVQR_FORMAT_JSON) {
+            printf("{\"pid\":%ld,\"sequence\":%llu,\"timestamp_us\":%lld,"
+                   "\"devices\":[", (long) pid, s->sequence,
+                   wallNow - (now - s->timestampUs));
+        }
+
+        for (j = 0; j < s->numDevices; j++) {
+            const NVQRHistoryDevice *d = &s->devices[j];
+
+            if (output->format == NVQR_FORMAT_JSON) {
+                printf("%s{\"device\":%d,\"total_allocs\":%d,"
+                       "\"vidmem_used_kib\":%d,\"vidmem_free_kib\":%d}",
+                       j ? "," : "", j, d->totalAllocs, d->vidMemUsedkiB,
+                       d->vidMemFreekiB);
+            } else {
+                printf("  %-10llu %10lld %6d %10d %12d %12d\n", s->sequence,
+                       (now - s->timestampUs) / 1000, j, d->totalAllocs,
+                       d->vidMemUsedkiB, d->vidMemFreekiB);
+            }
+        }
+
+        if (output->format == NVQR_FORMAT_JSON) {
+            printf("]}\n");
+        }
+    }
+
+    if (output->format != NVQR_FORMAT_JSON) {
+        printf("\n");
+    }
+
+    free(samples);
+    return NVQR_SUCCESS;
+}
+
+
+static void print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char) *str < 0x20) {
+            printf("\\u%04x", (unsigned char) *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+
+static const char *object_type_name(NVQRQueryData_t objectType)
+{
+    switch (objectType) {
+        case GL_QUERY_RESOURCE_SYS_RESERVED_NV:     return "system_reserved";
+        case GL_QUERY_RESOURCE_TEXTURE_NV:          return "texture";
+        case GL_QUERY_RESOURCE_RENDERBUFFER_NV:     return "renderbuffer";
+        case GL_QUERY_RESOURCE_BUFFEROBJECT_NV:     return "buffer_object";
+        default:                                    return "unknown";
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Fetch the peak usage seen by the preload DSO in a process, and print each
+// peak with the time it was reached.
+static nvqrReturn_t print_peaks(pid_t pid, const OutputOptions *output)
+{
+    NVQRPeak *peaks;
+    NVQRProcessInfo info;
+    nvqrReturn_t result;
+    long long now, wallNow;
+    int count, i;
+
+    result = nvqr_query_peaks(pid, &peaks, &count);
+    if (result != NVQR_SUCCESS) {
+        fprintf(stderr, "Error: failed to fetch the peaks of pid %ld.\n",
+                (long) pid);
+        return result;
+    }
+    now = nvqr_ipc_get_time_us();
+    wallNow = get_wall_clock_us();
+
+    if (output->format == NVQR_FORMAT_JSON) {
+        printf("{\"pid\":%ld,\"peaks\":[", (long) pid);
     } else {
-        fprintf(stderr, "Error: failed to query resource usage information "
-                "for pid %ld.\n", (long) connection.pid);
+        nvqr_get_process_info(pid, &info);
+        printf("%s, pid = %ld, peak vidmem usage\n",
+               info.name[0] ? info.name : "unknown", (long) pid);
+        printf("  %6s %-40s %12s %10s\n", "device", "of", "peak kiB",
+               "age s");
     }
 
-    result = nvqr_disconnect(&connection);
+    for (i = 0; i < count; i++) {
+        const NVQRPeak *p = &peaks[i];
+
+        if (output->format == NVQR_FORMAT_JSON) {
+            printf("%s{\"device\":%d,", i ? "," : "", p->device);
+            if (p->kind == NVQR_PEAK_OBJECT_TYPE) {
+                printf("\"object_type\":\"%s\",",
+                       object_type_name(p->id));
+            } else if (p->kind == NVQR_PEAK_TAG) {
+                printf("\"tag_id\":%d,\"tag\":", p->id);
+                print_json_string(p->tag);
+                printf(",");
+            }
+            printf("\"peak_kib\":%d,\"timestamp_us\":%lld}", p->peakkiB,
+                   wallNow - (now - p->timestampUs));
+        } else {
+            char of[48];
+
+            if (p->kind == NVQR_PEAK_OBJECT_TYPE) {
+                snprintf(of, sizeof(of), "%s", object_type_name(p->id));
+            } else if (p->kind == NVQR_PEAK_TAG) {
+                snprintf(of, sizeof(of), "tag %d %s", p->id, p->tag);
+            } else {
+                snprintf(of, sizeof(of), "all");
+            }
+            printf("  %6d %-40s %12d %10.1f\n", p->device, of, p->peakkiB,
+                   (now - p->timestampUs) / 1e6);
+        }
+    }
+
+    printf(output->format == NVQR_FORMAT_JSON ? "]}\n" : "\n");
+
+    free(peaks);
+    return NVQR_SUCCESS;
+}
+
+
+int main (int argc, char * const * const argv)
+{
+    PidList pids = { NULL, 0, 0 };
+    SampleOptions sampling;
+    OutputOptions output;
+    GLenum queryType;
+    ReportType report;
+    int timeoutMs, i;
+    nvqrReturn_t result;
+
+    memset(&output, 0, sizeof(output));
+    result = parse_commandline(argc, argv, &pids, &queryType, &timeoutMs,
+                               &sampling, &output, &report);
+    if (result != NVQR_SUCCESS) {
+        fprintf(stderr, "%s: invalid command line\n", argv[0]);
+        free(pids.pids);
+        return result;
+    }
+
+    if (report) {
+        for (i = 0; i < pids.count; i++) {
+            nvqrReturn_t ret =
+                report == REPORT_STATS ? print_stats(pids.pids[i], &output) :
+                report == REPORT_HISTORY ?
+                    print_history(pids.pids[i], &output) :
+                    print_peaks(pids.pids[i], &output);
+
+            if (result == NVQR_SUCCESS) {
+                result = ret;
+            }
+        }
+
+        free(pids.pids);
+        return result;
+    }
+
+    if (output.format == NVQR_FORMAT_BINARY) {
+#if defined (_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    } else if (output.format == NVQR_FORMAT_CSV && pids.count > 0 &&
+               nvqr_format_header(&output.buffer,
+                                  NVQR_FORMAT_CSV) == NVQR_SUCCESS) {
+        fwrite(output.buffer.data, 1, output.buffer.len, stdout);
+        output.buffer.len = 0;
+    }
+
+    if (pids.count == 1) {
+        result = query_single_process(pids.pids[0], queryType, &sampling,
+                                      &output);
+    } else if (pids.count > 1) {
+        QueryContext context;
+
+        context.queryType = queryType;
+        context.output = &output;
+        context.result = NVQR_SUCCESS;
+
+        result = nvqr_query_pids(pids.pids, pids.count, queryType, timeoutMs,
+                                 query_callback, &context);
+        if (result == NVQR_SUCCESS) {
+            result = context.result;
+        }
+    }
+
+    nvqr_free_output_buffer(&output.buffer);
+    free(pids.pids);
     return result;
 }
@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+#if defined(_WIN32)
+
+// Named pipes on Windows are only used synchronously
+
+nvqrReturn_t nvqr_connect_async(NVQRConnection *connection, pid_t pid,
+                                int timeoutMs)
+{
+    memset(connection, 0, sizeof(*connection));
+    connection->pid = pid;
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+nvqrReturn_t nvqr_complete_connect(NVQRConnection *connection)
+{
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+nvqrReturn_t nvqr_begin_request_meminfo(NVQRConnection *connection,
+                                        GLenum queryType, int timeoutMs)
+{
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+nvqrReturn_t nvqr_complete_request_meminfo(NVQRConnection *connection,
+                                           NVQRQueryData_t **data, int *cnt)
+{
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+int nvqr_get_fd(NVQRConnection connection)
+{
+    return -1;
+}
+
+int nvqr_get_poll_events(NVQRConnection connection)
+{
+    return 0;
+}
+
+int nvqr_get_timeout(NVQRConnection connection)
+{
+    return -1;
+}
+
+#else
+
+typedef enum {
+    NVQR_ASYNC_IDLE = 0,    // connected, no request outstanding
+    NVQR_ASYNC_CONNECTING,  // connect(2) in progress, or waiting to retry it
+    NVQR_ASYNC_SENDING,     // writing a command
+    NVQR_ASYNC_RECEIVING,   // reading the response to the command
+    NVQR_ASYNC_FAILED       // unusable; the connection must be closed
+} NVQRAsyncStage;
+
+struct NVQRAsyncStateRec {
+    NVQRAsyncStage stage;
+    long long started;
+    long long deadline;
+    long long retry_time;
+    NVQRQueryCmdBuffer cmd;
+    size_t cmd_sent;
+    NVQRResponseReader reader;
+};
+
+// The number of microseconds to wait before retrying a connection that was
+// refused because the target's listen backlog was full.
+#define NVQR_ASYNC_RETRY_US 10000
+
+
+void nvqr_reset_response_reader(NVQRResponseReader *reader)
+{
+    free(reader->data);
+    memset(reader, 0, sizeof(*reader));
+}
+
+
+nvqrReturn_t nvqr_read_response_async(int fd, NVQRResponseReader *reader)
+{
+    for (;;) {
+        void *dest;
+        size_t len;
+        ssize_t ret = 0;
+
+        if (reader->header_bytes < sizeof(reader->header)) {
+            dest = (char *) &reader->header + reader->header_bytes;
+            len = sizeof(reader->header) - reader->header_bytes;
+        } else {
+            dest = (char *) reader->data + reader->data_bytes;
+            len = reader->header.cnt * sizeof(*reader->data) -
+                  reader->data_bytes;
+        }
+
+        if (len > 0) {
+            ret = read(fd, dest, len);
+            if (ret == 0) {
+                return NVQR_ERROR_UNKNOWN;
+            }
+            if (ret < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ||
+                       errno == EINTR ? NVQR_IN_PROGRESS : NVQR_ERROR_UNKNOWN;
+            }
+        }
+
+        if (reader->header_bytes < sizeof(reader->header)) {
+            reader->header_bytes += ret;
+            if (reader->header_bytes < sizeof(reader->header)) {
+                continue;
+            }
+
+            // A complete header: check it, and make room for the data
+            if (reader->header.cnt < 0 ||
+                reader->header.cnt > NVQR_MAX_RESPONSE_LEN) {
+                return NVQR_ERROR_UNKNOWN;
+            }
+            reader->data = malloc((reader->header.cnt ? reader->header.cnt : 1)
+                                  * sizeof(*reader->data));
+            if (!reader->data) {
+                return NVQR_ERROR_UNKNOWN;
+            }
+            continue;
+        }
+
+        reader->data_bytes += ret;
+        if (reader->data_bytes == reader->header.cnt * sizeof(*reader->data)) {
+            return NVQR_SUCCESS;
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Mark a connection as unusable, and pass the error on to the caller.
+static nvqrReturn_t fail(struct NVQRAsyncStateRec *async, nvqrReturn_t result)
+{
+    async->stage = NVQR_ASYNC_FAILED;
+    nvqr_reset_response_reader(&async->reader);
+    return result;
+}
+
+
+static long long get_deadline(int timeoutMs)
+{
+    return timeoutMs < 0 ? -1 : nvqr_ipc_get_time_us() + timeoutMs * 1000LL;
+}
+
+
+//------------------------------------------------------------------------------
+// Start (or retry) the non-blocking connect(2) to the target process.
+static nvqrReturn_t start_connect(NVQRConnection *c)
+{
+    struct NVQRAsyncStateRec *async = c->async;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    nvqr_ipc_get_socket_name(addr.sun_path, sizeof(addr.sun_path), c->pid);
+
+    async->retry_time = 0;
+
+    if (connect(c->server_handle, (struct sockaddr *) &addr,
+                sizeof(addr)) == 0) {
+        async->stage = NVQR_ASYNC_SENDING;
+    } else if (errno == EINPROGRESS) {
+        async->stage = NVQR_ASYNC_CONNECTING;
+    } else if (errno == EAGAIN) {
+        // The listen backlog is full; try again shortly
+        async->stage = NVQR_ASYNC_CONNECTING;
+        async->retry_time = nvqr_ipc_get_time_us() + NVQR_ASYNC_RETRY_US;
+        nvqr_count_client_stat(c->stats, NVQR_CLIENT_STAT_RETRIES, 1);
+    } else {
+        return fail(async, NVQR_ERROR_NOT_SUPPORTED);
+    }
+
+    return NVQR_IN_PROGRESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Make as much progress on the outstanding command as is possible without
+// blocking. Returns NVQR_SUCCESS once the matching response has been received,
+// NVQR_IN_PROGRESS if the command has to wait for the socket, or an error.
+static nvqrReturn_t advance(NVQRConnection *c)
+{
+    struct NVQRAsyncStateRec *async = c->async;
+    nvqrReturn_t result;
+    ssize_t ret;
+
+    if (async->deadline >= 0 && nvqr_ipc_get_time_us() >= async->deadline) {
+        return fail(async, NVQR_ERROR_TIMEOUT);
+    }
+
+    if (async->stage == NVQR_ASYNC_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (async->retry_time) {
+            if (nvqr_ipc_get_time_us() < async->retry_time) {
+                return NVQR_IN_PROGRESS;
+            }
+            result = start_connect(c);
+            if (async->stage == NVQR_ASYNC_FAILED) {
+                return result;
+            }
+            if (async->stage == NVQR_ASYNC_CONNECTING) {
+                return NVQR_IN_PROGRESS;
+            }
+        } else {
+            struct pollfd pfd;
+
+            pfd.fd = c->server_handle;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, 0) <= 0) {
+                return NVQR_IN_PROGRESS;
+            }
+            if (getsockopt(c->server_handle, SOL_SOCKET, SO_ERROR,
+                           &err, &len) != 0 || err != 0) {
+                return fail(async, NVQR_ERROR_NOT_SUPPORTED);
+            }
+            async->stage = NVQR_ASYNC_SENDING;
+        }
+    }
+
+    while (async->stage == NVQR_ASYNC_SENDING) {
+        ret = nvqr_ipc_send(c->server_handle,
+                            (char *) &async->cmd + async->cmd_sent,
+                            sizeof(async->cmd) - async->cmd_sent);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return NVQR_IN_PROGRESS;
+            }
+            // A refused connection has been answered and shut down
+            if (errno != EPIPE) {
+                return fail(async, NVQR_ERROR_UNKNOWN);
+            }
+            async->stage = NVQR_ASYNC_RECEIVING;
+            break;
+        }
+
+        async->cmd_sent += ret;
+        if (async->cmd_sent == sizeof(async->cmd)) {
+            async->stage = NVQR_ASYNC_RECEIVING;
+        }
+    }
+
+    result = nvqr_read_response_async(c->server_handle, &async->reader);
+    if (result == NVQR_IN_PROGRESS) {
+        return result;
+    }
+
+    // A throttled query leaves the connection usable; the reader holds the
+    // time after which to retry it
+    if (result == NVQR_SUCCESS &&
+        async->reader.header.op == NVQR_QUERY_THROTTLED &&
+        async->reader.header.cnt >= 1) {
+        if (async->cmd.op == NVQR_QUERY_CONNECT) {
+            return fail(async, NVQR_ERROR_THROTTLED);
+        }
+        async->stage = NVQR_ASYNC_IDLE;
+        return NVQR_ERROR_THROTTLED;
+    }
+
+    if (result != NVQR_SUCCESS || async->reader.header.op != async->cmd.op) {
+        return fail(async, NVQR_ERROR_UNKNOWN);
+    }
+
+    async->stage = NVQR_ASYNC_IDLE;
+    return NVQR_SUCCESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Like advance(), but for a command that may not be outstanding, and
+// accounting for the command in the client statistics once it completes.
+static nvqrReturn_t make_progress(NVQRConnection *c)
+{
+    struct NVQRAsyncStateRec *async = c->async;
+    nvqrReturn_t result;
+    size_t received;
+
+    if (async->stage == NVQR_ASYNC_FAILED) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    if (async->stage == NVQR_ASYNC_IDLE) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    // The reader is reset on failure, so only a whole response is counted
+    result = advance(c);
+    received = async->reader.header_bytes + async->reader.data_bytes;
+    if (result == NVQR_IN_PROGRESS) {
+        return result;
+    }
+
+    if (async->cmd.op == NVQR_QUERY_CONNECT) {
+        nvqr_record_connect(c->stats, result, async->started,
+                            async->cmd_sent, received);
+    } else {
+        nvqr_record_request(c->stats, result, async->started,
+                            async->cmd_sent, received);
+    }
+
+    return result;
+}
+
+
+//------------------------------------------------------------------------------
+// Queue a command to be sent by make_progress().
+static void begin_command(struct NVQRAsyncStateRec *async, NVQRqueryOp op,
+                          int queryType, pid_t pid, int timeoutMs)
+{
+    nvqr_reset_response_reader(&async->reader);
+    memset(&async->cmd, 0, sizeof(async->cmd));
+    async->cmd.op = op;
+    async->cmd.queryType = queryType;
+    async->cmd.pid = pid;
+    async->cmd_sent = 0;
+    async->started = nvqr_ipc_get_time_us();
+    async->deadline = get_deadline(timeoutMs);
+}
+
+
+nvqrReturn_t nvqr_connect_async(NVQRConnection *connection, pid_t pid,
+                                int timeoutMs)
+{
+    struct NVQRAsyncStateRec *async;
+    int flags;
+
+    memset(connection, 0, sizeof(*connection));
+    connection->pid = pid;
+    connection->server_handle = -1;
+
+    async = calloc(1, sizeof(*async));
+    if (!async) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    connection->server_handle = nvqr_ipc_socket();
+    if (connection->server_handle == -1) {
+        free(async);
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    flags = fcntl(connection->server_handle, F_GETFL);
+    if (flags == -1 ||
+        fcntl(connection->server_handle, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(connection->server_handle);
+        connection->server_handle = -1;
+        free(async);
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    connection->async = async;
+    begin_command(async, NVQR_QUERY_CONNECT, 0, getpid(), timeoutMs);
+
+    if (start_connect(connection) != NVQR_IN_PROGRESS) {
+        close(connection->server_handle);
+        connection->server_handle = -1;
+        connection->async = NULL;
+        free(async);
+        nvqr_record_connect(NULL, NVQR_ERROR_NOT_SUPPORTED, 0, 0, 0);
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    connection->process_name = nvqr_process_name_from_pid(pid);
+    connection->stats = nvqr_new_connection_stats();
+    return NVQR_IN_PROGRESS;
+}
+
+
+nvqrReturn_t nvqr_complete_connect(NVQRConnection *connection)
+{
+    if (!connection->async || connection->async->cmd.op != NVQR_QUERY_CONNECT) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    return make_progress(connection);
+}
+
+
+nvqrReturn_t nvqr_begin_request_meminfo(NVQRConnection *connection,
+                                        GLenum queryType, int timeoutMs)
+{
+    struct NVQRAsyncStateRec *async = connection->async;
+
+    if (!async || async->stage != NVQR_ASYNC_IDLE) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    begin_command(async, NVQR_QUERY_MEMORY_INFO, queryType, 0, timeoutMs);
+    async->stage = NVQR_ASYNC_SENDING;
+
+    return make_progress(connection) == NVQR_IN_PROGRESS ||
+           async->stage == NVQR_ASYNC_IDLE ? NVQR_SUCCESS
+                                           : NVQR_ERROR_UNKNOWN;
+}
+
+
+nvqrReturn_t nvqr_complete_request_meminfo(NVQRConnection *connection,
+                                           NVQRQueryData_t **data, int *cnt)
+{
+    struct NVQRAsyncStateRec *async = connection->async;
+    nvqrReturn_t result;
+
+    *data = NULL;
+    *cnt = 0;
+
+    if (!async || async->cmd.op != NVQR_QUERY_MEMORY_INFO) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    // The response may already have arrived during an earlier call
+    if (async->stage == NVQR_ASYNC_IDLE) {
+        result = async->reader.header.op == NVQR_QUERY_THROTTLED ?
+                 NVQR_ERROR_THROTTLED : NVQR_SUCCESS;
+    } else {
+        result = make_progress(connection);
+    }
+    if (result == NVQR_SUCCESS || result == NVQR_ERROR_THROTTLED) {
+        if (!async->reader.data) {
+            return NVQR_ERROR_INVALID_ARGUMENT;
+        }
+
+        // Hand the response data over to the caller
+        *data = async->reader.data;
+        *cnt = async->reader.header.cnt;
+        async->reader.data = NULL;
+    }
+
+    return result;
+}
+
+
+int nvqr_get_fd(NVQRConnection connection)
+{
+    // Subscribed connections are polled for updates
+    if (connection.async ||
+        (connection.delta && connection.delta->subscribed)) {
+        return connection.server_handle;
+    }
+
+    return -1;
+}
+
+
+int nvqr_get_poll_events(NVQRConnection connection)
+{
+    struct NVQRAsyncStateRec *async = connection.async;
+
+    if (!async) {
+        return 0;
+    }
+
+    switch (async->stage) {
+        case NVQR_ASYNC_CONNECTING:
+            return async->retry_time ? 0 : POLLOUT;
+        case NVQR_ASYNC_SENDING:
+            return POLLOUT;
+        case NVQR_ASYNC_RECEIVING:
+            return POLLIN;
+        default:
+            return 0;
+    }
+}
+
+
+int nvqr_get_timeout(NVQRConnection connection)
+{
+    struct NVQRAsyncStateRec *async = connection.async;
+    long long wake, now;
+
+    if (!async || async->stage == NVQR_ASYNC_IDLE ||
+        async->stage == NVQR_ASYNC_FAILED) {
+        return -1;
+    }
+
+    wake = async->deadline;
+    if (async->stage == NVQR_ASYNC_CONNECTING && async->retry_time &&
+        (wake < 0 || async->retry_time < wake)) {
+        wake = async->retry_time;
+    }
+    if (wake < 0) {
+        return -1;
+    }
+
+    // Round up, so that the caller does not wake up just before the deadline
+    now = nvqr_ipc_get_time_us();
+    return wake > now ? (int) ((wake - now + 999) / 1000) : 0;
+}
+
+
+void nvqr_close_async(NVQRConnection *connection)
+{
+    struct NVQRAsyncStateRec *async = connection->async;
+
+    // Let the server know that we are going away, if that can be done
+    // without blocking; otherwise it will notice the closed socket.
+    if (async->stage == NVQR_ASYNC_IDLE) {
+        NVQRQueryCmdBuffer cmd;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.op = NVQR_QUERY_DISCONNECT;
+        if (nvqr_ipc_send(connection->server_handle, &cmd, sizeof(cmd)) < 0) {
+            // Nothing more to do; the connection is being closed anyway
+        }
+    }
+
+    nvqr_reset_response_reader(&async->reader);
+    free(async);
+    connection->async = NULL;
+    nvqr_free_connection_stats(connection->stats);
+    connection->stats = NULL;
+
+    if (connection->server_handle != -1) {
+        close(connection->server_handle);
+    }
+}
+
+#endif // _WIN32
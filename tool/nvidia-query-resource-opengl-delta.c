@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+#if defined(_WIN32)
+
+// The driver's server on Windows only speaks the original protocol
+
+nvqrReturn_t nvqr_enable_delta(NVQRConnection *connection)
+{
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+#else
+
+nvqrReturn_t nvqr_enable_delta(NVQRConnection *connection)
+{
+    if (connection->async || connection->pipeline) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (!connection->delta) {
+        connection->delta = calloc(1, sizeof(*connection->delta));
+        if (!connection->delta) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+    }
+
+    return NVQR_SUCCESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Carry out the instructions of an NVQR_DELTA_PATCH, checking every offset
+// and length against the buffers.
+static int apply_patch(const NVQRQueryData_t *patch, int cnt,
+                       const NVQRQueryData_t *base, int baseCnt,
+                       NVQRQueryData_t *out, int outCnt)
+{
+    int pos = 0, len = 0;
+
+    while (pos < cnt) {
+        int n;
+
+        if (patch[pos] == NVQR_DELTA_COPY) {
+            int offset;
+
+            if (cnt - pos < 3) {
+                return 0;
+            }
+            offset = patch[pos + 1];
+            n = patch[pos + 2];
+            if (offset < 0 || n < 0 || n > baseCnt - offset ||
+                n > outCnt - len) {
+                return 0;
+            }
+            memcpy(out + len, base + offset, n * sizeof(*out));
+            pos += 3;
+        } else if (patch[pos] == NVQR_DELTA_DATA) {
+            if (cnt - pos < 2) {
+                return 0;
+            }
+            n = patch[pos + 1];
+            if (n < 0 || n > cnt - pos - 2 || n > outCnt - len) {
+                return 0;
+            }
+            memcpy(out + len, patch + pos + 2, n * sizeof(*out));
+            pos += 2 + n;
+        } else {
+            return 0;
+        }
+        len += n;
+    }
+
+    return len == outCnt;
+}
+
+
+nvqrReturn_t nvqr_apply_delta(struct NVQRDeltaStateRec *delta, int cnt,
+                              NVQRQueryData_t **result, int *resultCnt)
+{
+    const NVQRQueryData_t *resp = delta->response;
+    NVQRQueryData_t *out = NULL;
+    int outCnt;
+
+    *result = NULL;
+    *resultCnt = 0;
+
+    if (cnt >= 1 && resp[0] == NVQR_DELTA_FULL) {
+        outCnt = cnt - 1;
+        out = malloc((outCnt ? outCnt : 1) * sizeof(*out));
+        if (out) {
+            memcpy(out, resp + 1, outCnt * sizeof(*out));
+        }
+    } else if (cnt >= 2 && resp[0] == NVQR_DELTA_PATCH && delta->cnt &&
+               resp[1] >= 0 && resp[1] <= NVQR_MAX_RESPONSE_LEN) {
+        outCnt = resp[1];
+        out = malloc((outCnt ? outCnt : 1) * sizeof(*out));
+        if (out && !apply_patch(resp + 2, cnt - 2, delta->base, delta->cnt,
+                                out, outCnt)) {
+            free(out);
+            out = NULL;
+        }
+    }
+
+    if (!out) {
+        delta->cnt = 0;
+        delta->reset = 1;
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    if (outCnt > delta->cap) {
+        NVQRQueryData_t *base = realloc(delta->base, outCnt * sizeof(*base));
+
+        if (!base) {
+            free(out);
+            delta->cnt = 0;
+            delta->reset = 1;
+            return NVQR_ERROR_UNKNOWN;
+        }
+        delta->base = base;
+        delta->cap = outCnt;
+    }
+    memcpy(delta->base, out, outCnt * sizeof(*out));
+    delta->cnt = outCnt;
+
+    *result = out;
+    *resultCnt = outCnt;
+    return NVQR_SUCCESS;
+}
+
+
+void nvqr_free_delta(struct NVQRDeltaStateRec *delta)
+{
+    if (delta) {
+        free(delta->base);
+        free(delta->response);
+        free(delta);
+    }
+}
+
+#endif
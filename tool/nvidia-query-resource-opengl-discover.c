@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+
+typedef struct {
+    pid_t *pids;
+    int count, capacity;
+} PidSet;
+
+
+static int add_pid(PidSet *set, long pid)
+{
+    if (pid <= 0) {
+        return 1;
+    }
+
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? 2 * set->capacity : 64;
+        pid_t *pids = realloc(set->pids, capacity * sizeof(*pids));
+
+        if (!pids) {
+            return 0;
+        }
+        set->pids = pids;
+        set->capacity = capacity;
+    }
+
+    set->pids[set->count++] = (pid_t) pid;
+    return 1;
+}
+
+
+//------------------------------------------------------------------------------
+// Parse the pid at the end of a socket or pipe name. Returns 0 if the name
+// does not end in a pid, or if the pid is followed by anything other than one
+// of the characters in terminators.
+static long parse_pid(const char *str, const char *end, const char *terminators)
+{
+    long pid = 0;
+
+    if (str == end || *str < '0' || *str > '9') {
+        return 0;
+    }
+
+    for (; str < end && *str >= '0' && *str <= '9'; str++) {
+        pid = pid * 10 + (*str - '0');
+        if (pid > 0x7fffffff) {
+            return 0;
+        }
+    }
+
+    return str == end || strchr(terminators, *str) ? pid : 0;
+}
+
+
+static int compare_pids(const void *a, const void *b)
+{
+    pid_t pa = *(const pid_t *) a, pb = *(const pid_t *) b;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+
+#if defined(_WIN32)
+
+//------------------------------------------------------------------------------
+// The driver creates a named pipe for each OpenGL process that can be queried;
+// list the pipes and pick out the ones with the server pipe name.
+static nvqrReturn_t find_servers(PidSet *set)
+{
+    static const char prefix[] = NVQR_IPC_SERVER_PIPE_BASENAME;
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA("\\\\.\\pipe\\*", &data);
+
+    if (find == INVALID_HANDLE_VALUE) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    do {
+        const char *name = data.cFileName;
+
+        if (strncmp(name, prefix, sizeof(prefix) - 1) == 0 &&
+            !add_pid(set, parse_pid(name + sizeof(prefix) - 1,
+                                    name + strlen(name), ""))) {
+            FindClose(find);
+            return NVQR_ERROR_UNKNOWN;
+        }
+    } while (FindNextFileA(find, &data));
+
+    FindClose(find);
+    return NVQR_SUCCESS;
+}
+
+#elif defined(__linux)
+
+// Socket flags in /proc/net/unix; __SO_ACCEPTCON marks listening sockets
+#define NVQR_SO_ACCEPTCON 0x00010000
+
+//------------------------------------------------------------------------------
+// Check one line of /proc/net/unix, which looks like
+//   Num: RefCount Protocol Flags Type St Inode Path
+// for a listening socket in the abstract namespace with the server socket
+// name. The leading and padding NUL bytes of abstract names are shown as '@'.
+static int parse_unix_socket_line(PidSet *set, const char *line,
+                                  const char *end)
+{
+    static const char prefix[] = "@" NVQR_IPC_SOCKET_BASENAME;
+    unsigned long flags = 0;
+    int field;
+
+    for (field = 0; field < 7; field++) {
+        const char *start;
+
+        while (line < end && *line == ' ') {
+            line++;
+        }
+        start = line;
+        while (line < end && *line != ' ') {
+            line++;
+        }
+        if (line == start) {
+            return 1;
+        }
+        if (field == 3) {
+            flags = strtoul(start, NULL, 16);
+        }
+    }
+
+    while (line < end && *line == ' ') {
+        line++;
+    }
+
+    if (!(flags & NVQR_SO_ACCEPTCON) ||
+        (size_t) (end - line) < sizeof(prefix) - 1 ||
+        memcmp(line, prefix, sizeof(prefix) - 1) != 0) {
+        return 1;
+    }
+
+    return add_pid(set, parse_pid(line + sizeof(prefix) - 1, end, "@"));
+}
+
+
+//------------------------------------------------------------------------------
+// Every server listens on an abstract socket, all of which are listed in
+// /proc/net/unix; read it in large chunks, and pick out the server sockets.
+static nvqrReturn_t find_servers(PidSet *set)
+{
+    char buf[65536];
+    size_t len = 0;
+    int fd = open("/proc/net/unix", O_RDONLY);
+    nvqrReturn_t ret = NVQR_SUCCESS;
+
+    if (fd == -1) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    for (;;) {
+        ssize_t bytes = read(fd, buf + len, sizeof(buf) - len);
+        const char *line = buf, *end = buf + len, *eol;
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            // Handle a final line without a newline, then stop
+            if (bytes < 0) {
+                ret = NVQR_ERROR_UNKNOWN;
+            } else if (len > 0 && !parse_unix_socket_line(set, buf, end)) {
+                ret = NVQR_ERROR_UNKNOWN;
+            }
+            break;
+        }
+        end += bytes;
+
+        while ((eol = memchr(line, '\n', end - line))) {
+            if (!parse_unix_socket_line(set, line, eol)) {
+                close(fd);
+                return NVQR_ERROR_UNKNOWN;
+            }
+            line = eol + 1;
+        }
+
+        // Carry any partial line over to the next read
+        len = end - line;
+        if (len == sizeof(buf)) {
+            len = 0; // an absurdly long line; skip it
+        }
+        memmove(buf, line, len);
+    }
+
+    close(fd);
+    return ret;
+}
+
+#else
+
+//------------------------------------------------------------------------------
+// Elsewhere, the server sockets are files in /tmp. Sockets left behind by
+// processes that exited without cleaning up are skipped.
+static nvqrReturn_t find_servers(PidSet *set)
+{
+    static const char prefix[] = NVQR_IPC_SOCKET_BASENAME;
+    DIR *dir = opendir("/tmp");
+    struct dirent *entry;
+
+    if (!dir) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        long pid;
+
+        if (strncmp(name, prefix, sizeof(prefix) - 1) != 0) {
+            continue;
+        }
+
+        pid = parse_pid(name + sizeof(prefix) - 1, name + strlen(name), "");
+        if (pid > 0 && (kill((pid_t) pid, 0) == 0 || errno == EPERM) &&
+            !add_pid(set, pid)) {
+            closedir(dir);
+            return NVQR_ERROR_UNKNOWN;
+        }
+    }
+
+    closedir(dir);
+    return NVQR_SUCCESS;
+}
+
+#endif
+
+
+nvqrReturn_t nvqr_find_processes(pid_t **pids, int *count)
+{
+    PidSet set = { NULL, 0, 0 };
+    nvqrReturn_t ret;
+    int i, n;
+
+    *pids = NULL;
+    *count = 0;
+
+    ret = find_servers(&set);
+    if (ret != NVQR_SUCCESS) {
+        free(set.pids);
+        return ret;
+    }
+
+    // Sort, and drop duplicates (e.g. a socket shared with forked children)
+    qsort(set.pids, set.count, sizeof(*set.pids), compare_pids);
+    for (i = 0, n = 0; i < set.count; i++) {
+        if (n == 0 || set.pids[i] != set.pids[n - 1]) {
+            set.pids[n++] = set.pids[i];
+        }
+    }
+
+    *pids = set.pids;
+    *count = n;
+    return NVQR_SUCCESS;
+}
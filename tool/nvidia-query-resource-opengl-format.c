@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-data.h"
+
+// Records are built up with these helpers rather than with printf(), which is
+// comparatively slow for output made up of many short fields. Each helper
+// returns FALSE (0) if the buffer could not be grown.
+
+static int reserve(NVQROutputBuffer *out, size_t len)
+{
+    if (out->capacity - out->len < len) {
+        size_t capacity = out->capacity ? out->capacity : 1024;
+        char *data;
+
+        while (capacity - out->len < len) {
+            capacity *= 2;
+        }
+        data = realloc(out->data, capacity);
+        if (!data) {
+            return 0;
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+
+    return 1;
+}
+
+
+static int append(NVQROutputBuffer *out, const char *str, size_t len)
+{
+    if (!reserve(out, len)) {
+        return 0;
+    }
+    memcpy(out->data + out->len, str, len);
+    out->len += len;
+    return 1;
+}
+
+
+static int append_str(NVQROutputBuffer *out, const char *str)
+{
+    return append(out, str, strlen(str));
+}
+
+
+static int append_int(NVQROutputBuffer *out, long long value)
+{
+    char buf[24], *ptr = buf + sizeof(buf);
+    unsigned long long mag = value < 0 ? 0ULL - (unsigned long long) value
+                                       : (unsigned long long) value;
+
+    do {
+        *--ptr = '0' + (char) (mag % 10);
+        mag /= 10;
+    } while (mag);
+
+    if (value < 0) {
+        *--ptr = '-';
+    }
+
+    return append(out, ptr, buf + sizeof(buf) - ptr);
+}
+
+
+//------------------------------------------------------------------------------
+// Append a quoted JSON string, escaping any characters that JSON requires.
+static int append_json_string(NVQROutputBuffer *out, const char *str,
+                              size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    if (!append(out, "\"", 1)) {
+        return 0;
+    }
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
+
+        if (c == '"' || c == '\\') {
+            char esc[2];
+
+            esc[0] = '\\';
+            esc[1] = (char) c;
+            if (!append(out, esc, 2)) {
+                return 0;
+            }
+        } else if (c < 0x20) {
+            char esc[6] = { '\\', 'u', '0', '0', 0, 0 };
+
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xf];
+            if (!append(out, esc, sizeof(esc))) {
+                return 0;
+            }
+        } else if (!append(out, (const char *) &str[i], 1)) {
+            return 0;
+        }
+    }
+
+    return append(out, "\"", 1);
+}
+
+
+//------------------------------------------------------------------------------
+// Append a CSV field, quoting it if it contains a separator, quote or newline.
+static int append_csv_string(NVQROutputBuffer *out, const char *str,
+                             size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] == ',' || str[i] == '"' || str[i] == '\r' ||
+            str[i] == '\n') {
+            break;
+        }
+    }
+    if (i == len) {
+        return append(out, str, len);
+    }
+
+    if (!append(out, "\"", 1)) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        if (str[i] == '"' && !append(out, "\"", 1)) {
+            return 0;
+        }
+        if (!append(out, &str[i], 1)) {
+            return 0;
+        }
+    }
+    return append(out, "\"", 1);
+}
+
+
+static const char *object_type_name(NVQRQueryData_t objectType)
+{
+    switch (objectType) {
+        case GL_QUERY_RESOURCE_SYS_RESERVED_NV:     return "system_reserved";
+        case GL_QUERY_RESOURCE_TEXTURE_NV:          return "texture";
+        case GL_QUERY_RESOURCE_RENDERBUFFER_NV:     return "renderbuffer";
+        case GL_QUERY_RESOURCE_BUFFEROBJECT_NV:     return "buffer_object";
+        default:                                    return "unknown";
+    }
+}
+
+
+static const char *mem_type_name(NVQRQueryData_t memType)
+{
+    return memType == GL_QUERY_RESOURCE_MEMTYPE_VIDMEM_NV ? "vidmem"
+                                                          : "unknown";
+}
+
+
+//------------------------------------------------------------------------------
+// Decode a query result into the scratch arrays of the output buffer, growing
+// them if the result has more records than fit.
+static nvqrReturn_t parse_result(NVQROutputBuffer *out,
+                                 const NVQRQueryData_t *data, int cnt,
+                                 NVQRParsedData *parsed)
+{
+    nvqrReturn_t ret;
+
+    memset(parsed, 0, sizeof(*parsed));
+    parsed->devices = out->devices;
+    parsed->maxDevices = out->maxDevices;
+    parsed->details = out->details;
+    parsed->maxDetails = out->maxDetails;
+    parsed->tags = out->tags;
+    parsed->maxTags = out->maxTags;
+
+    ret = nvqr_parse_memory_info(data, cnt, parsed);
+    if (ret != NVQR_ERROR_INSUFFICIENT_BUFFER) {
+        return ret;
+    }
+
+    if (parsed->numDevices > out->maxDevices) {
+        NVQRDeviceRecord *devices =
+            realloc(out->devices, parsed->numDevices * sizeof(*devices));
+
+        if (!devices) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+        out->devices = devices;
+        out->maxDevices = parsed->numDevices;
+    }
+    if (parsed->numDetails > out->maxDetails) {
+        NVQRDetailRecord *details =
+            realloc(out->details, parsed->numDetails * sizeof(*details));
+
+        if (!details) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+        out->details = details;
+        out->maxDetails = parsed->numDetails;
+    }
+    if (parsed->numTags > out->maxTags) {
+        NVQRTagRecord *tags =
+            realloc(out->tags, parsed->numTags * sizeof(*tags));
+
+        if (!tags) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+        out->tags = tags;
+        out->maxTags = parsed->numTags;
+    }
+
+    return parse_result(out, data, cnt, parsed);
+}
+
+
+static int format_json(NVQROutputBuffer *out, pid_t pid,
+                       const char *process_name, long long timestampUs,
+                       const NVQRParsedData *parsed)
+{
+    int ok, i, j;
+
+    ok = append_str(out, "{\"pid\":") &&
+         append_int(out, (long long) pid) &&
+         append_str(out, ",\"process\":") &&
+         (process_name ? append_json_string(out, process_name,
+                                            strlen(process_name))
+                       : append_str(out, "null")) &&
+         append_str(out, ",\"timestamp_us\":") &&
+         append_int(out, timestampUs) &&
+         append_str(out, ",\"version\":") &&
+         append_int(out, parsed->version) &&
+         append_str(out, ",\"devices\":[");
+
+    for (i = 0; ok && i < parsed->numDevices; i++) {
+        const NVQRDeviceRecord *dev = &parsed->devices[i];
+
+        ok = append_str(out, i ? ",{\"device\":" : "{\"device\":") &&
+             append_int(out, i) &&
+             append_str(out, ",\"total_allocs\":") &&
+             append_int(out, dev->totalAllocs) &&
+             append_str(out, ",\"vidmem_used_kib\":") &&
+             append_int(out, dev->vidMemUsedkiB) &&
+             append_str(out, ",\"vidmem_free_kib\":") &&
+             append_int(out, dev->vidMemFreekiB) &&
+             append_str(out, ",\"details\":[");
+
+        for (j = 0; ok && j < dev->numDetails; j++) {
+            const NVQRDetailRecord *detail =
+                &parsed->details[dev->firstDetail + j];
+
+            ok = append_str(out, j ? ",{\"mem_type\":\"" :
+                                     "{\"mem_type\":\"") &&
+                 append_str(out, mem_type_name(detail->memType)) &&
+                 append_str(out, "\",\"object_type\":\"") &&
+                 append_str(out, object_type_name(detail->objectType)) &&
+                 append_str(out, "\",\"num_allocs\":") &&
+                 append_int(out, detail->numAllocs) &&
+                 append_str(out, ",\"mem_used_kib\":") &&
+                 append_int(out, detail->memUsedkiB) &&
+                 append_str(out, "}");
+        }
+
+        ok = ok && append_str(out, "]}");
+    }
+
+    ok = ok && append_str(out, "],\"tags\":[");
+
+    for (i = 0; ok && i < parsed->numTags; i++) {
+        const NVQRTagRecord *tag = &parsed->tags[i];
+
+        ok = append_str(out, i ? ",{\"tag_id\":" : "{\"tag_id\":") &&
+             append_int(out, tag->tagId) &&
+             append_str(out, ",\"device\":") &&
+             append_int(out, tag->deviceId) &&
+             append_str(out, ",\"tag\":") &&
+             append_json_string(out, tag->tag, tag->tagLen) &&
+             append_str(out, ",\"num_allocs\":") &&
+             append_int(out, tag->numAllocs) &&
+             append_str(out, ",\"vidmem_used_kib\":") &&
+             append_int(out, tag->vidmemUsedkiB) &&
+             append_str(out, "}");
+    }
+
+    return ok && append_str(out, "]}\n");
+}
+
+
+//------------------------------------------------------------------------------
+// Append the columns common to every CSV row of a record.
+static int format_csv_prefix(NVQROutputBuffer *out, pid_t pid,
+                             const char *process_name, long long timestampUs,
+                             const char *record, int device)
+{
+    return append_int(out, timestampUs) &&
+           append_str(out, ",") &&
+           append_int(out, (long long) pid) &&
+           append_str(out, ",") &&
+           (!process_name ||
+            append_csv_string(out, process_name, strlen(process_name))) &&
+           append_str(out, ",") &&
+           append_str(out, record) &&
+           append_str(out, ",") &&
+           append_int(out, device) &&
+           append_str(out, ",");
+}
+
+
+static int format_csv(NVQROutputBuffer *out, pid_t pid,
+                      const char *process_name, long long timestampUs,
+                      const NVQRParsedData *parsed)
+{
+    int ok = 1, i;
+
+    for (i = 0; ok && i < parsed->numDevices; i++) {
+        const NVQRDeviceRecord *dev = &parsed->devices[i];
+
+        ok = format_csv_prefix(out, pid, process_name, timestampUs,
+                               "device", i) &&
+             append_str(out, ",,,,") &&
+             append_int(out, dev->totalAllocs) &&
+             append_str(out, ",") &&
+             append_int(out, dev->vidMemUsedkiB) &&
+             append_str(out, ",") &&
+             append_int(out, dev->vidMemFreekiB) &&
+             append_str(out, "\n");
+    }
+
+    for (i = 0; ok && i < parsed->numDetails; i++) {
+        const NVQRDetailRecord *detail = &parsed->details[i];
+
+        ok = format_csv_prefix(out, pid, process_name, timestampUs,
+                               "detail", detail->device) &&
+             append_str(out, mem_type_name(detail->memType)) &&
+             append_str(out, ",") &&
+             append_str(out, object_type_name(detail->objectType)) &&
+             append_str(out, ",,,") &&
+             append_int(out, detail->numAllocs) &&
+             append_str(out, ",") &&
+             append_int(out, detail->memUsedkiB) &&
+             append_str(out, ",\n");
+    }
+
+    for (i = 0; ok && i < parsed->numTags; i++) {
+        const NVQRTagRecord *tag = &parsed->tags[i];
+
+        ok = format_csv_prefix(out, pid, process_name, timestampUs,
+                               "tag", tag->deviceId) &&
+             append_str(out, ",,") &&
+             append_int(out, tag->tagId) &&
+             append_str(out, ",") &&
+             append_csv_string(out, tag->tag, tag->tagLen) &&
+             append_str(out, ",") &&
+             append_int(out, tag->numAllocs) &&
+             append_str(out, ",") &&
+             append_int(out, tag->vidmemUsedkiB) &&
+             append_str(out, ",\n");
+    }
+
+    return ok;
+}
+
+
+static void copy_name(char *dest, const char *src, size_t len)
+{
+    memset(dest, 0, NVQR_BINARY_NAME_LEN);
+    memcpy(dest, src, len < NVQR_BINARY_NAME_LEN ? len
+                                                 : NVQR_BINARY_NAME_LEN - 1);
+}
+
+
+static int format_binary(NVQROutputBuffer *out, pid_t pid,
+                         const char *process_name, long long timestampUs,
+                         const NVQRParsedData *parsed)
+{
+    size_t size = sizeof(NVQRBinaryRecordHeader) +
+                  parsed->numDevices * sizeof(NVQRBinaryDevice) +
+                  parsed->numDetails * sizeof(NVQRBinaryDetail) +
+                  parsed->numTags * sizeof(NVQRBinaryTag);
+    NVQRBinaryRecordHeader *header;
+    NVQRBinaryDevice *dev;
+    NVQRBinaryDetail *detail;
+    NVQRBinaryTag *tag;
+    int i;
+
+    // Pad the record so that the header of the next one in the buffer is
+    // aligned, too.
+    size = (size + NVQR_BINARY_RECORD_ALIGN - 1) &
+           ~(size_t) (NVQR_BINARY_RECORD_ALIGN - 1);
+
+    if (!reserve(out, size)) {
+        return 0;
+    }
+
+    // Fill the record in place; it is zeroed first so that no uninitialized
+    // padding is written out.
+    header = (NVQRBinaryRecordHeader *) (out->data + out->len);
+    memset(header, 0, size);
+    header->magic = NVQR_BINARY_RECORD_MAGIC;
+    header->recordVersion = NVQR_BINARY_RECORD_VERSION;
+    header->recordSize = (int) size;
+    header->pid = (int) pid;
+    header->timestampUs = timestampUs;
+    header->dataVersion = parsed->version;
+    header->numDevices = parsed->numDevices;
+    header->numDetails = parsed->numDetails;
+    header->numTags = parsed->numTags;
+    if (process_name) {
+        copy_name(header->processName, process_name, strlen(process_name));
+    }
+
+    dev = (NVQRBinaryDevice *) (header + 1);
+    for (i = 0; i < parsed->numDevices; i++, dev++) {
+        dev->totalAllocs = parsed->devices[i].totalAllocs;
+        dev->vidMemUsedkiB = parsed->devices[i].vidMemUsedkiB;
+        dev->vidMemFreekiB = parsed->devices[i].vidMemFreekiB;
+        dev->numDetails = parsed->devices[i].numDetails;
+    }
+
+    detail = (NVQRBinaryDetail *) dev;
+    for (i = 0; i < parsed->numDetails; i++, detail++) {
+        detail->device = parsed->details[i].device;
+        detail->memType = parsed->details[i].memType;
+        detail->objectType = parsed->details[i].objectType;
+        detail->numAllocs = parsed->details[i].numAllocs;
+        detail->memUsedkiB = parsed->details[i].memUsedkiB;
+    }
+
+    tag = (NVQRBinaryTag *) detail;
+    for (i = 0; i < parsed->numTags; i++, tag++) {
+        tag->tagId = parsed->tags[i].tagId;
+        tag->deviceId = parsed->tags[i].deviceId;
+        tag->numAllocs = parsed->tags[i].numAllocs;
+        tag->vidmemUsedkiB = parsed->tags[i].vidmemUsedkiB;
+        copy_name(tag->tag, parsed->tags[i].tag, parsed->tags[i].tagLen);
+    }
+
+    out->len += size;
+    return 1;
+}
+
+
+nvqrReturn_t nvqr_format_memory_info(NVQROutputBuffer *out,
+                                     nvqrFormat_t format, pid_t pid,
+                                     const char *process_name,
+                                     long long timestampUs,
+                                     const NVQRQueryData_t *data, int cnt)
+{
+    NVQRParsedData parsed;
+    size_t start = out->len;
+    nvqrReturn_t ret;
+    int ok;
+
+    ret = parse_result(out, data, cnt, &parsed);
+    if (ret != NVQR_SUCCESS) {
+        return ret;
+    }
+
+    switch (format) {
+        case NVQR_FORMAT_JSON:
+            ok = format_json(out, pid, process_name, timestampUs, &parsed);
+            break;
+        case NVQR_FORMAT_CSV:
+            ok = format_csv(out, pid, process_name, timestampUs, &parsed);
+            break;
+        case NVQR_FORMAT_BINARY:
+            ok = format_binary(out, pid, process_name, timestampUs, &parsed);
+            break;
+        default:
+            return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (!ok) {
+        // Never leave a partial record behind
+        out->len = start;
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    return NVQR_SUCCESS;
+}
+
+
+nvqrReturn_t nvqr_format_header(NVQROutputBuffer *out, nvqrFormat_t format)
+{
+    switch (format) {
+        case NVQR_FORMAT_CSV:
+            return append_str(out, "timestamp_us,pid,process,record,device,"
+                              "mem_type,object_type,tag_id,tag,num_allocs,"
+                              "mem_used_kib,mem_free_kib\n") ?
+                   NVQR_SUCCESS : NVQR_ERROR_UNKNOWN;
+        case NVQR_FORMAT_JSON:
+        case NVQR_FORMAT_BINARY:
+            return NVQR_SUCCESS;
+        default:
+            return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+
+void nvqr_free_output_buffer(NVQROutputBuffer *out)
+{
+    free(out->data);
+    free(out->devices);
+    free(out->details);
+    free(out->tags);
+    memset(out, 0, sizeof(*out));
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __NVIDIA_QUERY_RESOURCE_OPENGL_INTERNAL_H__
+#define __NVIDIA_QUERY_RESOURCE_OPENGL_INTERNAL_H__
+
+// Functions shared between the source files of the query library, which are
+// not part of its public API
+
+#include "nvidia-query-resource-opengl.h"
+
+//------------------------------------------------------------------------------
+// Determine the name of the process with the given PID, without any leading
+// path components. Returns a newly heap-allocated string, or NULL on error.
+
+char *nvqr_process_name_from_pid(pid_t pid);
+
+//------------------------------------------------------------------------------
+// Allocate the statistics of a new connection, or return NULL if they are not
+// kept per connection; and free them.
+
+struct NVQRClientStatsRec *nvqr_new_connection_stats(void);
+void nvqr_free_connection_stats(struct NVQRClientStatsRec *stats);
+
+//------------------------------------------------------------------------------
+// Add n to a counter of the client statistics, both of the process and of the
+// connection with the given statistics, which may be NULL.
+
+void nvqr_count_client_stat(struct NVQRClientStatsRec *stats,
+                            NVQRClientStatCounter counter, unsigned long n);
+
+//------------------------------------------------------------------------------
+// Account for a request that was sent at startUs (on the clock of
+// nvqr_ipc_get_time_us(), or -1 if it never was), and has just completed with
+// the given result after sent and received bytes were transferred.
+
+void nvqr_record_request(struct NVQRClientStatsRec *stats,
+                         nvqrReturn_t result, long long startUs,
+                         size_t sent, size_t received);
+
+//------------------------------------------------------------------------------
+// Likewise for an attempt to connect, which started at startUs.
+
+void nvqr_record_connect(struct NVQRClientStatsRec *stats,
+                         nvqrReturn_t result, long long startUs,
+                         size_t sent, size_t received);
+
+#if !defined(_WIN32)
+
+#include <stddef.h>
+
+//------------------------------------------------------------------------------
+// The state of a response being read from a non-blocking socket. Zero
+// initialize before reading the first response.
+
+typedef struct {
+    NVQRQueryResponseHeader header;
+    size_t header_bytes;
+    NVQRQueryData_t *data;
+    size_t data_bytes;
+} NVQRResponseReader;
+
+//------------------------------------------------------------------------------
+// Read as much of a response as is available without blocking. Returns
+// NVQR_SUCCESS once the whole response has been read, with the data in
+// reader->data, NVQR_IN_PROGRESS if more is still to come, or an error.
+
+nvqrReturn_t nvqr_read_response_async(int fd, NVQRResponseReader *reader);
+
+//------------------------------------------------------------------------------
+// Free the data of a response, and get ready to read another one.
+
+void nvqr_reset_response_reader(NVQRResponseReader *reader);
+
+//------------------------------------------------------------------------------
+// Check the cnt words of data of a response to a batch of count query types,
+// and point each entry of results at the result for the query type in data.
+// Returns NVQR_ERROR_UNKNOWN if the response is malformed.
+
+nvqrReturn_t nvqr_decode_batch_response(const NVQRQueryData_t *data, int cnt,
+                                        const GLenum *queryTypes, int count,
+                                        NVQRBatchResult *results);
+
+//------------------------------------------------------------------------------
+// Decode the cnt words of data of a response to NVQR_QUERY_STATS. Counters
+// and histograms that the server does not know of are left at zero, and those
+// that this library does not know of are ignored.
+
+nvqrReturn_t nvqr_decode_stats(const NVQRQueryData_t *data, int cnt,
+                               NVQRServerStats *stats);
+
+//------------------------------------------------------------------------------
+// Decode the cnt words of data of a response to NVQR_QUERY_HISTORY into a
+// newly heap-allocated array of *count samples. Returns
+// NVQR_ERROR_NOT_SUPPORTED if the server keeps no history.
+
+nvqrReturn_t nvqr_decode_history(const NVQRQueryData_t *data, int cnt,
+                                 NVQRHistorySample **samples, int *count);
+
+//------------------------------------------------------------------------------
+// Decode the cnt words of data of a response to NVQR_QUERY_PEAKS into a newly
+// heap-allocated array of *count peaks.
+
+nvqrReturn_t nvqr_decode_peaks(const NVQRQueryData_t *data, int cnt,
+                               NVQRPeak **peaks, int *count);
+
+//------------------------------------------------------------------------------
+// Close a connection opened with nvqr_connect() without telling the server,
+// for connections that are broken or out of step with the server, and free
+// everything that belongs to it.
+
+void nvqr_abandon_connection(NVQRConnection *connection);
+
+//------------------------------------------------------------------------------
+// Close a connection opened with nvqr_connect_async().
+
+void nvqr_close_async(NVQRConnection *connection);
+
+//------------------------------------------------------------------------------
+// The state of a connection with delta responses enabled: the last result
+// received, and scratch space for the responses. If reset is set, the
+// server's idea of the last result may differ from this one, and has to be
+// reset before the next query. If subscribed is set, the server pushes the
+// results, and the connection takes no other requests.
+
+struct NVQRDeltaStateRec {
+    NVQRQueryData_t *base;
+    int cnt, cap;
+    NVQRQueryData_t *response;
+    int response_cap;
+    int reset;
+    int subscribed;
+};
+
+//------------------------------------------------------------------------------
+// Rebuild the result described by the cnt words of a delta response, which
+// have been read into delta->response, and return it in a newly heap-allocated
+// buffer of *resultCnt words. The result becomes the base for the next delta
+// response.
+
+nvqrReturn_t nvqr_apply_delta(struct NVQRDeltaStateRec *delta, int cnt,
+                              NVQRQueryData_t **result, int *resultCnt);
+
+//------------------------------------------------------------------------------
+// Free the state of a connection with delta responses enabled.
+
+void nvqr_free_delta(struct NVQRDeltaStateRec *delta);
+
+#endif
+
+#endif
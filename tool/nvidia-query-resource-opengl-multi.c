@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+// Upper bound on the number of connections kept open at once, to stay well
+// clear of the open file limit when querying very many processes.
+#define NVQR_MULTI_MAX_IN_FLIGHT 256
+
+// The number of milliseconds to wait before retrying a connection that was
+// refused because the target's listen backlog was full.
+#define NVQR_MULTI_RETRY_MS 10
+
+
+static void report_result(pid_t pid, nvqrReturn_t result,
+                          const NVQRQueryData_t *data, int cnt,
+                          nvqrQueryCallback callback, void *user_data)
+{
+    char *name = nvqr_process_name_from_pid(pid);
+
+    callback(pid, name, result, data, cnt, user_data);
+    free(name);
+}
+
+
+#if defined(_WIN32)
+
+//------------------------------------------------------------------------------
+// Windows only supports blocking named pipe connections, so query each
+// process in turn.
+nvqrReturn_t nvqr_query_pids(const pid_t *pids, int count, GLenum queryType,
+                             int timeoutMs, nvqrQueryCallback callback,
+                             void *user_data)
+{
+    int i;
+
+    if (count < 0 || (count > 0 && (!pids || !callback))) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    for (i = 0; i < count; i++) {
+        NVQRConnection c;
+        NVQRQueryData_t *data = NULL;
+        int cnt = 0;
+        nvqrReturn_t result = nvqr_connect(&c, pids[i]);
+
+        if (result == NVQR_SUCCESS) {
+            result = nvqr_request_meminfo_alloc(c, queryType, &data, &cnt);
+            nvqr_disconnect(&c);
+        } else {
+            free(c.process_name);
+        }
+
+        report_result(pids[i], result, data, cnt, callback, user_data);
+        free(data);
+    }
+
+    return NVQR_SUCCESS;
+}
+
+#else
+
+typedef enum {
+    NVQR_MULTI_IDLE = 0,   // not started yet, or waiting to retry connect(2)
+    NVQR_MULTI_SENDING,    // writing the commands
+    NVQR_MULTI_RECEIVING,  // reading the responses
+    NVQR_MULTI_DONE
+} NVQRMultiState;
+
+//------------------------------------------------------------------------------
+// The state of the query of one process. Each process is queried with a
+// single NVQR_QUERY_ONESHOT command, which the server answers with the result
+// before closing the connection, so the query costs a single round trip.
+typedef struct {
+    pid_t pid;
+    int fd;
+    NVQRMultiState state;
+    long long started;
+    long long retry_time;
+    struct {
+        NVQRQueryCmdBuffer cmd;
+        GLenum queryType;
+    } cmd;
+    size_t bytes_sent;
+    NVQRBatchResult result;
+    NVQRResponseReader reader;
+} NVQRMultiQuery;
+
+
+static long long get_time_ms(void)
+{
+    return nvqr_ipc_get_time_us() / 1000;
+}
+
+
+static void finish_query(NVQRMultiQuery *q, nvqrReturn_t result,
+                         nvqrQueryCallback callback, void *user_data)
+{
+    if (q->fd != -1) {
+        close(q->fd);
+        q->fd = -1;
+    }
+
+    nvqr_record_request(NULL, result, q->started ? q->started : -1,
+                        q->bytes_sent,
+                        q->reader.header_bytes + q->reader.data_bytes);
+
+    if (result == NVQR_SUCCESS) {
+        report_result(q->pid, q->result.result, q->result.data, q->result.cnt,
+                      callback, user_data);
+    } else if (result == NVQR_ERROR_THROTTLED) {
+        report_result(q->pid, result, q->reader.data, q->reader.header.cnt,
+                      callback, user_data);
+    } else {
+        report_result(q->pid, result, NULL, 0, callback, user_data);
+    }
+
+    nvqr_reset_response_reader(&q->reader);
+    q->state = NVQR_MULTI_DONE;
+}
+
+
+//------------------------------------------------------------------------------
+// Start a non-blocking connection to the target process. Returns
+// NVQR_SUCCESS if the connection is underway; if the target's backlog is full,
+// the query is left idle to be retried later.
+static nvqrReturn_t start_query(NVQRMultiQuery *q, GLenum queryType)
+{
+    struct sockaddr_un addr;
+    int flags;
+
+    if (!q->started) {
+        q->started = nvqr_ipc_get_time_us();
+    }
+
+    q->fd = nvqr_ipc_socket();
+    if (q->fd == -1) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    flags = fcntl(q->fd, F_GETFL);
+    if (flags == -1 || fcntl(q->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    nvqr_ipc_get_socket_name(addr.sun_path, sizeof(addr.sun_path), q->pid);
+
+    if (connect(q->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 &&
+        errno != EINPROGRESS) {
+        if (errno == EAGAIN) {
+            close(q->fd);
+            q->fd = -1;
+            q->retry_time = get_time_ms() + NVQR_MULTI_RETRY_MS;
+            nvqr_count_client_stat(NULL, NVQR_CLIENT_STAT_RETRIES, 1);
+            return NVQR_SUCCESS;
+        }
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    memset(&q->cmd, 0, sizeof(q->cmd));
+    q->cmd.cmd.op = NVQR_QUERY_ONESHOT;
+    q->cmd.cmd.queryType = 1;
+    q->cmd.cmd.pid = getpid();
+    q->cmd.queryType = queryType;
+
+    q->state = NVQR_MULTI_SENDING;
+    return NVQR_SUCCESS;
+}
+
+
+//------------------------------------------------------------------------------
+// Make progress on a query without blocking. Returns NVQR_SUCCESS once the
+// query result has been received, NVQR_IN_PROGRESS if the query needs to
+// wait for its socket, or an error.
+static nvqrReturn_t service_query(NVQRMultiQuery *q)
+{
+    nvqrReturn_t result;
+    ssize_t ret;
+
+    while (q->state == NVQR_MULTI_SENDING) {
+        ret = nvqr_ipc_send(q->fd, (char *) &q->cmd + q->bytes_sent,
+                            sizeof(q->cmd) - q->bytes_sent);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return NVQR_IN_PROGRESS;
+            }
+            // A refused connection has been answered and shut down
+            if (errno != EPIPE) {
+                return errno == ECONNREFUSED ? NVQR_ERROR_NOT_SUPPORTED
+                                             : NVQR_ERROR_UNKNOWN;
+            }
+            q->state = NVQR_MULTI_RECEIVING;
+            break;
+        }
+
+        q->bytes_sent += ret;
+        if (q->bytes_sent == sizeof(q->cmd)) {
+            q->state = NVQR_MULTI_RECEIVING;
+        }
+    }
+
+    result = nvqr_read_response_async(q->fd, &q->reader);
+    if (result != NVQR_SUCCESS) {
+        return result;
+    }
+
+    if (q->reader.header.op == NVQR_QUERY_THROTTLED &&
+        q->reader.header.cnt >= 1) {
+        return NVQR_ERROR_THROTTLED;
+    }
+    if (q->reader.header.op != NVQR_QUERY_ONESHOT) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    return nvqr_decode_batch_response(q->reader.data, q->reader.header.cnt,
+                                      &q->cmd.queryType, 1,
+                                      &q->result);
+}
+
+
+nvqrReturn_t nvqr_query_pids(const pid_t *pids, int count, GLenum queryType,
+                             int timeoutMs, nvqrQueryCallback callback,
+                             void *user_data)
+{
+    NVQRMultiQuery *queries;
+    struct pollfd *fds;
+    int *fd_queries;
+    int next = 0, active = 0, done = 0, i;
+    long long deadline = timeoutMs >= 0 ? get_time_ms() + timeoutMs : -1;
+
+    if (count < 0 || (count > 0 && (!pids || !callback))) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    queries = calloc(count + 1, sizeof(*queries));
+    fds = calloc(NVQR_MULTI_MAX_IN_FLIGHT, sizeof(*fds));
+    fd_queries = calloc(NVQR_MULTI_MAX_IN_FLIGHT, sizeof(*fd_queries));
+    if (!queries || !fds || !fd_queries) {
+        free(queries);
+        free(fds);
+        free(fd_queries);
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    for (i = 0; i < count; i++) {
+        queries[i].pid = pids[i];
+        queries[i].fd = -1;
+    }
+
+    while (done < count) {
+        long long now = get_time_ms(), wake = deadline;
+        int nfds = 0, timeout;
+
+        // Start new queries while there is room, and retry refused ones
+        for (i = 0; i < count; i++) {
+            NVQRMultiQuery *q = &queries[i];
+            nvqrReturn_t result;
+
+            if (q->state != NVQR_MULTI_IDLE) {
+                continue;
+            }
+            if (i >= next) {
+                if (active >= NVQR_MULTI_MAX_IN_FLIGHT) {
+                    break;
+                }
+                next = i + 1;
+                active++;
+            } else if (q->retry_time > now) {
+                if (wake < 0 || q->retry_time < wake) {
+                    wake = q->retry_time;
+                }
+                continue;
+            }
+
+            result = start_query(q, queryType);
+            if (result != NVQR_SUCCESS) {
+                finish_query(q, result, callback, user_data);
+                active--;
+                done++;
+            } else if (q->state == NVQR_MULTI_IDLE &&
+                       (wake < 0 || q->retry_time < wake)) {
+                wake = q->retry_time;
+            }
+        }
+
+        for (i = 0; i < next; i++) {
+            NVQRMultiQuery *q = &queries[i];
+
+            if (q->state == NVQR_MULTI_SENDING ||
+                q->state == NVQR_MULTI_RECEIVING) {
+                fds[nfds].fd = q->fd;
+                fds[nfds].events = q->state == NVQR_MULTI_SENDING ?
+                                   POLLOUT : POLLIN;
+                fd_queries[nfds] = i;
+                nfds++;
+            }
+        }
+
+        if (done == count) {
+            break;
+        }
+
+        if (deadline >= 0 && now >= deadline) {
+            // Out of time: fail everything that is still outstanding
+            for (i = 0; i < count; i++) {
+                if (queries[i].state != NVQR_MULTI_DONE) {
+                    finish_query(&queries[i], NVQR_ERROR_TIMEOUT,
+                                 callback, user_data);
+                    done++;
+                }
+            }
+            break;
+        }
+
+        timeout = wake < 0 ? -1 : (int) (wake > now ? wake - now : 0);
+        if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            NVQRMultiQuery *q = &queries[fd_queries[i]];
+            nvqrReturn_t result;
+
+            if (!fds[i].revents) {
+                continue;
+            }
+
+            result = service_query(q);
+            if (result != NVQR_IN_PROGRESS) {
+                finish_query(q, result, callback, user_data);
+                active--;
+                done++;
+            }
+        }
+    }
+
+    // Only reached with queries outstanding if poll(2) itself failed
+    for (i = 0; i < count; i++) {
+        if (queries[i].state != NVQR_MULTI_DONE) {
+            finish_query(&queries[i], NVQR_ERROR_UNKNOWN, callback,
+                         user_data);
+        }
+    }
+
+    free(queries);
+    free(fds);
+    free(fd_queries);
+
+    return NVQR_SUCCESS;
+}
+
+#endif // _WIN32
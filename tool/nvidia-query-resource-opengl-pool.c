@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <stdbool.h>
+#include <poll.h>
+#include <pthread.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+#if defined(_WIN32)
+
+// Windows only supports one client connection per OpenGL process, which
+// leaves nothing to pool
+
+nvqrReturn_t nvqr_pool_create(NVQRPool **pool, int maxIdleMs)
+{
+    *pool = NULL;
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+void nvqr_pool_destroy(NVQRPool *pool)
+{
+}
+
+nvqrReturn_t nvqr_pool_acquire(NVQRPool *pool, pid_t pid,
+                               NVQRConnection **connection)
+{
+    *connection = NULL;
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+void nvqr_pool_release(NVQRPool *pool, NVQRConnection *connection,
+                       nvqrReturn_t result)
+{
+}
+
+int nvqr_pool_evict(NVQRPool *pool)
+{
+    return 0;
+}
+
+#else
+
+// Pooled connections are kept in a hash table of pids
+#define NVQR_POOL_BUCKETS 1024
+
+//------------------------------------------------------------------------------
+// A pooled connection. The connection comes first, so that the pointer handed
+// out to callers is also a pointer to the entry.
+typedef struct NVQRPoolEntryRec {
+    NVQRConnection connection;
+    unsigned long long startTime;
+    long long lastUsedUs;
+    bool in_use;
+    bool stale;
+    struct NVQRPoolEntryRec *next;      // in the hash bucket
+    struct NVQRPoolEntryRec *next_out;  // in a list of entries being checked
+                                        // or closed
+} NVQRPoolEntry;
+
+struct NVQRPoolRec {
+    pthread_mutex_t lock;
+    long long maxIdleUs;
+    NVQRPoolEntry *buckets[NVQR_POOL_BUCKETS];
+};
+
+
+static NVQRPoolEntry **get_bucket(NVQRPool *pool, pid_t pid)
+{
+    return &pool->buckets[(unsigned int) pid % NVQR_POOL_BUCKETS];
+}
+
+
+static void unlink_entry(NVQRPool *pool, NVQRPoolEntry *entry)
+{
+    NVQRPoolEntry **link = get_bucket(pool, entry->connection.pid);
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+}
+
+
+//------------------------------------------------------------------------------
+// Close a list of connections removed from the pool. Connections that are
+// known to be healthy are disconnected properly; the others are just dropped,
+// since the server may be gone or the stream out of step.
+static void close_entries(NVQRPoolEntry *entries, bool healthy)
+{
+    while (entries) {
+        NVQRPoolEntry *next = entries->next_out;
+
+        if (!healthy || nvqr_disconnect(&entries->connection) != NVQR_SUCCESS) {
+            nvqr_abandon_connection(&entries->connection);
+        }
+        free(entries);
+        entries = next;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Check that an idle connection is still usable: the process at the other end
+// must be the one it was opened to, and the server must not have closed the
+// connection. An idle connection has nothing to read, so any poll(2) event
+// means that it is gone.
+static bool entry_is_healthy(const NVQRPoolEntry *entry,
+                             const NVQRProcessInfo *info)
+{
+    struct pollfd pfd;
+
+    if (info->startTime != entry->startTime) {
+        return false;
+    }
+
+    pfd.fd = entry->connection.server_handle;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) == 0;
+}
+
+
+nvqrReturn_t nvqr_pool_create(NVQRPool **pool, int maxIdleMs)
+{
+    *pool = calloc(1, sizeof(**pool));
+    if (!*pool) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    pthread_mutex_init(&(*pool)->lock, NULL);
+    (*pool)->maxIdleUs = maxIdleMs < 0 ? -1 : maxIdleMs * 1000LL;
+
+    return NVQR_SUCCESS;
+}
+
+
+void nvqr_pool_destroy(NVQRPool *pool)
+{
+    NVQRPoolEntry *entries = NULL;
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    for (i = 0; i < NVQR_POOL_BUCKETS; i++) {
+        NVQRPoolEntry *entry, *next;
+
+        for (entry = pool->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            entry->next_out = entries;
+            entries = entry;
+        }
+    }
+
+    close_entries(entries, true);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+
+nvqrReturn_t nvqr_pool_acquire(NVQRPool *pool, pid_t pid,
+                               NVQRConnection **connection)
+{
+    NVQRPoolEntry *entry, *next, *stale = NULL;
+    NVQRProcessInfo info;
+    nvqrReturn_t ret;
+    bool alive;
+
+    *connection = NULL;
+
+    // Outside of Linux, the start time is always 0, so only the health of
+    // the connection itself is checked
+    alive = nvqr_get_process_info(pid, &info) == NVQR_SUCCESS;
+
+    pthread_mutex_lock(&pool->lock);
+    for (entry = *get_bucket(pool, pid); entry; entry = next) {
+        next = entry->next;
+
+        if (entry->connection.pid != pid || entry->in_use) {
+            continue;
+        }
+
+        if (!alive || !entry_is_healthy(entry, &info)) {
+            unlink_entry(pool, entry);
+            entry->next_out = stale;
+            stale = entry;
+            continue;
+        }
+
+        entry->in_use = true;
+        entry->lastUsedUs = nvqr_ipc_get_time_us();
+        pthread_mutex_unlock(&pool->lock);
+
+        close_entries(stale, false);
+        *connection = &entry->connection;
+        return NVQR_SUCCESS;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    close_entries(stale, false);
+    if (!alive) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    // No idle connection to this process: open a new one
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    ret = nvqr_connect(&entry->connection, pid);
+    if (ret != NVQR_SUCCESS) {
+        free(entry->connection.process_name);
+        free(entry);
+        return ret;
+    }
+
+    entry->startTime = info.startTime;
+    entry->lastUsedUs = nvqr_ipc_get_time_us();
+    entry->in_use = true;
+
+    pthread_mutex_lock(&pool->lock);
+    entry->next = *get_bucket(pool, pid);
+    *get_bucket(pool, pid) = entry;
+    pthread_mutex_unlock(&pool->lock);
+
+    *connection = &entry->connection;
+    return NVQR_SUCCESS;
+}
+
+
+void nvqr_pool_release(NVQRPool *pool, NVQRConnection *connection,
+                       nvqrReturn_t result)
+{
+    NVQRPoolEntry *entry = (NVQRPoolEntry *) connection;
+
+    if (!connection) {
+        return;
+    }
+
+    // After an error, the connection may be out of step with the server
+    if (result != NVQR_SUCCESS && result != NVQR_ERROR_INSUFFICIENT_BUFFER &&
+        result != NVQR_ERROR_INVALID_ARGUMENT &&
+        result != NVQR_ERROR_NOT_SUPPORTED &&
+        result != NVQR_ERROR_THROTTLED) {
+        pthread_mutex_lock(&pool->lock);
+        unlink_entry(pool, entry);
+        pthread_mutex_unlock(&pool->lock);
+
+        entry->next_out = NULL;
+        close_entries(entry, false);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    entry->in_use = false;
+    entry->lastUsedUs = nvqr_ipc_get_time_us();
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+int nvqr_pool_evict(NVQRPool *pool)
+{
+    NVQRPoolEntry *checking = NULL, *expired = NULL, *stale = NULL;
+    NVQRPoolEntry *entry, *next;
+    long long now = nvqr_ipc_get_time_us();
+    int evicted = 0, i;
+
+    // Take the idle connections out of circulation while they are checked,
+    // so that the lock is not held while looking up their processes
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < NVQR_POOL_BUCKETS; i++) {
+        for (entry = pool->buckets[i]; entry; entry = next) {
+            next = entry->next;
+
+            if (entry->in_use) {
+                continue;
+            }
+
+            if (pool->maxIdleUs >= 0 &&
+                now - entry->lastUsedUs > pool->maxIdleUs) {
+                unlink_entry(pool, entry);
+                entry->next_out = expired;
+                expired = entry;
+                evicted++;
+            } else {
+                entry->in_use = true;
+                entry->next_out = checking;
+                checking = entry;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (entry = checking; entry; entry = entry->next_out) {
+        NVQRProcessInfo info;
+
+        entry->stale = nvqr_get_process_info(entry->connection.pid, &info) !=
+                       NVQR_SUCCESS || !entry_is_healthy(entry, &info);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (entry = checking; entry; entry = next) {
+        next = entry->next_out;
+
+        if (entry->stale) {
+            unlink_entry(pool, entry);
+            entry->next_out = stale;
+            stale = entry;
+            evicted++;
+        } else {
+            entry->in_use = false;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    close_entries(expired, true);
+    close_entries(stale, false);
+
+    return evicted;
+}
+
+#endif // _WIN32
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux)
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+#if defined(__linux)
+
+// The cache is a hash table of pids, which is emptied whenever it fills up;
+// entries for processes that have exited are thereby dropped eventually.
+#define NVQR_PROCESS_CACHE_BUCKETS 1024
+#define NVQR_PROCESS_CACHE_MAX_ENTRIES 4096
+
+typedef struct NVQRProcessEntryRec {
+    struct NVQRProcessEntryRec *next;
+    NVQRProcessInfo info;
+} NVQRProcessEntry;
+
+static NVQRProcessEntry *cache[NVQR_PROCESS_CACHE_BUCKETS];
+static int cache_entries;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+//------------------------------------------------------------------------------
+// Read a file under /proc/<pid>/ into buf, NUL terminating it. Files in /proc
+// are generated in full on the first read, so a single read(2) with a large
+// enough buffer gets all of it. Returns the number of bytes read, or -1.
+static ssize_t read_proc_file(pid_t pid, const char *file, char *buf,
+                              size_t size)
+{
+    char path[64];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%ld/%s", (long) pid, file);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    do {
+        len = read(fd, buf, size - 1);
+    } while (len < 0 && errno == EINTR);
+    close(fd);
+
+    if (len >= 0) {
+        buf[len] = '\0';
+    }
+    return len;
+}
+
+
+static void copy_string(char *dest, size_t size, const char *src, size_t len)
+{
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+
+//------------------------------------------------------------------------------
+// Get the name and the start time of a process from /proc/<pid>/stat:
+//   pid (comm) state ppid ... starttime ...
+// where starttime is the 22nd field. The name may itself contain spaces and
+// parentheses, so the fields are counted from the last ')'.
+static int read_stat(pid_t pid, NVQRProcessInfo *info)
+{
+    char buf[1024], *open_paren, *close_paren, *ptr;
+    int field;
+
+    if (read_proc_file(pid, "stat", buf, sizeof(buf)) <= 0) {
+        return 0;
+    }
+
+    open_paren = strchr(buf, '(');
+    close_paren = strrchr(buf, ')');
+    if (!open_paren || !close_paren || close_paren < open_paren) {
+        return 0;
+    }
+
+    copy_string(info->comm, sizeof(info->comm), open_paren + 1,
+                close_paren - open_paren - 1);
+
+    // ptr is at the space before each field in turn, starting with the state
+    // in field 3
+    ptr = close_paren + 1;
+    for (field = 3; field < 22 && ptr; field++) {
+        ptr = strchr(ptr + 1, ' ');
+    }
+    if (!ptr) {
+        return 0;
+    }
+
+    info->startTime = strtoull(ptr + 1, NULL, 10);
+    return 1;
+}
+
+
+//------------------------------------------------------------------------------
+// Fill in the rest of the metadata of a process, with one read of each file.
+static void read_metadata(pid_t pid, NVQRProcessInfo *info)
+{
+    char buf[4096], *ptr, *end, *best = NULL;
+    size_t best_len = 0;
+    ssize_t len;
+
+    // argv[0] is the first NUL terminated string of the command line
+    len = read_proc_file(pid, "cmdline", buf, sizeof(buf));
+    if (len > 0) {
+        ptr = strrchr(buf, '/');
+        ptr = ptr ? ptr + 1 : buf;
+        copy_string(info->name, sizeof(info->name), ptr, strlen(ptr));
+    }
+
+    len = read_proc_file(pid, "status", buf, sizeof(buf));
+    if (len > 0 && (ptr = strstr(buf, "\nUid:"))) {
+        info->uid = strtol(ptr + 5, NULL, 10);
+    }
+
+    // Each line is hierarchy-ID:controllers:path. Prefer the path in the
+    // unified (v2) hierarchy, unless it is just the root, as in hybrid setups
+    // where the v1 hierarchies tell more.
+    len = read_proc_file(pid, "cgroup", buf, sizeof(buf));
+    for (ptr = buf; len > 0 && *ptr; ptr = *end ? end + 1 : end) {
+        char *path;
+
+        end = strchr(ptr, '\n');
+        if (!end) {
+            end = ptr + strlen(ptr);
+        }
+
+        path = memchr(ptr, ':', end - ptr);
+        path = path ? memchr(path + 1, ':', end - path - 1) : NULL;
+        if (!path) {
+            continue;
+        }
+        path++;
+
+        if (!best || (end - path > 1 && (best_len <= 1 ||
+                                         strncmp(ptr, "0::", 3) == 0))) {
+            best = path;
+            best_len = end - path;
+        }
+    }
+    if (best) {
+        copy_string(info->cgroup, sizeof(info->cgroup), best, best_len);
+    }
+}
+
+
+nvqrReturn_t nvqr_get_process_info(pid_t pid, NVQRProcessInfo *info)
+{
+    NVQRProcessEntry *entry;
+    unsigned int bucket = (unsigned int) pid % NVQR_PROCESS_CACHE_BUCKETS;
+
+    memset(info, 0, sizeof(*info));
+    info->pid = pid;
+    info->uid = -1;
+
+    if (pid <= 0 || !read_stat(pid, info)) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (entry = cache[bucket]; entry; entry = entry->next) {
+        if (entry->info.pid == pid) {
+            break;
+        }
+    }
+    if (entry && entry->info.startTime == info->startTime) {
+        *info = entry->info;
+        pthread_mutex_unlock(&cache_lock);
+        return NVQR_SUCCESS;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // A new process, or a reused pid: read the rest without holding the lock
+    read_metadata(pid, info);
+
+    pthread_mutex_lock(&cache_lock);
+    for (entry = cache[bucket]; entry; entry = entry->next) {
+        if (entry->info.pid == pid) {
+            break;
+        }
+    }
+    if (!entry) {
+        if (cache_entries >= NVQR_PROCESS_CACHE_MAX_ENTRIES) {
+            pthread_mutex_unlock(&cache_lock);
+            nvqr_clear_process_cache();
+            pthread_mutex_lock(&cache_lock);
+        }
+
+        entry = malloc(sizeof(*entry));
+        if (entry) {
+            entry->next = cache[bucket];
+            cache[bucket] = entry;
+            cache_entries++;
+        }
+    }
+    if (entry) {
+        entry->info = *info;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return NVQR_SUCCESS;
+}
+
+
+void nvqr_clear_process_cache(void)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < NVQR_PROCESS_CACHE_BUCKETS; i++) {
+        while (cache[i]) {
+            NVQRProcessEntry *entry = cache[i];
+
+            cache[i] = entry->next;
+            free(entry);
+        }
+    }
+    cache_entries = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+#else
+
+nvqrReturn_t nvqr_get_process_info(pid_t pid, NVQRProcessInfo *info)
+{
+    char *name = nvqr_process_name_from_pid(pid);
+
+    memset(info, 0, sizeof(*info));
+    info->pid = pid;
+    info->uid = -1;
+
+    if (!name) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    strncpy(info->name, name, sizeof(info->name) - 1);
+    strncpy(info->comm, name, sizeof(info->comm) - 1);
+    free(name);
+
+    return NVQR_SUCCESS;
+}
+
+
+void nvqr_clear_process_cache(void)
+{
+}
+
+#endif // __linux
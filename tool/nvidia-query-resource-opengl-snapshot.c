@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Shared snapshots: query results read from memory shared with the preload
+// DSO, rather than from its socket.
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+#if defined(_WIN32)
+
+// The driver's server on Windows only answers over its named pipes
+
+nvqrReturn_t nvqr_map_snapshot(NVQRConnection *connection, GLenum queryType,
+                               int intervalMs, NVQRSnapshot **snapshot)
+{
+    *snapshot = NULL;
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+nvqrReturn_t nvqr_read_snapshot(NVQRSnapshot *snapshot,
+                                NVQRQueryData_t *data, int maxCnt,
+                                NVQRSnapshotInfo *info)
+{
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+void nvqr_unmap_snapshot(NVQRSnapshot *snapshot)
+{
+}
+
+#else
+
+// How many times to retry reading a snapshot that is being written before
+// yielding the processor to the writer
+#define NVQR_SNAPSHOT_SPINS 64
+
+struct NVQRSnapshotRec {
+    int fd;
+    const NVQRSnapshotHeader *header;
+    size_t size;
+};
+
+// A map command and the sampling interval that follows it
+typedef struct {
+    NVQRQueryCmdBuffer cmd;
+    int intervalMs;
+} NVQRMapSnapshotCmd;
+
+
+//------------------------------------------------------------------------------
+// Map the whole of a snapshot's shared memory, which may have grown since it
+// was last mapped. Returns false on failure, leaving the old mapping in place.
+static bool map_region(NVQRSnapshot *snapshot)
+{
+    struct stat st;
+    void *header;
+
+    if (fstat(snapshot->fd, &st) < 0 ||
+        st.st_size < (off_t) sizeof(NVQRSnapshotHeader)) {
+        return false;
+    }
+
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, snapshot->fd, 0);
+    if (header == MAP_FAILED) {
+        return false;
+    }
+
+    if (snapshot->header) {
+        munmap((void *) snapshot->header, snapshot->size);
+    }
+    snapshot->header = header;
+    snapshot->size = st.st_size;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Read a response header, and the descriptor passed along with it, if any,
+// into *fd (-1 if none).
+static bool read_header(int socket, NVQRQueryResponseHeader *header, int *fd)
+{
+    size_t received = 0;
+
+    *fd = -1;
+
+    while (received < sizeof(*header)) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        ssize_t ret;
+
+        iov.iov_base = (char *) header + received;
+        iov.iov_len = sizeof(*header) - received;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ret = recvmsg(socket, &msg, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        received += ret;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS && *fd < 0) {
+                memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+            }
+        }
+    }
+
+    if (received < sizeof(*header)) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Send a map command for queryType, and read the response to it, along with
+// the descriptor of the snapshot. The data of the response, a single word if
+// the command was throttled, is discarded.
+static nvqrReturn_t request_map(NVQRConnection *connection, GLenum queryType,
+                                int intervalMs, int *fd, size_t *received)
+{
+    NVQRMapSnapshotCmd command;
+    NVQRQueryResponseHeader header;
+    NVQRQueryData_t word;
+    size_t sent;
+    ssize_t ret;
+    int i;
+
+    memset(&command, 0, sizeof(command));
+    command.cmd.op = NVQR_QUERY_MAP_SNAPSHOT;
+    command.cmd.queryType = queryType;
+    command.intervalMs = intervalMs;
+
+    for (sent = 0; sent < sizeof(command); sent += ret) {
+        ret = nvqr_ipc_send(connection->server_handle,
+                            (char *) &command + sent, sizeof(command) - sent);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        } else if (ret <= 0) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+    }
+
+    if (!read_header(connection->server_handle, &header, fd)) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+    *received = sizeof(header);
+
+    for (i = 0; i < header.cnt; i++) {
+        if (read(connection->server_handle, &word, sizeof(word)) !=
+            sizeof(word)) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+        *received += sizeof(word);
+    }
+
+    if (header.op == NVQR_QUERY_THROTTLED) {
+        return NVQR_ERROR_THROTTLED;
+    }
+
+    return header.op == NVQR_QUERY_MAP_SNAPSHOT && *fd >= 0 ?
+           NVQR_SUCCESS : NVQR_ERROR_UNKNOWN;
+}
+
+
+nvqrReturn_t nvqr_map_snapshot(NVQRConnection *connection, GLenum queryType,
+                               int intervalMs, NVQRSnapshot **snapshot)
+{
+    long long start = nvqr_ipc_get_time_us();
+    size_t received = 0;
+    nvqrReturn_t ret;
+    int fd = -1;
+
+    *snapshot = NULL;
+
+    if (intervalMs < 0 || connection->async || connection->pipeline ||
+        (connection->delta && connection->delta->subscribed)) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    ret = request_map(connection, queryType, intervalMs, &fd, &received);
+    if (ret == NVQR_SUCCESS) {
+        *snapshot = calloc(1, sizeof(**snapshot));
+        ret = NVQR_ERROR_UNKNOWN;
+    }
+    if (*snapshot) {
+        (*snapshot)->fd = fd;
+        if (map_region(*snapshot) &&
+            (*snapshot)->header->magic == NVQR_SNAPSHOT_MAGIC &&
+            (*snapshot)->header->queryType == (int) queryType) {
+            ret = NVQR_SUCCESS;
+        } else {
+            nvqr_unmap_snapshot(*snapshot);
+            *snapshot = NULL;
+            fd = -1;
+        }
+    }
+    if (ret != NVQR_SUCCESS && fd >= 0) {
+        close(fd);
+    }
+
+    nvqr_record_request(connection->stats, ret, start,
+                        sizeof(NVQRMapSnapshotCmd), received);
+    return ret;
+}
+
+
+nvqrReturn_t nvqr_read_snapshot(NVQRSnapshot *snapshot,
+                                NVQRQueryData_t *data, int maxCnt,
+                                NVQRSnapshotInfo *info)
+{
+    unsigned int before;
+    long long timestampUs, age;
+    int cnt, spins;
+
+    memset(info, 0, sizeof(*info));
+
+    for (spins = 1; ; spins++) {
+        const NVQRSnapshotHeader *header = snapshot->header;
+        size_t size = snapshot->size;
+
+        before = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        if (before == 0) {
+            return NVQR_IN_PROGRESS;
+        }
+        if (before & 1) {
+            // Give the writer a chance to finish, should it have been
+            // preempted in the middle of writing
+            if (spins % NVQR_SNAPSHOT_SPINS == 0) {
+                sched_yield();
+            }
+            continue;
+        }
+
+        cnt = __atomic_load_n(&header->cnt, __ATOMIC_RELAXED);
+        timestampUs = __atomic_load_n(&header->timestampUs, __ATOMIC_RELAXED);
+
+        if (maxCnt > 0 && cnt >= 0 && cnt <= NVQR_MAX_RESPONSE_LEN &&
+            sizeof(*header) + cnt * sizeof(*data) <= size) {
+            memcpy(data, header + 1,
+                   (cnt < maxCnt ? cnt : maxCnt) * sizeof(*data));
+        }
+
+        // The copy is only consistent if nothing was written in the meantime
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) != before) {
+            continue;
+        }
+
+        if (cnt < 0 || cnt > NVQR_MAX_RESPONSE_LEN) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+        if (sizeof(*header) + cnt * sizeof(*data) <= size) {
+            break;
+        }
+
+        // The result has outgrown the mapping
+        if (!map_region(snapshot) || snapshot->size == size) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+    }
+
+    age = nvqr_ipc_get_time_us() - timestampUs;
+    info->cnt = cnt;
+    info->generation = before / 2;
+    info->sampleAgeUs = age < 0 ? 0 : age < INT_MAX ? (int) age : INT_MAX;
+
+    return cnt <= maxCnt ? NVQR_SUCCESS : NVQR_ERROR_INSUFFICIENT_BUFFER;
+}
+
+
+void nvqr_unmap_snapshot(NVQRSnapshot *snapshot)
+{
+    if (!snapshot) {
+        return;
+    }
+
+    if (snapshot->header) {
+        munmap((void *) snapshot->header, snapshot->size);
+    }
+    close(snapshot->fd);
+    free(snapshot);
+}
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+
+// The client statistics are kept in words that can be updated atomically
+// without locks: 64-bit interlocked words on Windows, and native words
+// elsewhere, where 64-bit atomics may need a lock on 32-bit platforms.
+
+#if defined(_WIN32)
+typedef LONG64 nvqr_stat_t;
+
+static void stat_add(volatile nvqr_stat_t *stat, unsigned long n)
+{
+    InterlockedExchangeAdd64(stat, (LONG64) n);
+}
+
+static unsigned long long stat_take(volatile nvqr_stat_t *stat, int reset)
+{
+    return (unsigned long long) (reset ? InterlockedExchange64(stat, 0) :
+                                 InterlockedCompareExchange64(stat, 0, 0));
+}
+
+static void stat_raise(volatile nvqr_stat_t *stat, unsigned long long value)
+{
+    LONG64 max = InterlockedCompareExchange64(stat, 0, 0), seen;
+
+    while ((LONG64) value > max &&
+           (seen = InterlockedCompareExchange64(stat, (LONG64) value,
+                                                max)) != max) {
+        max = seen;
+    }
+}
+#else
+typedef unsigned long nvqr_stat_t;
+
+static void stat_add(volatile nvqr_stat_t *stat, unsigned long n)
+{
+    __atomic_fetch_add(stat, n, __ATOMIC_RELAXED);
+}
+
+static unsigned long long stat_take(volatile nvqr_stat_t *stat, int reset)
+{
+    return reset ? __atomic_exchange_n(stat, 0, __ATOMIC_RELAXED) :
+                   __atomic_load_n(stat, __ATOMIC_RELAXED);
+}
+
+static void stat_raise(volatile nvqr_stat_t *stat, unsigned long long value)
+{
+    nvqr_stat_t max = __atomic_load_n(stat, __ATOMIC_RELAXED);
+
+    while (value > max &&
+           !__atomic_compare_exchange_n(stat, &max, (nvqr_stat_t) value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+#endif
+
+typedef struct {
+    nvqr_stat_t count;
+    nvqr_stat_t sum;
+    nvqr_stat_t max;
+    nvqr_stat_t buckets[NVQR_HIST_BUCKETS];
+} NVQRClientHistogram;
+
+struct NVQRClientStatsRec {
+    nvqr_stat_t counters[NVQR_NUM_CLIENT_STATS];
+    NVQRClientHistogram histograms[NVQR_NUM_CLIENT_HISTOGRAMS];
+};
+
+static struct NVQRClientStatsRec process_stats;
+static nvqr_stat_t per_connection;
+
+
+static void count_stat(struct NVQRClientStatsRec *stats,
+                       NVQRClientStatCounter counter, unsigned long n)
+{
+    stat_add(&stats->counters[counter], n);
+}
+
+
+static void record_time(struct NVQRClientStatsRec *stats,
+                        NVQRClientStatHistogram histogram, long long us)
+{
+    NVQRClientHistogram *h = &stats->histograms[histogram];
+
+    if (us < 0) {
+        us = 0;
+    }
+
+    stat_add(&h->count, 1);
+    stat_add(&h->sum, (unsigned long) us);
+    stat_add(&h->buckets[nvqr_ipc_histogram_bucket(us)], 1);
+    stat_raise(&h->max, us);
+}
+
+
+static void take_stats(struct NVQRClientStatsRec *from, NVQRClientStats *to,
+                       int reset)
+{
+    int i, j;
+
+    for (i = 0; i < NVQR_NUM_CLIENT_STATS; i++) {
+        to->counters[i] = stat_take(&from->counters[i], reset);
+    }
+
+    for (i = 0; i < NVQR_NUM_CLIENT_HISTOGRAMS; i++) {
+        NVQRClientHistogram *h = &from->histograms[i];
+        NVQRHistogram *out = &to->histograms[i];
+
+        out->count = stat_take(&h->count, reset);
+        out->sumUs = stat_take(&h->sum, reset);
+        out->maxUs = stat_take(&h->max, reset);
+        for (j = 0; j < NVQR_HIST_BUCKETS; j++) {
+            out->buckets[j] = stat_take(&h->buckets[j], reset);
+        }
+    }
+}
+
+
+struct NVQRClientStatsRec *nvqr_new_connection_stats(void)
+{
+    return stat_take(&per_connection, 0) ?
+           calloc(1, sizeof(struct NVQRClientStatsRec)) : NULL;
+}
+
+
+void nvqr_free_connection_stats(struct NVQRClientStatsRec *stats)
+{
+    free(stats);
+}
+
+
+void nvqr_count_client_stat(struct NVQRClientStatsRec *stats,
+                            NVQRClientStatCounter counter, unsigned long n)
+{
+    count_stat(&process_stats, counter, n);
+    if (stats) {
+        count_stat(stats, counter, n);
+    }
+}
+
+
+static void record_command(struct NVQRClientStatsRec *stats,
+                           NVQRClientStatCounter counter,
+                           NVQRClientStatHistogram histogram, long long us,
+                           size_t sent, size_t received)
+{
+    struct NVQRClientStatsRec *all[2];
+    int i;
+
+    all[0] = &process_stats;
+    all[1] = stats;
+
+    for (i = 0; i < 2 && all[i]; i++) {
+        count_stat(all[i], counter, 1);
+        count_stat(all[i], NVQR_CLIENT_STAT_BYTES_SENT, (unsigned long) sent);
+        count_stat(all[i], NVQR_CLIENT_STAT_BYTES_RECEIVED,
+                   (unsigned long) received);
+        if (us >= 0) {
+            record_time(all[i], histogram, us);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Count the failures that have counters of their own.
+static void count_outcome(struct NVQRClientStatsRec *stats,
+                          nvqrReturn_t result)
+{
+    if (result == NVQR_ERROR_TIMEOUT) {
+        nvqr_count_client_stat(stats, NVQR_CLIENT_STAT_TIMEOUTS, 1);
+    } else if (result == NVQR_ERROR_THROTTLED) {
+        nvqr_count_client_stat(stats, NVQR_CLIENT_STAT_THROTTLED, 1);
+    }
+}
+
+
+void nvqr_record_request(struct NVQRClientStatsRec *stats,
+                         nvqrReturn_t result, long long startUs,
+                         size_t sent, size_t received)
+{
+    long long us = startUs < 0 ? -1 : nvqr_ipc_get_time_us() - startUs;
+
+    record_command(stats, NVQR_CLIENT_STAT_REQUESTS,
+                   NVQR_CLIENT_HIST_ROUND_TRIP, us, sent, received);
+
+    // Running out of buffer space is not a failure of the request
+    if (result != NVQR_SUCCESS && result != NVQR_ERROR_INSUFFICIENT_BUFFER) {
+        nvqr_count_client_stat(stats, NVQR_CLIENT_STAT_FAILURES, 1);
+        count_outcome(stats, result);
+    }
+}
+
+
+void nvqr_record_connect(struct NVQRClientStatsRec *stats,
+                         nvqrReturn_t result, long long startUs,
+                         size_t sent, size_t received)
+{
+    if (result == NVQR_SUCCESS) {
+        record_command(stats, NVQR_CLIENT_STAT_CONNECTS,
+                       NVQR_CLIENT_HIST_CONNECT,
+                       nvqr_ipc_get_time_us() - startUs, sent, received);
+    } else {
+        record_command(stats, NVQR_CLIENT_STAT_CONNECT_FAILURES,
+                       NVQR_CLIENT_HIST_CONNECT, -1, sent, received);
+        count_outcome(stats, result);
+    }
+}
+
+
+void nvqr_get_client_stats(NVQRClientStats *stats, int reset)
+{
+    take_stats(&process_stats, stats, reset);
+}
+
+
+void nvqr_enable_connection_stats(int enable)
+{
+#if defined(_WIN32)
+    InterlockedExchange64(&per_connection, enable != 0);
+#else
+    __atomic_store_n(&per_connection, enable != 0, __ATOMIC_RELAXED);
+#endif
+}
+
+
+nvqrReturn_t nvqr_get_connection_stats(NVQRConnection connection,
+                                       NVQRClientStats *stats, int reset)
+{
+    if (!connection.stats) {
+        memset(stats, 0, sizeof(*stats));
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    take_stats(connection.stats, stats, reset);
+    return NVQR_SUCCESS;
+}
+
+
+double nvqr_histogram_percentile(const NVQRHistogram *histogram,
+                                 double percentile)
+{
+    unsigned long long seen = 0;
+    double rank;
+    int i;
+
+    if (!histogram->count) {
+        return 0;
+    }
+
+    rank = histogram->count * (percentile < 0 ? 0 : percentile > 100 ? 100 :
+                               percentile) / 100;
+
+    for (i = 0; i < NVQR_HIST_BUCKETS - 1; i++) {
+        seen += histogram->buckets[i];
+        if (seen && seen >= rank) {
+            double upper = nvqr_ipc_histogram_bucket_min(i + 1) - 1;
+
+            return upper < histogram->maxUs ? upper : histogram->maxUs;
+        }
+    }
+
+    return histogram->maxUs;
+}
+
+
+#if !defined(_WIN32)
+
+static unsigned long long get_value(const NVQRQueryData_t *data)
+{
+    return (unsigned int) data[0] |
+           (unsigned long long) (unsigned int) data[1] << 32;
+}
+
+
+nvqrReturn_t nvqr_decode_stats(const NVQRQueryData_t *data, int cnt,
+                               NVQRServerStats *stats)
+{
+    int numStats, numHistograms, numBuckets, i, j;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (cnt < 4 || data[0] != NVQR_STATS_VERSION) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    numStats = data[1];
+    numHistograms = data[2];
+    numBuckets = data[3];
+    if (numStats < 0 || numHistograms < 0 || numBuckets < 0 ||
+        numStats > (cnt - 4) / 2 || numBuckets > cnt ||
+        numHistograms > (cnt - 4 - 2 * numStats) / (2 * (3 + numBuckets)) ||
+        cnt != 4 + 2 * numStats + 2 * numHistograms * (3 + numBuckets)) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+    data += 4;
+
+    for (i = 0; i < numStats; i++, data += 2) {
+        if (i < NVQR_NUM_STATS) {
+            stats->counters[i] = get_value(data);
+        }
+    }
+
+    for (i = 0; i < numHistograms && i < NVQR_NUM_HISTOGRAMS; i++) {
+        NVQRHistogram *h = &stats->histograms[i];
+
+        h->count = get_value(data);
+        h->sumUs = get_value(data + 2);
+        h->maxUs = get_value(data + 4);
+        data += 6;
+
+        for (j = 0; j < numBuckets; j++, data += 2) {
+            h->buckets[j < NVQR_HIST_BUCKETS ? j : NVQR_HIST_BUCKETS - 1] +=
+                get_value(data);
+        }
+    }
+
+    return NVQR_SUCCESS;
+}
+
+
+nvqrReturn_t nvqr_decode_history(const NVQRQueryData_t *data, int cnt,
+                                 NVQRHistorySample **samples, int *count)
+{
+    unsigned long long first;
+    int num, i, j;
+
+    *samples = NULL;
+    *count = 0;
+
+    if (cnt < NVQR_HISTORY_HEADER_LEN || data[0] != NVQR_HISTORY_VERSION ||
+        data[1] == 0) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    first = get_value(data + 2);
+    num = data[4];
+    if (num < 0 || num > (cnt - NVQR_HISTORY_HEADER_LEN) /
+                         NVQR_HISTORY_SAMPLE_LEN ||
+        cnt != NVQR_HISTORY_HEADER_LEN + num * NVQR_HISTORY_SAMPLE_LEN) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+    data += NVQR_HISTORY_HEADER_LEN;
+
+    if (num && !(*samples = calloc(num, sizeof(**samples)))) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    for (i = 0; i < num; i++, data += NVQR_HISTORY_SAMPLE_LEN) {
+        NVQRHistorySample *s = &(*samples)[i];
+
+        s->sequence = first + i;
+        s->timestampUs = (long long) get_value(data);
+        s->numDevices = data[2] < 0 ? 0 :
+                        data[2] > NVQR_HISTORY_MAX_DEVICES ?
+                        NVQR_HISTORY_MAX_DEVICES : data[2];
+        for (j = 0; j < NVQR_HISTORY_MAX_DEVICES; j++) {
+            s->devices[j].totalAllocs = data[3 + 3 * j];
+            s->devices[j].vidMemUsedkiB = data[4 + 3 * j];
+            s->devices[j].vidMemFreekiB = data[5 + 3 * j];
+        }
+    }
+
+    *count = num;
+    return NVQR_SUCCESS;
+}
+
+
+nvqrReturn_t nvqr_decode_peaks(const NVQRQueryData_t *data, int cnt,
+                               NVQRPeak **peaks, int *count)
+{
+    int num, i;
+
+    *peaks = NULL;
+    *count = 0;
+
+    if (cnt < NVQR_PEAKS_HEADER_LEN || data[0] != NVQR_PEAKS_VERSION) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    num = data[1];
+    if (num < 0 || num > (cnt - NVQR_PEAKS_HEADER_LEN) / NVQR_PEAK_LEN ||
+        cnt != NVQR_PEAKS_HEADER_LEN + num * NVQR_PEAK_LEN) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+    data += NVQR_PEAKS_HEADER_LEN;
+
+    if (num && !(*peaks = calloc(num, sizeof(**peaks)))) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    for (i = 0; i < num; i++, data += NVQR_PEAK_LEN) {
+        NVQRPeak *p = &(*peaks)[i];
+
+        p->kind = (NVQRPeakKind) data[0];
+        p->device = data[1];
+        p->id = data[2];
+        p->peakkiB = data[3];
+        p->timestampUs = (long long) get_value(data + 4);
+        memcpy(p->tag, data + 6, NVQR_PEAK_TAG_LEN);
+    }
+
+    *count = num;
+    return NVQR_SUCCESS;
+}
+
+#endif // _WIN32
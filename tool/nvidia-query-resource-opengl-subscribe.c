@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2015, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// Subscriptions to results pushed by the preload DSO. The pushed results are
+// delta responses, which are rebuilt with the delta state of the connection.
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#endif
+
+#include <GL/gl.h>
+
+#include "nvidia-query-resource-opengl.h"
+#include "nvidia-query-resource-opengl-ipc.h"
+#include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-internal.h"
+
+#if defined(_WIN32)
+
+// The driver's server on Windows only answers queries
+
+nvqrReturn_t nvqr_subscribe(NVQRConnection *connection, GLenum queryType,
+                            const NVQRSubscribeParams *params,
+                            NVQRQueryData_t **data, int *cnt)
+{
+    *data = NULL;
+    *cnt = 0;
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+nvqrReturn_t nvqr_wait_update(NVQRConnection *connection, int timeoutMs,
+                              NVQRQueryData_t **data, int *cnt)
+{
+    *data = NULL;
+    *cnt = 0;
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+nvqrReturn_t nvqr_unsubscribe(NVQRConnection *connection)
+{
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+
+#else
+
+// A subscribe command and the parameters that follow it
+typedef struct {
+    NVQRQueryCmdBuffer cmd;
+    NVQRSubscribeParams params;
+} NVQRSubscribeCmd;
+
+
+static bool is_subscribed(const NVQRConnection *connection)
+{
+    return connection->delta && connection->delta->subscribed;
+}
+
+
+static bool send_command(int fd, const void *buf, size_t len)
+{
+    size_t sent;
+    ssize_t ret;
+
+    for (sent = 0; sent < len; sent += ret) {
+        ret = nvqr_ipc_send(fd, (const char *) buf + sent, len - sent);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        } else if (ret <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Read the next response on a connection, waiting at most timeoutMs
+// milliseconds (or indefinitely, if negative) for it to start arriving. The
+// rest of a response that has started to arrive is always waited for.
+static nvqrReturn_t read_response(const NVQRConnection *connection,
+                                  int timeoutMs, NVQRResponseReader *reader)
+{
+    long long deadline = nvqr_ipc_get_time_us() + timeoutMs * 1000LL;
+    struct pollfd pfd;
+    nvqrReturn_t ret;
+    int ready;
+
+    memset(reader, 0, sizeof(*reader));
+    pfd.fd = connection->server_handle;
+    pfd.events = POLLIN;
+
+    do {
+        int wait = timeoutMs;
+
+        if (timeoutMs > 0) {
+            long long left = deadline - nvqr_ipc_get_time_us();
+
+            wait = left > 0 ? (int) ((left + 999) / 1000) : 0;
+        }
+        ready = poll(&pfd, 1, wait);
+    } while (ready < 0 && errno == EINTR);
+
+    if (ready == 0) {
+        return NVQR_ERROR_TIMEOUT;
+    }
+    if (ready < 0) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    // The socket blocks, so this only returns once the response is complete
+    do {
+        ret = nvqr_read_response_async(connection->server_handle, reader);
+    } while (ret == NVQR_IN_PROGRESS);
+
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+// Rebuild a pushed result from the delta response that has been read, and
+// return it in a newly heap-allocated buffer.
+static nvqrReturn_t apply_update(struct NVQRDeltaStateRec *delta,
+                                 NVQRResponseReader *reader,
+                                 NVQRQueryData_t **data, int *cnt)
+{
+    // Hand the response over rather than copying it
+    free(delta->response);
+    delta->response = reader->data;
+    delta->response_cap = reader->header.cnt;
+    reader->data = NULL;
+
+    return nvqr_apply_delta(delta, reader->header.cnt, data, cnt);
+}
+
+
+nvqrReturn_t nvqr_subscribe(NVQRConnection *connection, GLenum queryType,
+                            const NVQRSubscribeParams *params,
+                            NVQRQueryData_t **data, int *cnt)
+{
+    NVQRSubscribeCmd command;
+    NVQRResponseReader reader;
+    long long start;
+    nvqrReturn_t ret;
+
+    *data = NULL;
+    *cnt = 0;
+
+    if (!params || connection->async || connection->pipeline ||
+        is_subscribed(connection)) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Pushed results are delta responses
+    ret = nvqr_enable_delta(connection);
+    if (ret != NVQR_SUCCESS) {
+        return ret;
+    }
+
+    memset(&command, 0, sizeof(command));
+    command.cmd.op = NVQR_QUERY_SUBSCRIBE;
+    command.cmd.queryType = queryType;
+    command.params = *params;
+
+    start = nvqr_ipc_get_time_us();
+    memset(&reader, 0, sizeof(reader));
+    if (!send_command(connection->server_handle, &command, sizeof(command))) {
+        ret = NVQR_ERROR_UNKNOWN;
+    } else {
+        ret = read_response(connection, -1, &reader);
+    }
+
+    if (ret == NVQR_SUCCESS && reader.header.op == NVQR_QUERY_THROTTLED &&
+        reader.header.cnt >= 1) {
+        // The time after which to retry is the result
+        *data = reader.data;
+        *cnt = reader.header.cnt;
+        reader.data = NULL;
+        ret = NVQR_ERROR_THROTTLED;
+    } else if (ret == NVQR_SUCCESS &&
+               reader.header.op != NVQR_QUERY_SUBSCRIBE) {
+        ret = NVQR_ERROR_UNKNOWN;
+    } else if (ret == NVQR_SUCCESS) {
+        // The server starts over with a full result
+        connection->delta->cnt = 0;
+        connection->delta->reset = 0;
+        ret = apply_update(connection->delta, &reader, data, cnt);
+        connection->delta->subscribed = ret == NVQR_SUCCESS;
+    }
+
+    nvqr_record_request(connection->stats, ret, start, sizeof(command),
+                        reader.header_bytes + reader.data_bytes);
+    nvqr_reset_response_reader(&reader);
+    return ret;
+}
+
+
+nvqrReturn_t nvqr_wait_update(NVQRConnection *connection, int timeoutMs,
+                              NVQRQueryData_t **data, int *cnt)
+{
+    NVQRResponseReader reader;
+    nvqrReturn_t ret;
+
+    *data = NULL;
+    *cnt = 0;
+
+    if (!is_subscribed(connection)) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    ret = read_response(connection, timeoutMs, &reader);
+    if (ret == NVQR_SUCCESS) {
+        nvqr_count_client_stat(connection->stats,
+                               NVQR_CLIENT_STAT_BYTES_RECEIVED,
+                               reader.header_bytes + reader.data_bytes);
+        ret = reader.header.op == NVQR_QUERY_SUBSCRIBE ?
+              apply_update(connection->delta, &reader, data, cnt) :
+              NVQR_ERROR_UNKNOWN;
+    }
+
+    nvqr_reset_response_reader(&reader);
+    return ret;
+}
+
+
+nvqrReturn_t nvqr_unsubscribe(NVQRConnection *connection)
+{
+    NVQRQueryCmdBuffer cmd;
+    NVQRResponseReader reader;
+    size_t received = 0;
+    long long start;
+    nvqrReturn_t ret;
+    int op;
+
+    if (!is_subscribed(connection)) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = NVQR_QUERY_UNSUBSCRIBE;
+
+    start = nvqr_ipc_get_time_us();
+    if (!send_command(connection->server_handle, &cmd, sizeof(cmd))) {
+        ret = NVQR_ERROR_UNKNOWN;
+    } else {
+        // Skip the results pushed before the server got the command
+        do {
+            ret = read_response(connection, -1, &reader);
+            op = reader.header.op;
+            received += reader.header_bytes + reader.data_bytes;
+            nvqr_reset_response_reader(&reader);
+        } while (ret == NVQR_SUCCESS && op == NVQR_QUERY_SUBSCRIBE);
+
+        if (ret == NVQR_SUCCESS && op != NVQR_QUERY_UNSUBSCRIBE) {
+            ret = NVQR_ERROR_UNKNOWN;
+        }
+    }
+
+    // The server has forgotten the last result it pushed
+    connection->delta->subscribed = 0;
+    connection->delta->cnt = 0;
+
+    nvqr_record_request(connection->stats, ret, start, sizeof(cmd), received);
+    return ret;
+}
+
+#endif
@@ -33,10 +33,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
 #endif
 
 #include <GL/gl.h>
@@ -48,6 +51,7 @@
 #include "nvidia-query-resource-opengl.h"
 #include "nvidia-query-resource-opengl-ipc.h"
 #include "nvidia-query-resource-opengl-ipc-util.h"
+#include "nvidia-query-resource-opengl-internal.h"
 
 
 #if defined (_WIN32)
@@ -68,6 +72,17 @@ typedef size_t iosize_t;
 char *(*nvqr_strdup)(const char *src) = strdup;
 #endif // _WIN32
 
+// The number of bytes of a command, and of a response of cnt words, on the
+// wire, for the client statistics. Windows reads whole buffers.
+#if defined(_WIN32)
+#define COMMAND_SIZE NVQR_LEGACY_CMD_SIZE
+#define RESPONSE_SIZE(cnt) sizeof(NVQRQueryDataBuffer)
+#else
+#define COMMAND_SIZE sizeof(NVQRQueryCmdBuffer)
+#define RESPONSE_SIZE(cnt) (sizeof(NVQRQueryResponseHeader) + \
+                            (cnt) * sizeof(NVQRQueryData_t))
+#endif
+
 
 static pid_t get_my_pid(void)
 {
@@ -106,6 +121,7 @@ static bool open_server_connection(nvqr_handle_t *handle, pid_t pid)
         if (*handle == INVALID_HANDLE_VALUE &&
             GetLastError() == ERROR_PIPE_BUSY) {
             WaitNamedPipe((LPCSTR)(LPCSTR)name, 10000);
+            nvqr_count_client_stat(NULL, NVQR_CLIENT_STAT_RETRIES, 1);
         }
     }
     free(name);
@@ -114,7 +130,7 @@ static bool open_server_connection(nvqr_handle_t *handle, pid_t pid)
 #else
     bool connected = false;
 
-    *handle = socket(PF_UNIX, SOCK_STREAM, 0);
+    *handle = nvqr_ipc_socket();
     if (*handle != -1) {
         struct sockaddr_un addr;
         int len;
@@ -170,6 +186,29 @@ static bool open_client_connection(NVQRConnection *c)
 }
 
 
+#if !defined(_WIN32)
+//-----------------------------------------------------------------------------
+// Connections opened with nvqr_connect_async() are non-blocking; when one is
+// used with the blocking API, wait for the socket to become ready. Returns
+// TRUE if the caller should retry the operation.
+static bool wait_for_handle(nvqr_handle_t handle, short events)
+{
+    struct pollfd pfd;
+
+    if (errno == EINTR) {
+        return true;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+    }
+
+    pfd.fd = handle;
+    pfd.events = events;
+    return poll(&pfd, 1, -1) >= 0 || errno == EINTR;
+}
+#endif
+
+
 static iosize_t write_file(nvqr_handle_t handle, const void *buf, iosize_t len)
 {
     iosize_t bytes_written;
@@ -179,12 +218,83 @@ static iosize_t write_file(nvqr_handle_t handle, const void *buf, iosize_t len)
         bytes_written = 0;
     }
 #else
-    bytes_written = write(handle, buf, len);
+    ssize_t ret;
+
+    // Keep writing until everything is written, in case of short writes
+    for (bytes_written = 0; bytes_written < len; bytes_written += ret) {
+        ret = nvqr_ipc_send(handle, (const char *) buf + bytes_written,
+                            len - bytes_written);
+        if (ret < 0 && wait_for_handle(handle, POLLOUT)) {
+            ret = 0;
+        } else if (ret <= 0) {
+            break;
+        }
+    }
 #endif
     return bytes_written;
 }
 
 
+#if !defined(_WIN32)
+//-----------------------------------------------------------------------------
+// Read exactly len bytes, unless end-of-file or an error is encountered first.
+// Returns TRUE if all len bytes were read.
+static bool read_file(nvqr_handle_t handle, void *buf, size_t len)
+{
+    size_t bytes_read;
+    ssize_t ret;
+
+    for (bytes_read = 0; bytes_read < len; bytes_read += ret) {
+        ret = read(handle, (char *) buf + bytes_read, len - bytes_read);
+        if (ret < 0 && wait_for_handle(handle, POLLIN)) {
+            ret = 0;
+        } else if (ret <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Read cnt words of response data from the server, storing up to maxCnt of
+// them in data and discarding the rest.
+static bool read_response_data(nvqr_handle_t handle, NVQRQueryData_t *data,
+                               int cnt, int maxCnt)
+{
+    NVQRQueryData_t discard[256];
+
+    if (cnt <= maxCnt) {
+        return read_file(handle, data, cnt * sizeof(*data));
+    }
+
+    if (!read_file(handle, data, maxCnt * sizeof(*data))) {
+        return false;
+    }
+
+    for (cnt -= maxCnt; cnt > 0; cnt -= maxCnt) {
+        maxCnt = cnt < 256 ? cnt : 256;
+        if (!read_file(handle, discard, maxCnt * sizeof(*data))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Read a response header from the server and sanity check its length.
+static bool read_response_header(nvqr_handle_t handle,
+                                 NVQRQueryResponseHeader *header)
+{
+    return read_file(handle, header, sizeof(*header)) &&
+           header->cnt >= 0 && header->cnt <= NVQR_MAX_RESPONSE_LEN;
+}
+#endif
+
+
 static void close_file(nvqr_handle_t handle)
 {
 #if defined (_WIN32)
@@ -225,15 +335,30 @@ static void destroy_client(NVQRConnection c)
 //-----------------------------------------------------------------------------
 // Read a response from the server. This is done through the client handle
 // (a named pipe) on Windows, and the server handle (a domain socket) on Unix.
+// On Unix, the length of the response is given by its header; a response that
+// does not fit into the buffer is read in full, but only the first
+// NVQR_MAX_DATA_BUFFER_LEN words are kept, and buf->cnt is set to the full
+// length.
 static bool read_server_response(NVQRConnection c, NVQRQueryDataBuffer *buf) {
+#if defined (_WIN32)
     iosize_t bytesRead;
 
     memset(buf, 0, sizeof(*buf));
-#if defined (_WIN32)
     return ReadFile(c.client_handle, buf, sizeof(*buf), &bytesRead, NULL);
 #else
-    bytesRead = read(c.server_handle, buf, sizeof(*buf));
-    return bytesRead == sizeof(*buf);
+    NVQRQueryResponseHeader header;
+
+    memset(buf, 0, sizeof(*buf));
+    if (!read_response_header(c.server_handle, &header) ||
+        !read_response_data(c.server_handle, buf->data, header.cnt,
+                            NVQR_MAX_DATA_BUFFER_LEN)) {
+        return false;
+    }
+
+    buf->op = header.op;
+    buf->cnt = header.cnt;
+    buf->sampleAgeUs = header.sampleAgeUs;
+    return true;
 #endif
 }
 
@@ -249,7 +374,7 @@ static bool write_server_command(NVQRConnection c, NVQRqueryOp op,
     buf.queryType = queryType;
     buf.pid = pid;
 
-    ret = write_file(c.server_handle, &buf, sizeof(buf)) == sizeof(buf);
+    ret = write_file(c.server_handle, &buf, COMMAND_SIZE) == COMMAND_SIZE;
 
     flush_file(c.server_handle);
 
@@ -259,24 +384,33 @@ static bool write_server_command(NVQRConnection c, NVQRqueryOp op,
 
 //-----------------------------------------------------------------------------
 // Send NVQR_QUERY_CONNECT to the server and verify that it ACKs with
-// NVQR_QUERY_CONNECT. Returns TRUE on success; FALSE on failure.
-static bool connect_to_server(NVQRConnection *conn)
+// NVQR_QUERY_CONNECT.
+static nvqrReturn_t connect_to_server(NVQRConnection *conn)
 {
     NVQRQueryDataBuffer data;
-    bool ret = write_server_command(*conn, NVQR_QUERY_CONNECT, 0, get_my_pid());
 
-    if (ret) {
-        ret = open_client_connection(conn);
+    if (!write_server_command(*conn, NVQR_QUERY_CONNECT, 0, get_my_pid())) {
+#if defined(_WIN32)
+        return NVQR_ERROR_UNKNOWN;
+#else
+        // A server refusing the connection answers before reading the
+        // command, and shuts the socket down, so the response can still be
+        // read
+#endif
+    }
 
-        if (ret) {
-            if (!read_server_response(*conn, &data) ||
-                data.op != NVQR_QUERY_CONNECT) {
-                close_client_connection(*conn);
-            }
-        }
+    if (!open_client_connection(conn)) {
+        return NVQR_ERROR_UNKNOWN;
     }
 
-    return ret;
+    if (!read_server_response(*conn, &data) ||
+        data.op != NVQR_QUERY_CONNECT) {
+        close_client_connection(*conn);
+        return data.op == NVQR_QUERY_THROTTLED ? NVQR_ERROR_THROTTLED
+                                               : NVQR_ERROR_UNKNOWN;
+    }
+
+    return NVQR_SUCCESS;
 }
 
 
@@ -286,20 +420,739 @@ static void close_server_connection(nvqr_handle_t handle)
 }
 
 
+#if defined(_WIN32)
+nvqrReturn_t nvqr_enable_pipelining(NVQRConnection *connection)
+{
+    return NVQR_ERROR_NOT_SUPPORTED;
+}
+#else
+//-----------------------------------------------------------------------------
+// A request in flight on a connection shared between threads, waiting for the
+// response with its requestId.
+typedef struct NVQRPendingRequestRec {
+    int requestId;
+    bool done;
+    nvqrReturn_t result;
+    NVQRQueryResponseHeader header;
+    NVQRQueryData_t *data;
+    struct NVQRPendingRequestRec *next;
+} NVQRPendingRequest;
+
+//-----------------------------------------------------------------------------
+// The state of a connection shared between threads. Commands are written
+// whole under write_lock; the responses are read by whichever waiting thread
+// gets to it first, which hands each one to the request it belongs to.
+struct NVQRPipelineStateRec {
+    pthread_mutex_t write_lock;
+    pthread_mutex_t lock;       // protects the fields below
+    pthread_cond_t cond;
+    int next_id;
+    bool reading;
+    bool failed;
+    NVQRPendingRequest *pending;
+};
+
+
+nvqrReturn_t nvqr_enable_pipelining(NVQRConnection *connection)
+{
+    struct NVQRPipelineStateRec *pipeline;
+
+    if (connection->async || connection->delta) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (connection->pipeline) {
+        return NVQR_SUCCESS;
+    }
+
+    pipeline = calloc(1, sizeof(*pipeline));
+    if (!pipeline) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    pthread_mutex_init(&pipeline->write_lock, NULL);
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    connection->pipeline = pipeline;
+
+    return NVQR_SUCCESS;
+}
+
+
+static void free_pipeline(struct NVQRPipelineStateRec *pipeline)
+{
+    if (pipeline) {
+        pthread_mutex_destroy(&pipeline->write_lock);
+        pthread_mutex_destroy(&pipeline->lock);
+        pthread_cond_destroy(&pipeline->cond);
+        free(pipeline);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// Fail all requests in flight on a shared connection, and any further ones:
+// once a command or response is cut short, the stream cannot be trusted.
+static void fail_pipeline(struct NVQRPipelineStateRec *pipeline)
+{
+    NVQRPendingRequest *req;
+
+    for (req = pipeline->pending; req; req = req->next) {
+        req->done = true;
+    }
+
+    pipeline->pending = NULL;
+    pipeline->failed = true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Read one response from a shared connection and hand it to its request.
+// Called with pipeline->lock held, which is dropped while reading.
+static void read_pipelined_response(NVQRConnection c)
+{
+    struct NVQRPipelineStateRec *pipeline = c.pipeline;
+    NVQRPendingRequest **link;
+    NVQRQueryResponseHeader header;
+    NVQRQueryData_t *data = NULL;
+    bool ok;
+
+    pipeline->reading = true;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    ok = read_response_header(c.server_handle, &header);
+    if (ok) {
+        // Allocate at least one word, so that success always yields a buffer
+        data = malloc((header.cnt ? header.cnt : 1) * sizeof(*data));
+        ok = read_response_data(c.server_handle, data, header.cnt,
+                                data ? header.cnt : 0);
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->reading = false;
+    pthread_cond_broadcast(&pipeline->cond);
+
+    for (link = &pipeline->pending; ok && *link; link = &(*link)->next) {
+        NVQRPendingRequest *req = *link;
+
+        if (req->requestId == header.requestId) {
+            *link = req->next;
+            req->header = header;
+            req->data = data;
+            req->result = data ? NVQR_SUCCESS : NVQR_ERROR_UNKNOWN;
+            req->done = true;
+            return;
+        }
+    }
+
+    free(data);
+    fail_pipeline(pipeline);
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a command on a shared connection and wait for the response to it.
+static nvqrReturn_t pipelined_request(NVQRConnection c,
+                                      NVQRQueryCmdBuffer *cmd, iosize_t len,
+                                      NVQRQueryResponseHeader *header,
+                                      NVQRQueryData_t **data)
+{
+    struct NVQRPipelineStateRec *pipeline = c.pipeline;
+    NVQRPendingRequest req;
+    bool sent;
+
+    memset(&req, 0, sizeof(req));
+    req.result = NVQR_ERROR_UNKNOWN;
+
+    // Register the request before sending it, so its response finds it
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->failed) {
+        pthread_mutex_unlock(&pipeline->lock);
+        return NVQR_ERROR_UNKNOWN;
+    }
+    pipeline->next_id = pipeline->next_id % INT_MAX + 1;
+    req.requestId = cmd->requestId = pipeline->next_id;
+    req.next = pipeline->pending;
+    pipeline->pending = &req;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pthread_mutex_lock(&pipeline->write_lock);
+    sent = write_file(c.server_handle, cmd, len) == len;
+    pthread_mutex_unlock(&pipeline->write_lock);
+
+    pthread_mutex_lock(&pipeline->lock);
+    if (!sent) {
+        fail_pipeline(pipeline);
+    }
+    while (!req.done) {
+        if (pipeline->reading) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        } else {
+            read_pipelined_response(c);
+        }
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    *header = req.header;
+    *data = req.data;
+    return req.result;
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a command on a connection that is not shared, and read the response.
+static nvqrReturn_t lockstep_request(NVQRConnection c,
+                                     NVQRQueryCmdBuffer *cmd, iosize_t len,
+                                     NVQRQueryResponseHeader *header,
+                                     NVQRQueryData_t **data)
+{
+    if (write_file(c.server_handle, cmd, len) != len ||
+        !read_response_header(c.server_handle, header)) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    // Allocate at least one word, so that success always yields a buffer
+    *data = malloc((header->cnt ? header->cnt : 1) * sizeof(**data));
+    if (!*data) {
+        read_response_data(c.server_handle, NULL, header->cnt, 0);
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    if (!read_response_data(c.server_handle, *data, header->cnt,
+                            header->cnt)) {
+        free(*data);
+        *data = NULL;
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    return NVQR_SUCCESS;
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a command of len bytes, which starts with an NVQRQueryCmdBuffer, and
+// read the response to it into a newly heap-allocated *data buffer. If the
+// command is throttled, the buffer holds the time after which to retry it.
+static nvqrReturn_t request(NVQRConnection c, NVQRQueryCmdBuffer *cmd,
+                           iosize_t len, NVQRQueryResponseHeader *header,
+                           NVQRQueryData_t **data)
+{
+    long long start = nvqr_ipc_get_time_us();
+    nvqrReturn_t ret;
+
+    *data = NULL;
+
+    // Subscribed connections only take pushed results
+    if (c.delta && c.delta->subscribed) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (c.pipeline) {
+        ret = pipelined_request(c, cmd, len, header, data);
+    } else {
+        ret = lockstep_request(c, cmd, len, header, data);
+    }
+
+    // A throttled command gets the time after which to retry it
+    if (ret == NVQR_SUCCESS && header->op == NVQR_QUERY_THROTTLED) {
+        ret = header->cnt >= 1 ? NVQR_ERROR_THROTTLED : NVQR_ERROR_UNKNOWN;
+    }
+
+    nvqr_record_request(c.stats, ret, start, len,
+                        *data ? RESPONSE_SIZE(header->cnt) : 0);
+    return ret;
+}
+
+
+//-----------------------------------------------------------------------------
+// Perform a resource query, returning the result in a newly heap-allocated
+// buffer.
+static nvqrReturn_t request_meminfo_alloc(NVQRConnection c, GLenum queryType,
+                                          NVQRQueryData_t **data, int *cnt,
+                                          int *sampleAgeUs)
+{
+    NVQRQueryCmdBuffer cmd;
+    NVQRQueryResponseHeader header;
+    nvqrReturn_t ret;
+
+    *cnt = 0;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = NVQR_QUERY_MEMORY_INFO;
+    cmd.queryType = queryType;
+
+    ret = request(c, &cmd, sizeof(cmd), &header, data);
+    if (ret == NVQR_ERROR_THROTTLED) {
+        *cnt = header.cnt;
+    }
+    if (ret != NVQR_SUCCESS) {
+        return ret;
+    }
+
+    if (header.op != NVQR_QUERY_MEMORY_INFO) {
+        free(*data);
+        *data = NULL;
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    *cnt = header.cnt;
+    if (sampleAgeUs) {
+        *sampleAgeUs = header.sampleAgeUs;
+    }
+    return NVQR_SUCCESS;
+}
+
+
+//-----------------------------------------------------------------------------
+// Send NVQR_QUERY_MEMORY_INFO_DELTA to the server, and rebuild the result from
+// the response. If an earlier delta query failed, have the server forget the
+// result it sent last, so that it sends a full one. The bytes transferred are
+// added to *sent and *received.
+static nvqrReturn_t exchange_delta(NVQRConnection c, GLenum queryType,
+                                   NVQRQueryData_t **data, int *cnt,
+                                   int *sampleAgeUs, size_t *sent,
+                                   size_t *received)
+{
+    struct NVQRDeltaStateRec *delta = c.delta;
+    NVQRQueryResponseHeader header;
+
+    if (delta->reset) {
+        nvqr_count_client_stat(c.stats, NVQR_CLIENT_STAT_RETRIES, 1);
+        *sent += COMMAND_SIZE;
+        if (!write_server_command(c, NVQR_QUERY_DELTA_RESET, 0, 0) ||
+            !read_response_header(c.server_handle, &header) ||
+            !read_response_data(c.server_handle, NULL, header.cnt, 0) ||
+            header.op != NVQR_QUERY_DELTA_RESET) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+        *received += RESPONSE_SIZE(header.cnt);
+        delta->cnt = 0;
+        delta->reset = 0;
+    }
+
+    // Until the response has been applied, the two sides may be out of step
+    delta->reset = 1;
+
+    *sent += COMMAND_SIZE;
+    if (!write_server_command(c, NVQR_QUERY_MEMORY_INFO_DELTA, queryType, 0) ||
+        !read_response_header(c.server_handle, &header)) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+    *received += RESPONSE_SIZE(header.cnt);
+
+    if (header.cnt > delta->response_cap) {
+        NVQRQueryData_t *response = realloc(delta->response,
+                                            header.cnt * sizeof(*response));
+
+        if (!response) {
+            read_response_data(c.server_handle, NULL, header.cnt, 0);
+            return NVQR_ERROR_UNKNOWN;
+        }
+        delta->response = response;
+        delta->response_cap = header.cnt;
+    }
+
+    if (!read_response_data(c.server_handle, delta->response, header.cnt,
+                            header.cnt)) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    // The server leaves its side alone when it throttles the query
+    if (header.op == NVQR_QUERY_THROTTLED && header.cnt >= 1) {
+        *data = malloc(header.cnt * sizeof(**data));
+        if (!*data) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+        memcpy(*data, delta->response, header.cnt * sizeof(**data));
+        *cnt = header.cnt;
+        delta->reset = 0;
+        return NVQR_ERROR_THROTTLED;
+    }
+
+    if (header.op != NVQR_QUERY_MEMORY_INFO_DELTA ||
+        nvqr_apply_delta(delta, header.cnt, data, cnt) != NVQR_SUCCESS) {
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    delta->reset = 0;
+    if (sampleAgeUs) {
+        *sampleAgeUs = header.sampleAgeUs;
+    }
+    return NVQR_SUCCESS;
+}
+
+
+static nvqrReturn_t request_meminfo_delta(NVQRConnection c, GLenum queryType,
+                                          NVQRQueryData_t **data, int *cnt,
+                                          int *sampleAgeUs)
+{
+    long long start = nvqr_ipc_get_time_us();
+    size_t sent = 0, received = 0;
+    nvqrReturn_t ret;
+
+    *data = NULL;
+    *cnt = 0;
+
+    if (c.delta->subscribed) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    ret = exchange_delta(c, queryType, data, cnt, sampleAgeUs, &sent,
+                         &received);
+    nvqr_record_request(c.stats, ret, start, sent, received);
+    return ret;
+}
+#endif
+
+
 //-----------------------------------------------------------------------------
 // Send NVQR_QUERY_MEMINFO to the server and verify that it ACKs with
 // NVQR_QUERY_MEMINFO. Pass the meminfo read from the server back to the caller.
 nvqrReturn_t nvqr_request_meminfo(NVQRConnection c, GLenum queryType,
                                          NVQRQueryDataBuffer *buf)
 {
+    nvqrReturn_t ret = NVQR_ERROR_UNKNOWN;
+    long long start;
+
+#if !defined(_WIN32)
+    if (c.delta || c.pipeline) {
+        NVQRQueryData_t *data;
+        int cnt, age = 0;
+
+        memset(buf, 0, sizeof(*buf));
+        if (c.delta) {
+            ret = request_meminfo_delta(c, queryType, &data, &cnt, &age);
+        } else {
+            ret = request_meminfo_alloc(c, queryType, &data, &cnt, &age);
+        }
+        if (ret == NVQR_ERROR_THROTTLED) {
+            buf->op = NVQR_QUERY_THROTTLED;
+            buf->cnt = 1;
+            buf->data[0] = data[0];
+            free(data);
+            return ret;
+        }
+        if (ret != NVQR_SUCCESS) {
+            return ret;
+        }
+
+        buf->op = NVQR_QUERY_MEMORY_INFO;
+        buf->cnt = cnt;
+        buf->sampleAgeUs = age;
+        memcpy(buf->data, data, (cnt < NVQR_MAX_DATA_BUFFER_LEN ? cnt :
+                                 NVQR_MAX_DATA_BUFFER_LEN) * sizeof(*data));
+        free(data);
+
+        return cnt <= NVQR_MAX_DATA_BUFFER_LEN ?
+               NVQR_SUCCESS : NVQR_ERROR_INSUFFICIENT_BUFFER;
+    }
+#endif
+
+    start = nvqr_ipc_get_time_us();
     if (write_server_command(c, NVQR_QUERY_MEMORY_INFO, queryType, 0) &&
         read_server_response(c, buf) &&
         buf->op == NVQR_QUERY_MEMORY_INFO)
     {
-        return NVQR_SUCCESS;
+        ret = buf->cnt <= NVQR_MAX_DATA_BUFFER_LEN ?
+              NVQR_SUCCESS : NVQR_ERROR_INSUFFICIENT_BUFFER;
+    } else if (buf->op == NVQR_QUERY_THROTTLED && buf->cnt >= 1) {
+        ret = NVQR_ERROR_THROTTLED;
     }
 
-    return NVQR_ERROR_UNKNOWN;
+    nvqr_record_request(c.stats, ret, start, COMMAND_SIZE,
+                        ret != NVQR_ERROR_UNKNOWN ? RESPONSE_SIZE(buf->cnt)
+                                                  : 0);
+    return ret;
+}
+
+
+nvqrReturn_t nvqr_request_meminfo_alloc(NVQRConnection c, GLenum queryType,
+                                        NVQRQueryData_t **data, int *cnt)
+{
+#if defined (_WIN32)
+    NVQRQueryDataBuffer *buf = malloc(sizeof(*buf));
+    nvqrReturn_t ret = NVQR_ERROR_UNKNOWN;
+
+    *data = NULL;
+    *cnt = 0;
+
+    if (buf) {
+        ret = nvqr_request_meminfo(c, queryType, buf);
+        if (ret == NVQR_SUCCESS) {
+            // The data starts the buffer, so hand it out in place
+            memmove(buf, buf->data, buf->cnt * sizeof(buf->data[0]));
+            *data = (NVQRQueryData_t *) buf;
+            *cnt = buf->cnt;
+        } else {
+            free(buf);
+        }
+    }
+
+    return ret;
+#else
+    if (c.delta) {
+        return request_meminfo_delta(c, queryType, data, cnt, NULL);
+    }
+
+    return request_meminfo_alloc(c, queryType, data, cnt, NULL);
+#endif
+}
+
+
+#if !defined(_WIN32)
+nvqrReturn_t nvqr_decode_batch_response(const NVQRQueryData_t *data, int cnt,
+                                        const GLenum *queryTypes, int count,
+                                        NVQRBatchResult *results)
+{
+    int i, pos = 0;
+
+    for (i = 0; i < count; i++) {
+        int len;
+
+        if (cnt - pos < 2 || data[pos] != (NVQRQueryData_t) queryTypes[i]) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+
+        len = data[pos + 1];
+        if (len < 0 || len > cnt - pos - 2) {
+            return NVQR_ERROR_UNKNOWN;
+        }
+
+        results[i].queryType = queryTypes[i];
+        results[i].result = len ? NVQR_SUCCESS : NVQR_ERROR_UNKNOWN;
+        results[i].data = len ? data + pos + 2 : NULL;
+        results[i].cnt = len;
+        pos += 2 + len;
+    }
+
+    return pos == cnt ? NVQR_SUCCESS : NVQR_ERROR_UNKNOWN;
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a batch command (NVQR_QUERY_BATCH or NVQR_QUERY_ONESHOT), followed by
+// its query types, and read and decode the response.
+static nvqrReturn_t request_batch(NVQRConnection c, NVQRqueryOp op,
+                                  const GLenum *queryTypes, int count,
+                                  NVQRBatchResult *results,
+                                  NVQRQueryData_t **buffer)
+{
+    struct {
+        NVQRQueryCmdBuffer cmd;
+        int types[NVQR_MAX_BATCH_TYPES];
+    } cmd;
+    iosize_t len = sizeof(cmd.cmd) + count * sizeof(cmd.types[0]);
+    NVQRQueryResponseHeader header;
+    nvqrReturn_t ret;
+    int i;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cmd.op = op;
+    cmd.cmd.queryType = count;
+    cmd.cmd.pid = get_my_pid();
+    for (i = 0; i < count; i++) {
+        cmd.types[i] = queryTypes[i];
+    }
+
+    ret = request(c, &cmd.cmd, len, &header, buffer);
+    if (ret != NVQR_SUCCESS) {
+        return ret == NVQR_ERROR_THROTTLED ? ret : NVQR_ERROR_UNKNOWN;
+    }
+
+    if (header.op != op ||
+        nvqr_decode_batch_response(*buffer, header.cnt, queryTypes, count,
+                                   results) != NVQR_SUCCESS) {
+        free(*buffer);
+        *buffer = NULL;
+        return NVQR_ERROR_UNKNOWN;
+    }
+
+    return NVQR_SUCCESS;
+}
+
+
+static bool valid_batch(const GLenum *queryTypes, int count,
+                        NVQRBatchResult *results, NVQRQueryData_t **buffer)
+{
+    return queryTypes && results && buffer &&
+           count > 0 && count <= NVQR_MAX_BATCH_TYPES;
+}
+#endif
+
+
+nvqrReturn_t nvqr_request_meminfo_batch(NVQRConnection c,
+                                        const GLenum *queryTypes, int count,
+                                        NVQRBatchResult *results,
+                                        NVQRQueryData_t **buffer)
+{
+#if defined(_WIN32)
+    return NVQR_ERROR_NOT_SUPPORTED;
+#else
+    if (!valid_batch(queryTypes, count, results, buffer) || c.async) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    return request_batch(c, NVQR_QUERY_BATCH, queryTypes, count, results,
+                         buffer);
+#endif
+}
+
+
+nvqrReturn_t nvqr_query_oneshot(pid_t pid, const GLenum *queryTypes,
+                                int count, NVQRBatchResult *results,
+                                NVQRQueryData_t **buffer)
+{
+#if defined(_WIN32)
+    return NVQR_ERROR_NOT_SUPPORTED;
+#else
+    NVQRConnection c;
+    nvqrReturn_t ret;
+
+    if (!valid_batch(queryTypes, count, results, buffer)) {
+        return NVQR_ERROR_INVALID_ARGUMENT;
+    }
+
+    memset(&c, 0, sizeof(c));
+    if (!open_server_connection(&c.server_handle, pid)) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    ret = request_batch(c, NVQR_QUERY_ONESHOT, queryTypes, count, results,
+                        buffer);
+    close_server_connection(c.server_handle);
+
+    return ret;
+#endif
+}
+
+
+nvqrReturn_t nvqr_query_stats(pid_t pid, NVQRServerStats *stats)
+{
+#if defined(_WIN32)
+    return NVQR_ERROR_NOT_SUPPORTED;
+#else
+    NVQRConnection c;
+    NVQRQueryCmdBuffer cmd;
+    NVQRQueryResponseHeader header;
+    NVQRQueryData_t *data;
+    nvqrReturn_t ret;
+
+    memset(stats, 0, sizeof(*stats));
+
+    memset(&c, 0, sizeof(c));
+    if (!open_server_connection(&c.server_handle, pid)) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = NVQR_QUERY_STATS;
+    cmd.pid = get_my_pid();
+
+    ret = request(c, &cmd, sizeof(cmd), &header, &data);
+    close_server_connection(c.server_handle);
+
+    if (ret == NVQR_SUCCESS) {
+        ret = header.op == NVQR_QUERY_STATS ?
+              nvqr_decode_stats(data, header.cnt, stats) : NVQR_ERROR_UNKNOWN;
+    }
+    free(data);
+
+    return ret;
+#endif
+}
+
+
+#if !defined(_WIN32)
+
+// NVQR_QUERY_HISTORY, followed by the number of the first sample wanted
+typedef struct {
+    NVQRQueryCmdBuffer cmd;
+    int since[2];
+} NVQRHistoryCmd;
+
+#endif
+
+
+nvqrReturn_t nvqr_query_history(pid_t pid, unsigned long long since,
+                                NVQRHistorySample **samples, int *count)
+{
+#if defined(_WIN32)
+    *samples = NULL;
+    *count = 0;
+    return NVQR_ERROR_NOT_SUPPORTED;
+#else
+    NVQRConnection c;
+    NVQRHistoryCmd command;
+    NVQRQueryResponseHeader header;
+    NVQRQueryData_t *data;
+    nvqrReturn_t ret;
+
+    *samples = NULL;
+    *count = 0;
+
+    memset(&c, 0, sizeof(c));
+    if (!open_server_connection(&c.server_handle, pid)) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    memset(&command, 0, sizeof(command));
+    command.cmd.op = NVQR_QUERY_HISTORY;
+    command.cmd.pid = get_my_pid();
+    command.since[0] = (int) (since & 0xffffffff);
+    command.since[1] = (int) (since >> 32);
+
+    ret = request(c, &command.cmd, sizeof(command), &header, &data);
+    close_server_connection(c.server_handle);
+
+    if (ret == NVQR_SUCCESS) {
+        ret = header.op == NVQR_QUERY_HISTORY ?
+              nvqr_decode_history(data, header.cnt, samples, count) :
+              NVQR_ERROR_UNKNOWN;
+    }
+    free(data);
+
+    return ret;
+#endif
+}
+
+
+nvqrReturn_t nvqr_query_peaks(pid_t pid, NVQRPeak **peaks, int *count)
+{
+#if defined(_WIN32)
+    *peaks = NULL;
+    *count = 0;
+    return NVQR_ERROR_NOT_SUPPORTED;
+#else
+    NVQRConnection c;
+    NVQRQueryCmdBuffer cmd;
+    NVQRQueryResponseHeader header;
+    NVQRQueryData_t *data;
+    nvqrReturn_t ret;
+
+    *peaks = NULL;
+    *count = 0;
+
+    memset(&c, 0, sizeof(c));
+    if (!open_server_connection(&c.server_handle, pid)) {
+        return NVQR_ERROR_NOT_SUPPORTED;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = NVQR_QUERY_PEAKS;
+    cmd.pid = get_my_pid();
+
+    ret = request(c, &cmd, sizeof(cmd), &header, &data);
+    close_server_connection(c.server_handle);
+
+    if (ret == NVQR_SUCCESS) {
+        ret = header.op == NVQR_QUERY_PEAKS ?
+              nvqr_decode_peaks(data, header.cnt, peaks, count) :
+              NVQR_ERROR_UNKNOWN;
+    }
+    free(data);
+
+    return ret;
+#endif
 }
 
 
@@ -310,9 +1163,18 @@ static bool disconnect_from_server(NVQRConnection c)
 {
     NVQRQueryDataBuffer data;
 
-    return write_server_command(c, NVQR_QUERY_DISCONNECT, 0, 0) &&
-                            read_server_response(c, &data) &&
-                            data.op == NVQR_QUERY_DISCONNECT;
+    if (!write_server_command(c, NVQR_QUERY_DISCONNECT, 0, 0)) {
+        return false;
+    }
+
+    // Skip the results pushed to a subscribed connection in the meantime
+    do {
+        if (!read_server_response(c, &data)) {
+            return false;
+        }
+    } while (data.op == NVQR_QUERY_SUBSCRIBE);
+
+    return data.op == NVQR_QUERY_DISCONNECT;
 }
 
 
@@ -321,7 +1183,7 @@ static bool disconnect_from_server(NVQRConnection c)
 // determine the name of the process with the given PID. Strip all file path
 // components except the last and return the process name to the caller in a
 // newly heap-allocated buffer, or return NULL on error.
-static char *process_name_from_pid(int pid)
+char *nvqr_process_name_from_pid(pid_t pid)
 {
     char *name = NULL;
 #if defined (_WIN32)
@@ -343,13 +1205,21 @@ static char *process_name_from_pid(int pid)
         }
         CloseHandle(hTHSnap);
     }
+#elif defined (__linux)
+    static const char directory_separator = '/';
+    NVQRProcessInfo info;
+
+    // Served from the process metadata cache where possible
+    if (nvqr_get_process_info(pid, &info) == NVQR_SUCCESS) {
+        name = strdup(info.name);
+    }
 #else
 // Format string to determine the name of a procfs file to read
 #if defined (__sun) && defined (__SVR4)
 // Solaris exposes process info through a psinfo_t structure in a "psinfo" file
 #define PROCFILE_FMT_STRING "/proc/%ld/psinfo"
 #else
-// FreeBSD and Linux expose the command line of a process in a "cmdline" file
+// FreeBSD exposes the command line of a process in a "cmdline" file
 #define PROCFILE_FMT_STRING "/proc/%ld/cmdline"
 #endif
 
@@ -374,19 +1244,17 @@ static char *process_name_from_pid(int pid)
             name = strdup(psinfo.pr_fname);
         }
 #else
-        int namelen;
-        char c;
-
-        // neither fstat(2) nor lseek(fd, 0, SEEK_END) seem to work for finding
-        // the length of a /proc/$pid/cmdline file, so just crawl the file to
-        // find the length of argv[0] for the target process id.
-        for (namelen = 0; read(fd, &c, 1) == 1 && c; namelen++);
-        lseek(fd, 0, SEEK_SET);
-
-        name = calloc(namelen + 1, 1);
-        if (name && read(fd, name, namelen) != namelen) {
-            free(name);
-            name = NULL;
+        char buf[4096];
+        ssize_t bytes;
+
+        // neither fstat(2) nor lseek(fd, 0, SEEK_END) work for finding the
+        // length of a /proc/$pid/cmdline file, but the whole file is generated
+        // on the first read, so read it in one go; argv[0] is the first NUL
+        // terminated string in it.
+        bytes = read(fd, buf, sizeof(buf) - 1);
+        if (bytes >= 0) {
+            buf[bytes] = '\0';
+            name = strdup(buf);
         }
 #endif // __sun && __SVR4
         close(fd);
@@ -412,36 +1280,79 @@ static char *process_name_from_pid(int pid)
 
 nvqrReturn_t nvqr_connect(NVQRConnection *connection, pid_t pid)
 {
+    long long start = nvqr_ipc_get_time_us();
+    nvqrReturn_t ret;
+
     memset(connection, 0, sizeof(*connection));
     connection->pid = pid;
-    connection->process_name = process_name_from_pid(pid);
+    connection->process_name = nvqr_process_name_from_pid(pid);
 
     if (!create_client(connection)) {
+        nvqr_record_connect(NULL, NVQR_ERROR_UNKNOWN, start, 0, 0);
         return NVQR_ERROR_UNKNOWN;
     }
 
     if (!open_server_connection(&(connection->server_handle), pid)) {
         destroy_client(*connection);
+        nvqr_record_connect(NULL, NVQR_ERROR_NOT_SUPPORTED, start, 0, 0);
         return NVQR_ERROR_NOT_SUPPORTED;
     }
 
-    if (!connect_to_server(connection)) {
+    ret = connect_to_server(connection);
+    if (ret != NVQR_SUCCESS) {
         destroy_client(*connection);
         close_server_connection(connection->server_handle);
-        return NVQR_ERROR_UNKNOWN;
+        nvqr_record_connect(NULL, ret, start, COMMAND_SIZE, 0);
+        return ret;
     }
 
+    connection->stats = nvqr_new_connection_stats();
+    nvqr_record_connect(connection->stats, NVQR_SUCCESS, start, COMMAND_SIZE,
+                        RESPONSE_SIZE(0));
     return NVQR_SUCCESS;
 }
 
 
+#if !defined(_WIN32)
+void nvqr_abandon_connection(NVQRConnection *connection)
+{
+    nvqr_free_delta(connection->delta);
+    connection->delta = NULL;
+    free_pipeline(connection->pipeline);
+    connection->pipeline = NULL;
+
+    close_server_connection(connection->server_handle);
+    free(connection->process_name);
+    connection->process_name = NULL;
+    nvqr_free_connection_stats(connection->stats);
+    connection->stats = NULL;
+}
+#endif
+
+
 nvqrReturn_t nvqr_disconnect(NVQRConnection *connection)
 {
+#if !defined(_WIN32)
+    if (connection->async) {
+        nvqr_close_async(connection);
+        free(connection->process_name);
+        return NVQR_SUCCESS;
+    }
+#endif
+
+#if !defined(_WIN32)
+    nvqr_free_delta(connection->delta);
+    connection->delta = NULL;
+    free_pipeline(connection->pipeline);
+    connection->pipeline = NULL;
+#endif
+
     if (disconnect_from_server(*connection)) {
         close_client_connection(*connection);
         destroy_client(*connection);
         close_server_connection(connection->server_handle);
         free(connection->process_name);
+        nvqr_free_connection_stats(connection->stats);
         return NVQR_SUCCESS;
     }
 